@@ -0,0 +1,2365 @@
+/*  Reference counted dynamic string and string containers.
+    Copyright 2012 John Abrahamsen <jhnabrhmsn@gmail.com>
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the
+    "Software"), to deal in the Software without restriction, including
+    without limitation the rights to use, copy, modify, merge, publish,
+    distribute, sublicense, and/or sell copies of the Software, and to
+    permit persons to whom the Software is furnished to do so, subject to
+    the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+    LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+    OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+/* Benchmark harness. Every benchmark is run at several input sizes. Each run
+   is a number of samples, taken after a few warmup samples, where a sample
+   times a batch of operations with CLOCK_MONOTONIC. The batch size is
+   calibrated so a sample takes at least BENCH_SAMPLE_NS, or longer for
+   benchmarks with a fixed cost per sample. Reported figures are
+   nanoseconds per operation: minimum, median and 99th percentile over all
+   samples. Benchmarks may name a baseline listed before them, e.g.
+   plain malloc and memcpy, to which their median is compared. Sizes are
+   bytes for string benchmarks and elements for container benchmarks, where
+   one operation works on the whole container. Concurrent benchmarks take
+   the number of threads as size, an operation is then done by any of the
+   threads, so near linear scaling shows as time per operation falling in
+   proportion to the thread count.
+
+   On Linux the timed samples are also measured with perf_event_open
+   hardware counters: cycles, instructions, L1 data cache read misses, last
+   level cache misses and branch misses. These are reported as instructions
+   per cycle and misses per element. Counters the kernel or hardware does
+   not provide are left out of the report.
+
+   Every public operation has a benchmark, except for:
+   - constant time accessors and reference counting, e.g. dstr_length,
+     dstr_at, dstr_empty, dstr_vector_size, dstr_builder_length and
+     dstr_incref, which most benchmarks run anyway.
+   - variants sharing all of their code with a benchmarked function:
+     dstr_vector_push_front_decref, dstr_builder_add_decref,
+     dstr_vector_join_wrap, dstr_list_to_dstr_wrap, dstr_rcu_publish_vector
+     and dstr_rcu_defer_vector_decref.
+   - setup and teardown differing from the benchmarked one only in how the
+     object is made: dstr_reader_with_bufsize, dstr_tokenizer_with_delimsn,
+     dstr_csv_new, dstr_csv_mmap, dstr_pool_new and dstr_pool_free.
+   - diagnostics and configuration: dstr_print, dstr_version,
+     dstr_profile_dump, dstr_profile_rate, dstr_stats_snapshot,
+     dstr_thread_cache_budget, dstr_thread_cache_flush and the
+     DSTR_MEM_CLEAR helpers dstr_safe_memset, dstr_safe_realloc and
+     dstr_safe_free.
+
+   Usage: dstr_bench [-r samples] [-f filter] [-j file.json]   */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include "dstr.h"
+
+#define BENCH_WARMUP 3
+#define BENCH_SAMPLES 31
+#define BENCH_SAMPLE_NS 200000L
+/* Long enough to hide waking up to 32 threads for every sample.   */
+#define BENCH_THREAD_SAMPLE_NS 20000000L
+
+typedef struct bench{
+    const char *name;
+    const char *baseline; /* Name of benchmark to compare with, or 0. */
+    const size_t *sizes; /* Zero terminated. */
+    void *(*setup)(size_t size);
+    void (*run)(void *ctx, size_t size, long iters);
+    void (*teardown)(void *ctx);
+    long sample_ns; /* Minimum sample time, 0 for BENCH_SAMPLE_NS. */
+} bench;
+
+enum {
+    BENCH_CYCLES,
+    BENCH_INSTRUCTIONS,
+    BENCH_L1D_MISSES,
+    BENCH_LLC_MISSES,
+    BENCH_BRANCH_MISSES,
+    BENCH_COUNTERS
+};
+
+typedef struct bench_result{
+    const bench *b;
+    size_t size;
+    long iters; /* Operations per sample. */
+    int samples;
+    double min_ns, p50_ns, p99_ns;
+    double counts[BENCH_COUNTERS]; /* Totals over all samples, -1 if missing. */
+} bench_result;
+
+static const size_t str_sizes[] = { 16, 256, 4096, 0 };
+static const size_t vec_sizes[] = { 16, 1024, 65536, 0 };
+/* Thread counts, for benchmarks of concurrent containers.   */
+static const size_t thread_sizes[] = { 1, 2, 4, 8, 16, 32, 0 };
+
+/* Keeps results alive so the compiler can not drop benchmark bodies.   */
+static volatile size_t bench_sink;
+
+static char *bench_text(size_t size)
+{
+    char *text = malloc(size + 1);
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        text[i] = 'a' + (i * 7) % 26;
+    text[size] = '\0';
+    return text;
+}
+
+static long bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*                            HARDWARE COUNTERS                             */
+
+static const char *counter_names[BENCH_COUNTERS] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"
+};
+static int counter_fd[BENCH_COUNTERS];
+
+static void counters_open()
+{
+    int i;
+#ifdef __linux__
+    struct perf_event_attr attr;
+    static const unsigned int type[BENCH_COUNTERS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+    };
+    static const unsigned long long config[BENCH_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+
+    for (i = 0; i < BENCH_COUNTERS; i++){
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type[i];
+        attr.config = config[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        /* Counters may be multiplexed, times are used to scale them.   */
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+            PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counter_fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#else
+    for (i = 0; i < BENCH_COUNTERS; i++)
+        counter_fd[i] = -1;
+#endif
+}
+
+static int counters_available()
+{
+    int i;
+
+    for (i = 0; i < BENCH_COUNTERS; i++){
+        if (counter_fd[i] >= 0)
+            return 1;
+    }
+    return 0;
+}
+
+static void counters_start()
+{
+#ifdef __linux__
+    int i;
+
+    for (i = 0; i < BENCH_COUNTERS; i++){
+        if (counter_fd[i] < 0)
+            continue;
+        ioctl(counter_fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static void counters_stop(double *counts)
+{
+    int i;
+#ifdef __linux__
+    unsigned long long value[3]; /* Count, time enabled, time running. */
+
+    for (i = 0; i < BENCH_COUNTERS; i++){
+        counts[i] = -1;
+        if (counter_fd[i] < 0)
+            continue;
+        ioctl(counter_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter_fd[i], value, sizeof(value)) != sizeof(value) ||
+                !value[2])
+            continue;
+        counts[i] = (double)value[0] * value[1] / value[2];
+    }
+#else
+    for (i = 0; i < BENCH_COUNTERS; i++)
+        counts[i] = -1;
+#endif
+}
+
+static void counters_close()
+{
+    int i;
+
+    for (i = 0; i < BENCH_COUNTERS; i++){
+        if (counter_fd[i] >= 0)
+            close(counter_fd[i]);
+    }
+}
+
+/*                             STRING BENCHMARKS                            */
+
+static void *setup_text(size_t size)
+{
+    return bench_text(size);
+}
+
+static void *setup_dstr(size_t size)
+{
+    char *text = bench_text(size);
+    dstr *str = dstr_with_initial(text);
+    free(text);
+    return str;
+}
+
+static void teardown_dstr(void *ctx)
+{
+    dstr_decref(ctx);
+}
+
+static void run_baseline_malloc_copy(void *ctx, size_t size, long iters)
+{
+    char *cpy;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        cpy = malloc(size + 1);
+        memcpy(cpy, ctx, size + 1);
+        bench_sink += cpy[size / 2];
+        free(cpy);
+    }
+}
+
+static void run_with_initial(void *ctx, size_t size, long iters)
+{
+    dstr *str;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        str = dstr_with_initial(ctx);
+        bench_sink += dstr_length(str);
+        dstr_decref(str);
+    }
+}
+
+/* Payload in a malloc'd buffer passed through a string and back.   */
+static void run_buffer_copy(void *ctx, size_t size, long iters)
+{
+    char *buf, *out;
+    dstr *str;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        buf = malloc(size + 1);
+        memcpy(buf, ctx, size + 1);
+        str = dstr_with_initialn(buf, size);
+        free(buf);
+        out = dstr_copy_to_cstr(str);
+        dstr_decref(str);
+        bench_sink += out[size / 2];
+        free(out);
+    }
+}
+
+static void run_adopt_release(void *ctx, size_t size, long iters)
+{
+    char *buf, *out;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        buf = dstr_malloc(size + 1);
+        memcpy(buf, ctx, size + 1);
+        out = dstr_release(dstr_adopt(buf, size, size + 1), 0);
+        bench_sink += out[size / 2];
+        dstr_free(out);
+    }
+}
+
+static void run_copy(void *ctx, size_t size, long iters)
+{
+    dstr *str;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        str = dstr_copy(ctx);
+        bench_sink += dstr_length(str);
+        dstr_decref(str);
+    }
+}
+
+static void run_copy_to_cstr(void *ctx, size_t size, long iters)
+{
+    char *cstr;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        cstr = dstr_copy_to_cstr(ctx);
+        bench_sink += cstr[0];
+        free(cstr);
+    }
+}
+
+static void run_with_initialn(void *ctx, size_t size, long iters)
+{
+    dstr *str;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        str = dstr_with_initialn(ctx, size);
+        bench_sink += dstr_length(str);
+        dstr_decref(str);
+    }
+}
+
+static void run_with_prealloc(void *ctx, size_t size, long iters)
+{
+    dstr *str;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        str = dstr_with_prealloc(size + 1);
+        dstr_append_cstrn(str, ctx, size);
+        bench_sink += dstr_length(str);
+        dstr_decref(str);
+    }
+}
+
+/* Appending benchmarks build up to 64 pieces, then start over.   */
+typedef struct append_ctx{
+    char *buf;
+    size_t sz;
+    char *text;
+    dstr *dest;
+    dstr *src;
+} append_ctx;
+
+static void *setup_append(size_t size)
+{
+    append_ctx *ctx = malloc(sizeof(append_ctx));
+    ctx->text = bench_text(size);
+    ctx->buf = malloc(size * 64 + 1);
+    ctx->sz = 0;
+    ctx->dest = dstr_new();
+    ctx->src = dstr_with_initial(ctx->text);
+    return ctx;
+}
+
+static void teardown_append(void *arg)
+{
+    append_ctx *ctx = arg;
+    free(ctx->text);
+    free(ctx->buf);
+    dstr_decref(ctx->dest);
+    dstr_decref(ctx->src);
+    free(ctx);
+}
+
+static void run_baseline_memcpy_append(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        if (ctx->sz == size * 64)
+            ctx->sz = 0;
+        memcpy(ctx->buf + ctx->sz, ctx->text, size);
+        ctx->sz += size;
+        ctx->buf[ctx->sz] = '\0';
+    }
+    bench_sink += ctx->sz;
+}
+
+static void run_append_cstr(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        if (dstr_length(ctx->dest) == size * 64)
+            dstr_resize(ctx->dest, 0);
+        dstr_append_cstr(ctx->dest, ctx->text);
+    }
+}
+
+static void run_append(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        if (dstr_length(ctx->dest) == size * 64)
+            dstr_resize(ctx->dest, 0);
+        dstr_append(ctx->dest, ctx->src);
+    }
+}
+
+/* Header line built from constant strings, created per use.   */
+static void run_header_with_initial(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    dstr *name, *sep;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        if (dstr_length(ctx->dest) >= size * 64)
+            dstr_resize(ctx->dest, 0);
+        name = dstr_with_initial("Content-Type");
+        sep = dstr_with_initial(": ");
+        dstr_append(ctx->dest, name);
+        dstr_append(ctx->dest, sep);
+        dstr_append(ctx->dest, ctx->src);
+        dstr_decref(name);
+        dstr_decref(sep);
+    }
+}
+
+static void run_header_literal(void *arg, size_t size, long iters)
+{
+    static dstr name = DSTR_LITERAL("Content-Type");
+    static dstr sep = DSTR_LITERAL(": ");
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        if (dstr_length(ctx->dest) >= size * 64)
+            dstr_resize(ctx->dest, 0);
+        dstr_incref(&name);
+        dstr_append(ctx->dest, &name);
+        dstr_append(ctx->dest, &sep);
+        dstr_append(ctx->dest, ctx->src);
+        dstr_decref(&name);
+    }
+}
+
+static void run_prepend(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        if (dstr_length(ctx->dest) == size * 64)
+            dstr_resize(ctx->dest, 0);
+        dstr_prepend(ctx->dest, ctx->src);
+    }
+}
+
+static void run_append_decref(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        if (dstr_length(ctx->dest) == size * 64)
+            dstr_resize(ctx->dest, 0);
+        dstr_incref(ctx->src);
+        dstr_append_decref(ctx->dest, ctx->src);
+    }
+}
+
+static void run_prepend_cstr(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        if (dstr_length(ctx->dest) == size * 64)
+            dstr_resize(ctx->dest, 0);
+        dstr_prepend_cstr(ctx->dest, ctx->text);
+    }
+}
+
+static void run_prepend_cstrn(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        if (dstr_length(ctx->dest) == size * 64)
+            dstr_resize(ctx->dest, 0);
+        dstr_prepend_cstrn(ctx->dest, ctx->text, size);
+    }
+}
+
+static void run_prepend_decref(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        if (dstr_length(ctx->dest) == size * 64)
+            dstr_resize(ctx->dest, 0);
+        dstr_incref(ctx->src);
+        dstr_prepend_decref(ctx->dest, ctx->src);
+    }
+}
+
+static void run_swap(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_swap(ctx->dest, ctx->src);
+        bench_sink += dstr_length(ctx->dest);
+    }
+}
+
+/* Grows the capacity to 64 pieces and gives it back.   */
+static void run_reserve_compact(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_reserve(ctx->dest, size * 64);
+        dstr_compact(ctx->dest);
+    }
+    bench_sink += dstr_capacity(ctx->dest);
+}
+
+static void run_resize_fill(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_resize_fill(ctx->dest, size, '-');
+        bench_sink += dstr_length(ctx->dest);
+        dstr_resize(ctx->dest, 0);
+    }
+}
+
+static void run_sprintf(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        if (dstr_length(ctx->dest) > size * 64)
+            dstr_resize(ctx->dest, 0);
+        dstr_sprintf(ctx->dest, "%ld,", i * 2654435761L);
+    }
+}
+
+static void run_append_i64(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        if (dstr_length(ctx->dest) > size * 64)
+            dstr_resize(ctx->dest, 0);
+        dstr_append_i64(ctx->dest, i * 2654435761L);
+        dstr_append_cstrn(ctx->dest, ",", 1);
+    }
+}
+
+static void run_append_u64_hex(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        if (dstr_length(ctx->dest) > size * 64)
+            dstr_resize(ctx->dest, 0);
+        dstr_append_u64_hex(ctx->dest, (uint64_t)i * 2654435761u);
+        dstr_append_cstrn(ctx->dest, ",", 1);
+    }
+}
+
+static void run_append_double(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        if (dstr_length(ctx->dest) > size * 64)
+            dstr_resize(ctx->dest, 0);
+        dstr_append_double(ctx->dest, i * 0.001 + 1.0 / 3.0);
+    }
+}
+
+static void run_sprintf_double(void *arg, size_t size, long iters)
+{
+    append_ctx *ctx = arg;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        if (dstr_length(ctx->dest) > size * 64)
+            dstr_resize(ctx->dest, 0);
+        dstr_sprintf(ctx->dest, "%.17g", i * 0.001 + 1.0 / 3.0);
+    }
+}
+
+static void *setup_number(size_t size)
+{
+    return dstr_with_initial("-1234567890123");
+}
+
+static void run_to_i64(void *ctx, size_t size, long iters)
+{
+    int64_t value;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_to_i64(ctx, &value);
+        bench_sink += value;
+    }
+}
+
+static void run_baseline_strtoll(void *ctx, size_t size, long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++)
+        bench_sink += strtoll(dstr_to_cstr_const(ctx), 0, 10);
+}
+
+static void *setup_double(size_t size)
+{
+    return dstr_with_initial("-12345.6789012345e-3");
+}
+
+static void run_to_double(void *ctx, size_t size, long iters)
+{
+    double value;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_to_double(ctx, &value);
+        bench_sink += (long)value;
+    }
+}
+
+static void run_baseline_strtod(void *ctx, size_t size, long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++)
+        bench_sink += (long)strtod(dstr_to_cstr_const(ctx), 0);
+}
+
+static void run_case_convert(void *ctx, size_t size, long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_to_upper(ctx);
+        dstr_to_lower(ctx);
+    }
+}
+
+static void run_capitalize(void *ctx, size_t size, long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_capitalize(ctx);
+        bench_sink += dstr_to_cstr_const(ctx)[0];
+    }
+}
+
+static void run_clear(void *ctx, size_t size, long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++)
+        dstr_clear(ctx);
+    bench_sink += dstr_length(ctx);
+}
+
+static void *setup_utf8(size_t size)
+{
+    static const char piece[] = "Gr\xC3\xBC\xC3\x9F" "e, \xE4\xB8\x96\xE7\x95\x8C \xF0\x9F\x98\x80 ";
+    dstr *str = dstr_with_prealloc(size + sizeof(piece));
+
+    while (dstr_length(str) + sizeof(piece) - 1 <= size)
+        dstr_append_cstr(str, piece);
+    while (dstr_length(str) < size)
+        dstr_append_cstr(str, "a");
+    return str;
+}
+
+static void run_utf8_valid(void *ctx, size_t size, long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++)
+        bench_sink += dstr_utf8_valid_cstrn(dstr_to_cstr_const(ctx),
+                                            dstr_length(ctx));
+}
+
+static void run_utf8_length(void *ctx, size_t size, long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++)
+        bench_sink += dstr_utf8_length(ctx);
+}
+
+static void run_baseline_strlen(void *ctx, size_t size, long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++)
+        bench_sink += strlen(dstr_to_cstr_const(ctx));
+}
+
+static void run_utf8_substr(void *ctx, size_t size, long iters)
+{
+    size_t n = dstr_utf8_length(ctx);
+    dstr *sub;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        sub = dstr_utf8_substr(ctx, n / 4, n / 2);
+        bench_sink += dstr_length(sub);
+        dstr_decref(sub);
+    }
+}
+
+/* Truncating benchmarks copy the text back in before every cut, compare
+   with dstr_swap.   */
+static void run_utf8_truncate(void *ctx, size_t size, long iters)
+{
+    size_t n = dstr_utf8_length(ctx);
+    dstr *str = dstr_with_prealloc(size + 1);
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_swap(str, ctx);
+        dstr_utf8_truncate(str, n / 2);
+        bench_sink += dstr_length(str);
+    }
+    dstr_decref(str);
+}
+
+static void run_utf8_truncate_bytes(void *ctx, size_t size, long iters)
+{
+    dstr *str = dstr_with_prealloc(size + 1);
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_swap(str, ctx);
+        dstr_utf8_truncate_bytes(str, size / 2);
+        bench_sink += dstr_length(str);
+    }
+    dstr_decref(str);
+}
+
+/* Encoding benchmarks convert size input bytes, the output is reused.   */
+struct codec_ctx {
+    unsigned char *bytes;
+    dstr *base64;
+    dstr *hex;
+    dstr *out;
+};
+
+static void *setup_codec(size_t size)
+{
+    struct codec_ctx *ctx = malloc(sizeof(*ctx));
+    size_t i;
+
+    ctx->bytes = malloc(size);
+    for (i = 0; i < size; i++)
+        ctx->bytes[i] = (unsigned char)(i * 131 + 7);
+    ctx->base64 = dstr_new();
+    ctx->hex = dstr_new();
+    ctx->out = dstr_with_prealloc(2 * size + 64);
+    dstr_append_base64(ctx->base64, ctx->bytes, size);
+    dstr_append_hex(ctx->hex, ctx->bytes, size);
+    return ctx;
+}
+
+static void teardown_codec(void *p)
+{
+    struct codec_ctx *ctx = p;
+
+    free(ctx->bytes);
+    dstr_decref(ctx->base64);
+    dstr_decref(ctx->hex);
+    dstr_decref(ctx->out);
+    free(ctx);
+}
+
+static void run_baseline_hex_encode(void *p, size_t size, long iters)
+{
+    static const char digits[] = "0123456789abcdef";
+    struct codec_ctx *ctx = p;
+    char *out = (char *)dstr_to_cstr_const(ctx->out);
+    size_t j;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        for (j = 0; j < size; j++){
+            out[2 * j] = digits[ctx->bytes[j] >> 4];
+            out[2 * j + 1] = digits[ctx->bytes[j] & 0xF];
+        }
+        bench_sink += out[size];
+    }
+}
+
+static void run_hex_encode(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_resize(ctx->out, 0);
+        bench_sink += dstr_append_hex(ctx->out, ctx->bytes, size);
+    }
+}
+
+static void run_hex_decode(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_resize(ctx->out, 0);
+        bench_sink += dstr_decode_hex(ctx->out, dstr_to_cstr_const(ctx->hex),
+                                      dstr_length(ctx->hex));
+    }
+}
+
+static void run_base64_encode(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_resize(ctx->out, 0);
+        bench_sink += dstr_append_base64(ctx->out, ctx->bytes, size);
+    }
+}
+
+static void run_base64_decode(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_resize(ctx->out, 0);
+        bench_sink += dstr_decode_base64(ctx->out, dstr_to_cstr_const(ctx->base64),
+                                         dstr_length(ctx->base64));
+    }
+}
+
+/* Escaping benchmarks use text with a quote, a space and a newline
+   every 64 bytes. The hex member holds the URL encoded text.   */
+static void *setup_escape(size_t size)
+{
+    struct codec_ctx *ctx = setup_codec(0);
+    size_t i;
+
+    free(ctx->bytes);
+    ctx->bytes = (unsigned char *)bench_text(size);
+    for (i = 0; i < size; i += 64){
+        ctx->bytes[i] = '"';
+        if (i + 20 < size)
+            ctx->bytes[i + 20] = ' ';
+        if (i + 40 < size)
+            ctx->bytes[i + 40] = '\n';
+    }
+    dstr_resize(ctx->out, 0);
+    dstr_append_url_encoded(ctx->out, (char *)ctx->bytes, size);
+    dstr_append(ctx->hex, ctx->out);
+    return ctx;
+}
+
+static void run_baseline_json_bytewise(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    const char *c;
+    size_t j;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_resize(ctx->out, 0);
+        for (j = 0; j < size; j++){
+            c = (const char *)ctx->bytes + j;
+            if (*c == '"')
+                dstr_append_cstrn(ctx->out, "\\\"", 2);
+            else if (*c == '\n')
+                dstr_append_cstrn(ctx->out, "\\n", 2);
+            else
+                dstr_append_cstrn(ctx->out, c, 1);
+        }
+        bench_sink += dstr_length(ctx->out);
+    }
+}
+
+static void run_json_escaped(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_resize(ctx->out, 0);
+        bench_sink += dstr_append_json_escaped(ctx->out, (char *)ctx->bytes, size);
+    }
+}
+
+static void run_url_encoded(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_resize(ctx->out, 0);
+        bench_sink += dstr_append_url_encoded(ctx->out, (char *)ctx->bytes, size);
+    }
+}
+
+static void run_url_decode(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_resize(ctx->out, 0);
+        bench_sink += dstr_url_decode(ctx->out, dstr_to_cstr_const(ctx->hex),
+                                      dstr_length(ctx->hex));
+    }
+}
+
+/* Replace benchmarks substitute a placeholder found every 64 bytes.   */
+static void *setup_template(size_t size)
+{
+    struct codec_ctx *ctx = setup_codec(0);
+    size_t i;
+
+    free(ctx->bytes);
+    ctx->bytes = (unsigned char *)bench_text(size);
+    for (i = 0; i + 8 <= size; i += 64)
+        memcpy(ctx->bytes + i, "{{name}}", 8);
+    dstr_append_cstr(ctx->hex, (char *)ctx->bytes);
+    return ctx;
+}
+
+static void run_baseline_erase_insert(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    const char *at;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_swap(ctx->out, ctx->hex);
+        while ((at = strstr(dstr_to_cstr_const(ctx->out), "{{name}}"))){
+            size_t pos = at - dstr_to_cstr_const(ctx->out);
+            dstr_erase(ctx->out, pos, pos + 8);
+            dstr_insert_cstr(ctx->out, "a longer value", pos);
+        }
+        bench_sink += dstr_length(ctx->out);
+    }
+}
+
+static void run_replace_all(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_swap(ctx->out, ctx->hex);
+        bench_sink += dstr_replace_all(ctx->out, "{{name}}", "a longer value");
+    }
+}
+
+static void run_replace_all_shrink(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_swap(ctx->out, ctx->hex);
+        bench_sink += dstr_replace_all(ctx->out, "{{name}}", "value");
+    }
+}
+
+static void run_replace_all_pairs(void *p, size_t size, long iters)
+{
+    static const char *const pairs[] = {
+        "{{name}}", "a longer value", "{{none}}", "value"
+    };
+    struct codec_ctx *ctx = p;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_swap(ctx->out, ctx->hex);
+        bench_sink += dstr_replace_all_pairs(ctx->out, pairs, 2);
+    }
+}
+
+static void run_insert_erase(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    dstr_swap(ctx->out, ctx->hex);
+    for (i = 0; i < iters; i++){
+        dstr_insert_cstr(ctx->out, "inserted", size / 2);
+        bench_sink += dstr_erase(ctx->out, size / 2, size / 2 + 8);
+    }
+}
+
+static void run_insert_cstrn_erase(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    dstr_swap(ctx->out, ctx->hex);
+    for (i = 0; i < iters; i++){
+        dstr_insert_cstrn(ctx->out, "inserted", size / 2, 8);
+        bench_sink += dstr_erase(ctx->out, size / 2, size / 2 + 8);
+    }
+}
+
+static void run_insert_dstr_erase(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    dstr *str = dstr_with_initial("inserted");
+    long i;
+
+    dstr_swap(ctx->out, ctx->hex);
+    for (i = 0; i < iters; i++){
+        dstr_insert(ctx->out, str, size / 2);
+        bench_sink += dstr_erase(ctx->out, size / 2, size / 2 + 8);
+    }
+    dstr_decref(str);
+}
+
+/* Trim benchmarks strip size / 4 bytes of whitespace from each end.   */
+static void *setup_padded(size_t size)
+{
+    struct codec_ctx *ctx = setup_codec(0);
+    size_t i;
+
+    for (i = 0; i < size / 4; i++)
+        dstr_append_cstr(ctx->hex, i % 8 ? " " : "\t");
+    for (i = 0; i < size / 2; i++)
+        dstr_append_cstr(ctx->hex, "x");
+    for (i = 0; i < size / 4; i++)
+        dstr_append_cstr(ctx->hex, i % 8 ? " " : "\n");
+    return ctx;
+}
+
+static void run_baseline_erase_trim(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_swap(ctx->out, ctx->hex);
+        while (dstr_length(ctx->out) &&
+               isspace((unsigned char)dstr_to_cstr_const(ctx->out)[0]))
+            dstr_erase(ctx->out, 0, 1);
+        while (dstr_length(ctx->out) &&
+               isspace((unsigned char)dstr_to_cstr_const(ctx->out)[dstr_length(ctx->out) - 1]))
+            dstr_erase(ctx->out, dstr_length(ctx->out) - 1, dstr_length(ctx->out));
+        bench_sink += dstr_length(ctx->out);
+    }
+}
+
+static void run_trim(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_swap(ctx->out, ctx->hex);
+        bench_sink += dstr_trim(ctx->out);
+    }
+}
+
+static void run_ltrim(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_swap(ctx->out, ctx->hex);
+        bench_sink += dstr_ltrim(ctx->out);
+    }
+}
+
+static void run_rtrim(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_swap(ctx->out, ctx->hex);
+        bench_sink += dstr_rtrim(ctx->out);
+    }
+}
+
+static void run_trim_chars(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_swap(ctx->out, ctx->hex);
+        bench_sink += dstr_trim_chars(ctx->out, " \t\n");
+    }
+}
+
+static void run_ltrim_rtrim_chars(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_swap(ctx->out, ctx->hex);
+        bench_sink += dstr_ltrim_chars(ctx->out, " \t\n");
+        bench_sink += dstr_rtrim_chars(ctx->out, " \t\n");
+    }
+}
+
+static void run_trim_view(void *p, size_t size, long iters)
+{
+    struct codec_ctx *ctx = p;
+    const char *data;
+    size_t n;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        data = dstr_to_cstr_const(ctx->hex);
+        n = dstr_length(ctx->hex);
+        dstr_trim_view(&data, &n);
+        bench_sink += n;
+    }
+}
+
+/* Search benchmarks look for a needle placed at the end of the text.   */
+static void *setup_haystack(size_t size)
+{
+    dstr *str = setup_dstr(size);
+    dstr_append_cstr(str, "needle");
+    return str;
+}
+
+static void run_contains(void *ctx, size_t size, long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++)
+        bench_sink += dstr_contains(ctx, "needle");
+}
+
+static void run_baseline_strstr(void *ctx, size_t size, long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++)
+        bench_sink += strstr(dstr_to_cstr_const(ctx), "needle") != 0;
+}
+
+static void run_starts_ends_with(void *ctx, size_t size, long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++){
+        bench_sink += dstr_starts_with(ctx, "ahov");
+        bench_sink += dstr_ends_with(ctx, "needle");
+    }
+}
+
+static void run_contains_dstr(void *ctx, size_t size, long iters)
+{
+    dstr *needle = dstr_with_initial("needle");
+    long i;
+
+    for (i = 0; i < iters; i++)
+        bench_sink += dstr_contains_dstr(ctx, needle);
+    dstr_decref(needle);
+}
+
+static void run_starts_ends_with_dstr(void *ctx, size_t size, long iters)
+{
+    dstr *starts = dstr_with_initial("ahov");
+    dstr *ends = dstr_with_initial("needle");
+    long i;
+
+    for (i = 0; i < iters; i++){
+        bench_sink += dstr_starts_with_dstr(ctx, starts);
+        bench_sink += dstr_ends_with_dstr(ctx, ends);
+    }
+    dstr_decref(starts);
+    dstr_decref(ends);
+}
+
+static void run_matches(void *ctx, size_t size, long iters)
+{
+    char *same = dstr_copy_to_cstr(ctx);
+    long i;
+
+    for (i = 0; i < iters; i++)
+        bench_sink += dstr_matches(ctx, same);
+    free(same);
+}
+
+/* Split benchmarks split a comma separated text of size elements.   */
+static void *setup_csv(size_t size)
+{
+    dstr *str = dstr_new();
+    size_t i;
+
+    for (i = 0; i < size; i++){
+        if (i)
+            dstr_append_cstr(str, ",");
+        dstr_append_cstr(str, "field");
+        dstr_append_u64(str, i);
+    }
+    return str;
+}
+
+static void run_split_to_vector(void *ctx, size_t size, long iters)
+{
+    dstr_vector *vec;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        vec = dstr_split_to_vector(ctx, ",");
+        bench_sink += dstr_vector_size(vec);
+        dstr_vector_decref(vec);
+    }
+}
+
+static void run_tokenizer_split(void *ctx, size_t size, long iters)
+{
+    dstr_tokenizer *tok = dstr_tokenizer_new(",", 0);
+    dstr_vector *vec;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        vec = dstr_tokenizer_split(tok, ctx);
+        bench_sink += dstr_vector_size(vec);
+        dstr_vector_decref(vec);
+    }
+    dstr_tokenizer_free(tok);
+}
+
+static void run_tokenizer_views(void *ctx, size_t size, long iters)
+{
+    dstr_tokenizer *tok = dstr_tokenizer_new(" \t,;|", DSTR_TOKENIZER_COLLAPSE);
+    const char *token;
+    size_t n;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_tokenizer_reset(tok, dstr_to_cstr_const(ctx), dstr_length(ctx));
+        while (dstr_tokenizer_next_view(tok, &token, &n))
+            bench_sink += n;
+    }
+    dstr_tokenizer_free(tok);
+}
+
+static void run_tokenizer_next(void *ctx, size_t size, long iters)
+{
+    dstr_tokenizer *tok = dstr_tokenizer_new(",", 0);
+    dstr *token;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_tokenizer_reset(tok, dstr_to_cstr_const(ctx), dstr_length(ctx));
+        while ((token = dstr_tokenizer_next(tok))){
+            bench_sink += dstr_length(token);
+            dstr_decref(token);
+        }
+    }
+    dstr_tokenizer_free(tok);
+}
+
+/* CSV benchmarks parse size rows of five fields, one of them quoted.   */
+static void *setup_csv_rows(size_t size)
+{
+    dstr *str = dstr_new();
+    size_t i;
+
+    for (i = 0; i < size; i++){
+        dstr_append_u64(str, i);
+        dstr_append_cstr(str, ",2024-01-01T00:00:00Z,\"Doe, John\",");
+        dstr_append_u64(str, i * 7919);
+        dstr_append_cstr(str, ",some free text in the last column\n");
+    }
+    return str;
+}
+
+static void run_csv_rows(void *ctx, size_t size, long iters)
+{
+    dstr_vector *row = dstr_vector_new();
+    dstr_csv *csv;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        csv = dstr_csv_with_buffer(dstr_to_cstr_const(ctx), dstr_length(ctx), ',');
+        while (dstr_csv_next_row(csv, row) == 1)
+            bench_sink += dstr_vector_size(row);
+        dstr_csv_free(csv);
+    }
+    dstr_vector_decref(row);
+}
+
+static void run_csv_views(void *ctx, size_t size, long iters)
+{
+    const dstr_csv_field *fields;
+    dstr_csv *csv;
+    size_t n;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        csv = dstr_csv_with_buffer(dstr_to_cstr_const(ctx), dstr_length(ctx), ',');
+        while (dstr_csv_next_row_views(csv, &fields, &n) == 1)
+            bench_sink += n;
+        dstr_csv_free(csv);
+    }
+}
+
+static void run_split_to_list(void *ctx, size_t size, long iters)
+{
+    dstr_list *list;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        list = dstr_split_to_list(ctx, ",");
+        bench_sink += list->head != 0;
+        dstr_list_decref(list);
+    }
+}
+
+/*                              LIST BENCHMARKS                             */
+
+static void *setup_list(size_t size)
+{
+    dstr_list *list = dstr_list_new();
+    size_t i;
+
+    for (i = 0; i < size; i++){
+        dstr *str = dstr_with_initial("list element ");
+        dstr_append_u64(str, i);
+        dstr_list_add_decref(list, str);
+    }
+    return list;
+}
+
+static void teardown_list(void *ctx)
+{
+    dstr_list_decref(ctx);
+}
+
+static void run_list_add(void *ctx, size_t size, long iters)
+{
+    dstr *str = dstr_with_initial("element");
+    dstr_list *list;
+    long i;
+    size_t j;
+
+    for (i = 0; i < iters; i++){
+        list = dstr_list_new();
+        for (j = 0; j < size; j++)
+            dstr_list_add(list, str);
+        dstr_list_decref(list);
+    }
+    dstr_decref(str);
+}
+
+static void __count_callback(dstr *str, void *total)
+{
+    *(size_t *)total += dstr_length(str);
+}
+
+static void run_list_traverse(void *ctx, size_t size, long iters)
+{
+    size_t total = 0;
+    long i;
+
+    for (i = 0; i < iters; i++)
+        dstr_list_traverse(ctx, __count_callback, &total);
+    bench_sink += total;
+}
+
+static void run_list_to_dstr(void *ctx, size_t size, long iters)
+{
+    dstr *str;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        str = dstr_list_to_dstr(",", ctx);
+        bench_sink += dstr_length(str);
+        dstr_decref(str);
+    }
+}
+
+static void run_list_bencode(void *ctx, size_t size, long iters)
+{
+    dstr *str;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        str = dstr_list_bencode(ctx);
+        bench_sink += dstr_length(str);
+        dstr_decref(str);
+    }
+}
+
+static void run_list_search_contains(void *ctx, size_t size, long iters)
+{
+    dstr_list *found;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        found = dstr_list_search_contains(ctx, "99");
+        bench_sink += found->head != 0;
+        dstr_list_decref(found);
+    }
+}
+
+static void run_list_search_contains_dstr(void *ctx, size_t size, long iters)
+{
+    dstr *needle = dstr_with_initial("99");
+    dstr_list *found;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        found = dstr_list_search_contains_dstr(ctx, needle);
+        bench_sink += found->head != 0;
+        dstr_list_decref(found);
+    }
+    dstr_decref(needle);
+}
+
+static void run_list_add_remove(void *ctx, size_t size, long iters)
+{
+    dstr *str = dstr_with_initial("element");
+    dstr_list *list = ctx;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_list_add(list, str);
+        dstr_list_remove(list, list->tail);
+    }
+    dstr_decref(str);
+}
+
+static void run_list_traverse_reverse(void *ctx, size_t size, long iters)
+{
+    size_t total = 0;
+    long i;
+
+    for (i = 0; i < iters; i++)
+        dstr_list_traverse_reverse(ctx, __count_callback, &total);
+    bench_sink += total;
+}
+
+static void run_list_size(void *ctx, size_t size, long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++)
+        bench_sink += dstr_list_size(ctx);
+}
+
+static int __delete_callback(dstr *str)
+{
+    return 1;
+}
+
+static void run_list_traverse_delete(void *ctx, size_t size, long iters)
+{
+    dstr *str = dstr_with_initial("element");
+    dstr_list *list;
+    long i;
+    size_t j;
+
+    for (i = 0; i < iters; i++){
+        list = dstr_list_new();
+        for (j = 0; j < size; j++)
+            dstr_list_add(list, str);
+        dstr_list_traverse_delete(list, __delete_callback);
+        bench_sink += list->head != 0;
+        dstr_list_decref(list);
+    }
+    dstr_decref(str);
+}
+
+static void *setup_list_bencoded(size_t size)
+{
+    dstr_list *list = setup_list(size);
+    dstr *str = dstr_list_bencode(list);
+    dstr_list_decref(list);
+    return str;
+}
+
+static void run_list_bdecode(void *ctx, size_t size, long iters)
+{
+    dstr_list *list;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        list = dstr_list_bdecode(dstr_to_cstr_const(ctx));
+        bench_sink += list->head != 0;
+        dstr_list_decref(list);
+    }
+}
+
+static void run_list_writev(void *ctx, size_t size, long iters)
+{
+    int fd = open("/dev/null", O_WRONLY);
+    long i;
+
+    for (i = 0; i < iters; i++)
+        dstr_list_writev(fd, ctx, ",");
+    close(fd);
+}
+
+/*                             VECTOR BENCHMARKS                            */
+
+static void *setup_vector(size_t size)
+{
+    dstr_vector *vec = dstr_vector_prealloc(size);
+    size_t i;
+
+    for (i = 0; i < size; i++){
+        dstr *str = dstr_with_initial("vector element ");
+        dstr_append_u64(str, i);
+        dstr_vector_push_back_decref(vec, str);
+    }
+    return vec;
+}
+
+static void teardown_vector(void *ctx)
+{
+    dstr_vector_decref(ctx);
+}
+
+static void run_baseline_pointer_array(void *ctx, size_t size, long iters)
+{
+    dstr **arr;
+    long i;
+    size_t j;
+
+    for (i = 0; i < iters; i++){
+        arr = malloc(size * sizeof(dstr *));
+        for (j = 0; j < size; j++)
+            arr[j] = ctx;
+        bench_sink += arr[size - 1] != 0;
+        free(arr);
+    }
+}
+
+static void run_vector_push_back(void *ctx, size_t size, long iters)
+{
+    dstr *str = dstr_with_initial("element");
+    dstr_vector *vec;
+    long i;
+    size_t j;
+
+    for (i = 0; i < iters; i++){
+        vec = dstr_vector_new();
+        for (j = 0; j < size; j++)
+            dstr_vector_push_back(vec, str);
+        dstr_vector_decref(vec);
+    }
+    dstr_decref(str);
+}
+
+static void run_vector_insert_remove(void *ctx, size_t size, long iters)
+{
+    dstr *str = dstr_with_initial("element");
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_vector_insert(ctx, size / 2, str);
+        dstr_vector_remove(ctx, size / 2);
+    }
+    dstr_decref(str);
+}
+
+static void run_vector_at(void *ctx, size_t size, long iters)
+{
+    size_t total = 0, j;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        for (j = 0; j < size; j++)
+            total += dstr_length(dstr_vector_at(ctx, j));
+    }
+    bench_sink += total;
+}
+
+static void run_vector_join(void *ctx, size_t size, long iters)
+{
+    dstr *str;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        str = dstr_vector_join(",", ctx);
+        bench_sink += dstr_length(str);
+        dstr_decref(str);
+    }
+}
+
+static void run_vector_writev(void *ctx, size_t size, long iters)
+{
+    int fd = open("/dev/null", O_WRONLY);
+    long i;
+
+    for (i = 0; i < iters; i++)
+        dstr_vector_writev(fd, ctx, ",");
+    close(fd);
+}
+
+static void run_vector_parallel_search(void *ctx, size_t size, long iters)
+{
+    dstr_vector *found;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        found = dstr_vector_parallel_search_contains(0, ctx, "99");
+        bench_sink += dstr_vector_size(found);
+        dstr_vector_decref(found);
+    }
+}
+
+static void __contains_callback(dstr *str, void *found)
+{
+    if (dstr_contains(str, "99"))
+        __atomic_fetch_add((size_t *)found, 1, __ATOMIC_RELAXED);
+}
+
+static int __contains_filter(const dstr *str, void *user_data)
+{
+    return dstr_contains(str, "99") != 0;
+}
+
+static void run_vector_parallel_for(void *ctx, size_t size, long iters)
+{
+    size_t found = 0;
+    long i;
+
+    for (i = 0; i < iters; i++)
+        dstr_vector_parallel_for(0, ctx, __contains_callback, &found);
+    bench_sink += found;
+}
+
+static void run_vector_parallel_filter(void *ctx, size_t size, long iters)
+{
+    dstr_vector *found;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        found = dstr_vector_parallel_filter(0, ctx, __contains_filter, 0);
+        bench_sink += dstr_vector_size(found);
+        dstr_vector_decref(found);
+    }
+}
+
+static void run_vector_insert_decref_remove(void *ctx, size_t size, long iters)
+{
+    dstr *str = dstr_with_initial("element");
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_incref(str);
+        dstr_vector_insert_decref(ctx, size / 2, str);
+        dstr_vector_remove(ctx, size / 2);
+    }
+    dstr_decref(str);
+}
+
+static void run_vector_push_pop_front(void *ctx, size_t size, long iters)
+{
+    dstr *str = dstr_with_initial("element");
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_vector_push_front(ctx, str);
+        bench_sink += dstr_length(dstr_vector_front(ctx));
+        dstr_vector_pop_front(ctx);
+    }
+    dstr_decref(str);
+}
+
+static void run_vector_push_pop_back(void *ctx, size_t size, long iters)
+{
+    dstr *str = dstr_with_initial("element");
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_vector_push_back(ctx, str);
+        bench_sink += dstr_length(dstr_vector_back(ctx));
+        dstr_vector_pop_back(ctx);
+    }
+    dstr_decref(str);
+}
+
+/*                              OTHER BENCHMARKS                            */
+
+static void run_builder(void *ctx, size_t size, long iters)
+{
+    dstr_builder *builder = dstr_builder_new();
+    dstr *str;
+    long i;
+    size_t j;
+
+    for (i = 0; i < iters; i++){
+        for (j = 0; j < size; j++)
+            dstr_builder_add_cstrn(builder, "<td>", 4);
+        str = dstr_builder_to_dstr(builder);
+        bench_sink += dstr_length(str);
+        dstr_decref(str);
+        dstr_builder_clear(builder);
+    }
+    dstr_builder_decref(builder);
+}
+
+static void run_builder_writev(void *ctx, size_t size, long iters)
+{
+    int fd = open("/dev/null", O_WRONLY);
+    dstr_builder *builder = dstr_builder_new();
+    dstr *cell = dstr_with_initial("<td>");
+    long i;
+    size_t j;
+
+    for (i = 0; i < iters; i++){
+        for (j = 0; j < size; j++){
+            if (j % 2)
+                dstr_builder_add(builder, cell);
+            else
+                dstr_builder_add_cstr(builder, "</td>");
+        }
+        dstr_builder_writev(fd, builder);
+        dstr_builder_clear(builder);
+    }
+    dstr_builder_decref(builder);
+    dstr_decref(cell);
+    close(fd);
+}
+
+static void run_append_pieces(void *ctx, size_t size, long iters)
+{
+    dstr *str;
+    long i;
+    size_t j;
+
+    for (i = 0; i < iters; i++){
+        str = dstr_new();
+        for (j = 0; j < size; j++)
+            dstr_append_cstrn(str, "<td>", 4);
+        bench_sink += dstr_length(str);
+        dstr_decref(str);
+    }
+}
+
+static void *setup_lines_file(size_t size)
+{
+    FILE *fp = tmpfile();
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        fprintf(fp, "line number %lu of the input\n", (unsigned long)i);
+    fflush(fp);
+    return fp;
+}
+
+static void teardown_file(void *ctx)
+{
+    fclose(ctx);
+}
+
+static void run_getline(void *ctx, size_t size, long iters)
+{
+    dstr *line = dstr_new();
+    dstr_reader *reader;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        lseek(fileno(ctx), 0, SEEK_SET);
+        reader = dstr_reader_new(fileno(ctx));
+        while (dstr_getline(reader, line) == 1)
+            bench_sink += dstr_length(line);
+        dstr_reader_free(reader);
+    }
+    dstr_decref(line);
+}
+
+static void run_read_all(void *ctx, size_t size, long iters)
+{
+    dstr *str;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        lseek(fileno(ctx), 0, SEEK_SET);
+        str = dstr_read_all(fileno(ctx));
+        bench_sink += dstr_length(str);
+        dstr_decref(str);
+    }
+}
+
+static void run_queue(void *ctx, size_t size, long iters)
+{
+    dstr_queue *queue = dstr_queue_new();
+    dstr *str = dstr_with_initial("element");
+    long i;
+    size_t j;
+
+    for (i = 0; i < iters; i++){
+        for (j = 0; j < size; j++){
+            dstr_incref(str);
+            dstr_queue_push_decref(queue, str);
+        }
+        for (j = 0; j < size; j++)
+            dstr_decref(dstr_queue_pop(queue));
+    }
+    dstr_queue_free(queue);
+    dstr_decref(str);
+}
+
+static void run_queue_drain(void *ctx, size_t size, long iters)
+{
+    dstr_queue *queue = dstr_queue_new();
+    dstr_vector *vec = dstr_vector_prealloc(size);
+    dstr *str = dstr_with_initial("element");
+    long i;
+    size_t j;
+
+    for (i = 0; i < iters; i++){
+        for (j = 0; j < size; j++){
+            dstr_incref(str);
+            dstr_queue_push_decref(queue, str);
+        }
+        bench_sink += dstr_queue_drain(queue, vec, 0);
+        for (j = 0; j < size; j++)
+            dstr_vector_pop_back(vec);
+    }
+    dstr_vector_decref(vec);
+    dstr_queue_free(queue);
+    dstr_decref(str);
+}
+
+static void *setup_intern(size_t size)
+{
+    dstr_intern *table = dstr_intern_new(0);
+    char key[32];
+    size_t i;
+
+    for (i = 0; i < size; i++){
+        snprintf(key, sizeof(key), "key%lu", (unsigned long)i);
+        dstr_decref(dstr_intern_insert_cstr(table, key));
+    }
+    return table;
+}
+
+static void teardown_intern(void *ctx)
+{
+    dstr_intern_free(ctx);
+}
+
+static void run_intern(void *ctx, size_t size, long iters)
+{
+    char key[32];
+    long i;
+    int n;
+
+    for (i = 0; i < iters; i++){
+        n = snprintf(key, sizeof(key), "key%lu", (unsigned long)(i % size));
+        dstr_decref(dstr_intern_insert_cstrn(ctx, key, n));
+    }
+}
+
+static void run_intern_size(void *ctx, size_t size, long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++)
+        bench_sink += dstr_intern_size(ctx);
+}
+
+#define INTERN_THREAD_KEYS 1024
+
+/* Worker threads stay up across samples and are started by a barrier.   */
+typedef struct intern_threads_ctx{
+    dstr_intern *table;
+    pthread_t *threads;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    size_t n;
+    long iters; /* Per thread, for the current sample. */
+    int stop;
+} intern_threads_ctx;
+
+typedef struct intern_worker{
+    intern_threads_ctx *ctx;
+    size_t id;
+} intern_worker;
+
+/* Each thread interns its own keys, so what is measured is contention on
+   the shards rather than on the reference counts of shared strings.   */
+static void *intern_thread(void *arg)
+{
+    intern_worker *w = arg;
+    intern_threads_ctx *ctx = w->ctx;
+    unsigned long base = w->id * INTERN_THREAD_KEYS;
+    char key[32];
+    long i;
+    int n;
+
+    for (;;){
+        pthread_barrier_wait(&ctx->start);
+        if (ctx->stop)
+            break;
+        for (i = 0; i < ctx->iters; i++){
+            n = snprintf(key, sizeof(key), "key%lu",
+                         base + (unsigned long)i % INTERN_THREAD_KEYS);
+            dstr_decref(dstr_intern_insert_cstrn(ctx->table, key, n));
+        }
+        pthread_barrier_wait(&ctx->done);
+    }
+    free(w);
+    return 0;
+}
+
+static void *setup_intern_threads(size_t size)
+{
+    intern_threads_ctx *ctx = malloc(sizeof(intern_threads_ctx));
+    intern_worker *w;
+    char key[32];
+    size_t i;
+
+    ctx->table = dstr_intern_new(0);
+    for (i = 0; i < size * INTERN_THREAD_KEYS; i++){
+        snprintf(key, sizeof(key), "key%lu", (unsigned long)i);
+        dstr_decref(dstr_intern_insert_cstr(ctx->table, key));
+    }
+    ctx->threads = malloc(size * sizeof(pthread_t));
+    ctx->n = size;
+    ctx->iters = 0;
+    ctx->stop = 0;
+    pthread_barrier_init(&ctx->start, 0, size + 1);
+    pthread_barrier_init(&ctx->done, 0, size + 1);
+    for (i = 0; i < size; i++){
+        w = malloc(sizeof(intern_worker));
+        w->ctx = ctx;
+        w->id = i;
+        pthread_create(&ctx->threads[i], 0, intern_thread, w);
+    }
+    return ctx;
+}
+
+static void teardown_intern_threads(void *arg)
+{
+    intern_threads_ctx *ctx = arg;
+    size_t i;
+
+    ctx->stop = 1;
+    pthread_barrier_wait(&ctx->start);
+    for (i = 0; i < ctx->n; i++)
+        pthread_join(ctx->threads[i], 0);
+    pthread_barrier_destroy(&ctx->start);
+    pthread_barrier_destroy(&ctx->done);
+    dstr_intern_free(ctx->table);
+    free(ctx->threads);
+    free(ctx);
+}
+
+static void run_intern_threads(void *arg, size_t size, long iters)
+{
+    intern_threads_ctx *ctx = arg;
+
+    ctx->iters = (iters + size - 1) / size;
+    pthread_barrier_wait(&ctx->start);
+    pthread_barrier_wait(&ctx->done);
+}
+
+static void run_rcu_read(void *ctx, size_t size, long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_rcu_read_lock();
+        bench_sink += dstr_length(dstr_rcu_dereference(*(dstr **)&ctx));
+        dstr_rcu_read_unlock();
+    }
+}
+
+/* Writers publish the same string over and over, so what is measured is
+   the exchange and the deferred decref. Decrefs left over are done at the
+   end of each sample.   */
+static void run_rcu_publish(void *ctx, size_t size, long iters)
+{
+    dstr *str = ctx, *slot = str;
+    long i;
+
+    dstr_incref(str);
+    for (i = 0; i < iters; i++){
+        dstr_incref(str);
+        dstr_rcu_publish(&slot, str);
+    }
+    dstr_rcu_defer_decref(slot);
+    dstr_rcu_synchronize();
+}
+
+static void run_rcu_defer_decref(void *ctx, size_t size, long iters)
+{
+    dstr *str = ctx;
+    long i;
+
+    for (i = 0; i < iters; i++){
+        dstr_incref(str);
+        dstr_rcu_defer_decref(str);
+    }
+    dstr_rcu_synchronize();
+}
+
+static const bench benchmarks[] = {
+    { "baseline_malloc_copy", 0, str_sizes, setup_text, run_baseline_malloc_copy, free },
+    { "dstr_with_initial", "baseline_malloc_copy", str_sizes, setup_text, run_with_initial, free },
+    { "dstr_with_initialn", "baseline_malloc_copy", str_sizes, setup_text, run_with_initialn, free },
+    { "dstr_with_prealloc", "baseline_malloc_copy", str_sizes, setup_text, run_with_prealloc, free },
+    { "dstr_buffer_copy", "baseline_malloc_copy", str_sizes, setup_text, run_buffer_copy, free },
+    { "dstr_adopt_release", "baseline_malloc_copy", str_sizes, setup_text, run_adopt_release, free },
+    { "dstr_copy", "baseline_malloc_copy", str_sizes, setup_dstr, run_copy, teardown_dstr },
+    { "dstr_copy_to_cstr", "baseline_malloc_copy", str_sizes, setup_dstr, run_copy_to_cstr, teardown_dstr },
+    { "baseline_memcpy_append", 0, str_sizes, setup_append, run_baseline_memcpy_append, teardown_append },
+    { "dstr_append_cstr", "baseline_memcpy_append", str_sizes, setup_append, run_append_cstr, teardown_append },
+    { "dstr_append", "baseline_memcpy_append", str_sizes, setup_append, run_append, teardown_append },
+    { "dstr_append_decref", "baseline_memcpy_append", str_sizes, setup_append, run_append_decref, teardown_append },
+    { "dstr_prepend", "baseline_memcpy_append", str_sizes, setup_append, run_prepend, teardown_append },
+    { "dstr_prepend_cstr", "baseline_memcpy_append", str_sizes, setup_append, run_prepend_cstr, teardown_append },
+    { "dstr_prepend_cstrn", "baseline_memcpy_append", str_sizes, setup_append, run_prepend_cstrn, teardown_append },
+    { "dstr_prepend_decref", "baseline_memcpy_append", str_sizes, setup_append, run_prepend_decref, teardown_append },
+    { "dstr_swap", "baseline_malloc_copy", str_sizes, setup_append, run_swap, teardown_append },
+    { "dstr_reserve_compact", 0, str_sizes, setup_append, run_reserve_compact, teardown_append },
+    { "dstr_resize_fill", 0, str_sizes, setup_append, run_resize_fill, teardown_append },
+    { "dstr_header_with_initial", 0, str_sizes, setup_append, run_header_with_initial, teardown_append },
+    { "dstr_header_literal", "dstr_header_with_initial", str_sizes, setup_append, run_header_literal, teardown_append },
+    { "dstr_sprintf_int", 0, str_sizes, setup_append, run_sprintf, teardown_append },
+    { "dstr_append_i64", "dstr_sprintf_int", str_sizes, setup_append, run_append_i64, teardown_append },
+    { "dstr_append_u64_hex", "dstr_sprintf_int", str_sizes, setup_append, run_append_u64_hex, teardown_append },
+    { "dstr_sprintf_double", 0, str_sizes, setup_append, run_sprintf_double, teardown_append },
+    { "dstr_append_double", "dstr_sprintf_double", str_sizes, setup_append, run_append_double, teardown_append },
+    { "baseline_strtoll", 0, str_sizes, setup_number, run_baseline_strtoll, teardown_dstr },
+    { "dstr_to_i64", "baseline_strtoll", str_sizes, setup_number, run_to_i64, teardown_dstr },
+    { "baseline_strtod", 0, str_sizes, setup_double, run_baseline_strtod, teardown_dstr },
+    { "dstr_to_double", "baseline_strtod", str_sizes, setup_double, run_to_double, teardown_dstr },
+    { "dstr_to_upper_lower", 0, str_sizes, setup_dstr, run_case_convert, teardown_dstr },
+    { "dstr_capitalize", 0, str_sizes, setup_dstr, run_capitalize, teardown_dstr },
+    { "dstr_clear", 0, str_sizes, setup_dstr, run_clear, teardown_dstr },
+    { "baseline_strlen", 0, str_sizes, setup_utf8, run_baseline_strlen, teardown_dstr },
+    { "dstr_utf8_valid", "baseline_strlen", str_sizes, setup_utf8, run_utf8_valid, teardown_dstr },
+    { "dstr_utf8_length", "baseline_strlen", str_sizes, setup_utf8, run_utf8_length, teardown_dstr },
+    { "dstr_utf8_substr", "dstr_utf8_length", str_sizes, setup_utf8, run_utf8_substr, teardown_dstr },
+    { "dstr_utf8_truncate", "dstr_swap", str_sizes, setup_utf8, run_utf8_truncate, teardown_dstr },
+    { "dstr_utf8_truncate_bytes", "dstr_swap", str_sizes, setup_utf8, run_utf8_truncate_bytes, teardown_dstr },
+    { "baseline_hex_encode", 0, str_sizes, setup_codec, run_baseline_hex_encode, teardown_codec },
+    { "dstr_append_hex", "baseline_hex_encode", str_sizes, setup_codec, run_hex_encode, teardown_codec },
+    { "dstr_decode_hex", "baseline_hex_encode", str_sizes, setup_codec, run_hex_decode, teardown_codec },
+    { "dstr_append_base64", "baseline_hex_encode", str_sizes, setup_codec, run_base64_encode, teardown_codec },
+    { "dstr_decode_base64", "baseline_hex_encode", str_sizes, setup_codec, run_base64_decode, teardown_codec },
+    { "baseline_json_bytewise", 0, str_sizes, setup_escape, run_baseline_json_bytewise, teardown_codec },
+    { "dstr_append_json_escaped", "baseline_json_bytewise", str_sizes, setup_escape, run_json_escaped, teardown_codec },
+    { "dstr_append_url_encoded", "baseline_json_bytewise", str_sizes, setup_escape, run_url_encoded, teardown_codec },
+    { "dstr_url_decode", "baseline_json_bytewise", str_sizes, setup_escape, run_url_decode, teardown_codec },
+    { "baseline_erase_insert", 0, str_sizes, setup_template, run_baseline_erase_insert, teardown_codec },
+    { "dstr_replace_all", "baseline_erase_insert", str_sizes, setup_template, run_replace_all, teardown_codec },
+    { "dstr_replace_all_shrink", "baseline_erase_insert", str_sizes, setup_template, run_replace_all_shrink, teardown_codec },
+    { "dstr_replace_all_pairs", "dstr_replace_all", str_sizes, setup_template, run_replace_all_pairs, teardown_codec },
+    { "dstr_insert_erase", 0, str_sizes, setup_template, run_insert_erase, teardown_codec },
+    { "dstr_insert_cstrn_erase", "dstr_insert_erase", str_sizes, setup_template, run_insert_cstrn_erase, teardown_codec },
+    { "dstr_insert_dstr_erase", "dstr_insert_erase", str_sizes, setup_template, run_insert_dstr_erase, teardown_codec },
+    { "baseline_erase_trim", 0, str_sizes, setup_padded, run_baseline_erase_trim, teardown_codec },
+    { "dstr_trim", "baseline_erase_trim", str_sizes, setup_padded, run_trim, teardown_codec },
+    { "dstr_ltrim", "dstr_trim", str_sizes, setup_padded, run_ltrim, teardown_codec },
+    { "dstr_rtrim", "dstr_trim", str_sizes, setup_padded, run_rtrim, teardown_codec },
+    { "dstr_trim_chars", "dstr_trim", str_sizes, setup_padded, run_trim_chars, teardown_codec },
+    { "dstr_ltrim_rtrim_chars", "dstr_trim", str_sizes, setup_padded, run_ltrim_rtrim_chars, teardown_codec },
+    { "dstr_trim_view", "dstr_trim", str_sizes, setup_padded, run_trim_view, teardown_codec },
+    { "baseline_strstr", 0, str_sizes, setup_haystack, run_baseline_strstr, teardown_dstr },
+    { "dstr_contains", "baseline_strstr", str_sizes, setup_haystack, run_contains, teardown_dstr },
+    { "dstr_starts_ends_with", 0, str_sizes, setup_haystack, run_starts_ends_with, teardown_dstr },
+    { "dstr_contains_dstr", "dstr_contains", str_sizes, setup_haystack, run_contains_dstr, teardown_dstr },
+    { "dstr_starts_ends_with_dstr", "dstr_starts_ends_with", str_sizes, setup_haystack, run_starts_ends_with_dstr, teardown_dstr },
+    { "dstr_matches", 0, str_sizes, setup_haystack, run_matches, teardown_dstr },
+    { "dstr_split_to_vector", 0, vec_sizes, setup_csv, run_split_to_vector, teardown_dstr },
+    { "dstr_split_to_list", 0, vec_sizes, setup_csv, run_split_to_list, teardown_dstr },
+    { "dstr_tokenizer_split", "dstr_split_to_vector", vec_sizes, setup_csv, run_tokenizer_split, teardown_dstr },
+    { "dstr_tokenizer_views", "dstr_split_to_vector", vec_sizes, setup_csv, run_tokenizer_views, teardown_dstr },
+    { "dstr_tokenizer_next", "dstr_split_to_vector", vec_sizes, setup_csv, run_tokenizer_next, teardown_dstr },
+    { "dstr_csv_rows", 0, vec_sizes, setup_csv_rows, run_csv_rows, teardown_dstr },
+    { "dstr_csv_views", "dstr_csv_rows", vec_sizes, setup_csv_rows, run_csv_views, teardown_dstr },
+    { "baseline_pointer_array", 0, vec_sizes, 0, run_baseline_pointer_array, 0 },
+    { "dstr_list_add", "baseline_pointer_array", vec_sizes, 0, run_list_add, 0 },
+    { "dstr_list_add_remove", 0, vec_sizes, setup_list, run_list_add_remove, teardown_list },
+    { "dstr_list_traverse_delete", "dstr_list_add", vec_sizes, 0, run_list_traverse_delete, 0 },
+    { "dstr_list_traverse", 0, vec_sizes, setup_list, run_list_traverse, teardown_list },
+    { "dstr_list_traverse_reverse", "dstr_list_traverse", vec_sizes, setup_list, run_list_traverse_reverse, teardown_list },
+    { "dstr_list_size", "dstr_list_traverse", vec_sizes, setup_list, run_list_size, teardown_list },
+    { "dstr_list_to_dstr", 0, vec_sizes, setup_list, run_list_to_dstr, teardown_list },
+    { "dstr_list_bencode", 0, vec_sizes, setup_list, run_list_bencode, teardown_list },
+    { "dstr_list_bdecode", "dstr_list_bencode", vec_sizes, setup_list_bencoded, run_list_bdecode, teardown_dstr },
+    { "dstr_list_writev", 0, vec_sizes, setup_list, run_list_writev, teardown_list },
+    { "dstr_list_search_contains", 0, vec_sizes, setup_list, run_list_search_contains, teardown_list },
+    { "dstr_list_search_contains_dstr", "dstr_list_search_contains", vec_sizes, setup_list, run_list_search_contains_dstr, teardown_list },
+    { "dstr_vector_push_back", "baseline_pointer_array", vec_sizes, 0, run_vector_push_back, 0 },
+    { "dstr_vector_insert_remove", 0, vec_sizes, setup_vector, run_vector_insert_remove, teardown_vector },
+    { "dstr_vector_insert_decref_remove", "dstr_vector_insert_remove", vec_sizes, setup_vector, run_vector_insert_decref_remove, teardown_vector },
+    { "dstr_vector_push_pop_front", "dstr_vector_insert_remove", vec_sizes, setup_vector, run_vector_push_pop_front, teardown_vector },
+    { "dstr_vector_push_pop_back", 0, vec_sizes, setup_vector, run_vector_push_pop_back, teardown_vector },
+    { "dstr_vector_at", 0, vec_sizes, setup_vector, run_vector_at, teardown_vector },
+    { "dstr_vector_join", "dstr_list_to_dstr", vec_sizes, setup_vector, run_vector_join, teardown_vector },
+    { "dstr_vector_writev", 0, vec_sizes, setup_vector, run_vector_writev, teardown_vector },
+    { "dstr_vector_parallel_search_contains", "dstr_list_search_contains", vec_sizes, setup_vector, run_vector_parallel_search, teardown_vector },
+    { "dstr_vector_parallel_for", "dstr_vector_parallel_search_contains", vec_sizes, setup_vector, run_vector_parallel_for, teardown_vector },
+    { "dstr_vector_parallel_filter", "dstr_vector_parallel_search_contains", vec_sizes, setup_vector, run_vector_parallel_filter, teardown_vector },
+    { "dstr_append_pieces", 0, vec_sizes, 0, run_append_pieces, 0 },
+    { "dstr_builder", "dstr_append_pieces", vec_sizes, 0, run_builder, 0 },
+    { "dstr_builder_writev", "dstr_builder", vec_sizes, 0, run_builder_writev, 0 },
+    { "dstr_getline", 0, vec_sizes, setup_lines_file, run_getline, teardown_file },
+    { "dstr_read_all", 0, vec_sizes, setup_lines_file, run_read_all, teardown_file },
+    { "dstr_queue_push_pop", 0, vec_sizes, 0, run_queue, 0 },
+    { "dstr_queue_push_drain", "dstr_queue_push_pop", vec_sizes, 0, run_queue_drain, 0 },
+    { "dstr_intern_insert", 0, vec_sizes, setup_intern, run_intern, teardown_intern },
+    { "dstr_intern_size", 0, vec_sizes, setup_intern, run_intern_size, teardown_intern },
+    { "dstr_intern_insert_threads", 0, thread_sizes, setup_intern_threads, run_intern_threads, teardown_intern_threads, BENCH_THREAD_SAMPLE_NS },
+    { "dstr_rcu_read", 0, str_sizes, setup_dstr, run_rcu_read, teardown_dstr },
+    { "dstr_rcu_publish", 0, str_sizes, setup_dstr, run_rcu_publish, teardown_dstr },
+    { "dstr_rcu_defer_decref", "dstr_rcu_publish", str_sizes, setup_dstr, run_rcu_defer_decref, teardown_dstr },
+};
+
+/*                                 HARNESS                                  */
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static long run_sample(const bench *b, void *ctx, size_t size, long iters)
+{
+    long start = bench_now_ns();
+    b->run(ctx, size, iters);
+    return bench_now_ns() - start;
+}
+
+static void run_bench(const bench *b, size_t size, int samples,
+                      bench_result *result)
+{
+    double *ns = malloc(samples * sizeof(double));
+    void *ctx = b->setup ? b->setup(size) : 0;
+    long iters = 1, elapsed, sample_ns;
+    int i;
+
+    sample_ns = b->sample_ns ? b->sample_ns : BENCH_SAMPLE_NS;
+    /* Calibrate batch size, which also warms up caches.   */
+    while ((elapsed = run_sample(b, ctx, size, iters)) < sample_ns &&
+            iters < (1L << 30))
+        iters *= 2;
+    for (i = 0; i < BENCH_WARMUP; i++)
+        run_sample(b, ctx, size, iters);
+    counters_start();
+    for (i = 0; i < samples; i++)
+        ns[i] = (double)run_sample(b, ctx, size, iters) / iters;
+    counters_stop(result->counts);
+    if (b->teardown)
+        b->teardown(ctx);
+
+    qsort(ns, samples, sizeof(double), compare_double);
+    result->b = b;
+    result->size = size;
+    result->iters = iters;
+    result->samples = samples;
+    result->min_ns = ns[0];
+    result->p50_ns = ns[samples / 2];
+    result->p99_ns = ns[(samples * 99 + 99) / 100 - 1];
+    free(ns);
+}
+
+static const bench_result *find_result(const bench_result *results, int n,
+                                       const char *name, size_t size)
+{
+    int i;
+
+    for (i = 0; i < n; i++){
+        if (results[i].size == size && !strcmp(results[i].b->name, name))
+            return &results[i];
+    }
+    return 0;
+}
+
+/* Misses per element handled, -1 when the counter is missing.   */
+static double per_element(const bench_result *result, int counter)
+{
+    double elements = (double)result->iters * result->size;
+
+    if (result->counts[counter] < 0)
+        return -1;
+    return result->counts[counter] / (elements * result->samples);
+}
+
+static double ipc(const bench_result *result)
+{
+    if (result->counts[BENCH_CYCLES] <= 0 ||
+            result->counts[BENCH_INSTRUCTIONS] < 0)
+        return -1;
+    return result->counts[BENCH_INSTRUCTIONS] / result->counts[BENCH_CYCLES];
+}
+
+static void print_counter(double value, const char *fmt)
+{
+    if (value < 0)
+        printf(" %8s", "-");
+    else
+        printf(fmt, value);
+}
+
+static void write_json(FILE *fp, const bench_result *results, int n,
+                       int samples)
+{
+    const bench_result *base;
+    int i, j;
+
+    fprintf(fp, "{\n  \"library\": \"dstr\",\n  \"version\": \"%s\",\n",
+            DSTR_VERSION);
+    fprintf(fp, "  \"timestamp\": %ld,\n  \"samples\": %d,\n", (long)time(0),
+            samples);
+    fprintf(fp, "  \"benchmarks\": [\n");
+    for (i = 0; i < n; i++){
+        fprintf(fp, "    {\"name\": \"%s\", \"size\": %lu, \"iterations\": %ld, "
+                "\"min_ns\": %.2f, \"p50_ns\": %.2f, \"p99_ns\": %.2f",
+                results[i].b->name, (unsigned long)results[i].size,
+                results[i].iters, results[i].min_ns, results[i].p50_ns,
+                results[i].p99_ns);
+        base = results[i].b->baseline ?
+            find_result(results, n, results[i].b->baseline, results[i].size) : 0;
+        if (base)
+            fprintf(fp, ", \"baseline\": \"%s\", \"baseline_ratio\": %.3f",
+                    base->b->name, results[i].p50_ns / base->p50_ns);
+        for (j = 0; j < BENCH_COUNTERS; j++){
+            if (results[i].counts[j] >= 0)
+                fprintf(fp, ", \"%s\": %.0f, \"%s_per_element\": %.4f",
+                        counter_names[j], results[i].counts[j],
+                        counter_names[j], per_element(&results[i], j));
+        }
+        if (ipc(&results[i]) >= 0)
+            fprintf(fp, ", \"ipc\": %.3f", ipc(&results[i]));
+        fprintf(fp, "}%s\n", i + 1 < n ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+    int n_bench = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    bench_result *results;
+    const bench_result *base;
+    const char *filter = 0, *json = 0;
+    int samples = BENCH_SAMPLES, n = 0, i, opt, counters;
+    const size_t *size;
+    FILE *fp;
+
+    while ((opt = getopt(argc, argv, "r:f:j:")) != -1){
+        switch (opt){
+        case 'r':
+            samples = atoi(optarg);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'j':
+            json = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r samples] [-f filter] [-j file.json]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (samples < 1)
+        samples = 1;
+
+    counters_open();
+    counters = counters_available();
+    results = malloc(n_bench * 4 * sizeof(bench_result));
+    printf("%-38s %8s %12s %12s %12s %10s", "benchmark", "size",
+           "min ns/op", "p50 ns/op", "p99 ns/op", "vs base");
+    if (counters)
+        printf(" %8s %8s %8s %8s", "IPC", "L1D/el", "LLC/el", "brmis/el");
+    printf("\n");
+    for (i = 0; i < n_bench; i++){
+        if (filter && !strstr(benchmarks[i].name, filter))
+            continue;
+        for (size = benchmarks[i].sizes; *size; size++){
+            run_bench(&benchmarks[i], *size, samples, &results[n]);
+            printf("%-38s %8lu %12.1f %12.1f %12.1f", benchmarks[i].name,
+                   (unsigned long)*size, results[n].min_ns, results[n].p50_ns,
+                   results[n].p99_ns);
+            base = benchmarks[i].baseline ?
+                find_result(results, n, benchmarks[i].baseline, *size) : 0;
+            if (base)
+                printf(" %9.2fx", results[n].p50_ns / base->p50_ns);
+            else if (counters)
+                printf(" %10s", "");
+            if (counters){
+                print_counter(ipc(&results[n]), " %8.2f");
+                print_counter(per_element(&results[n], BENCH_L1D_MISSES), " %8.3f");
+                print_counter(per_element(&results[n], BENCH_LLC_MISSES), " %8.3f");
+                print_counter(per_element(&results[n], BENCH_BRANCH_MISSES), " %8.3f");
+            }
+            printf("\n");
+            n++;
+        }
+    }
+
+    if (json){
+        fp = fopen(json, "w");
+        if (!fp){
+            perror(json);
+            return 1;
+        }
+        write_json(fp, results, n, samples);
+        fclose(fp);
+    }
+    counters_close();
+    free(results);
+    return 0;
+}
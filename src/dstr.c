@@ -24,9 +24,53 @@
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
 #include <malloc.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <locale.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef DSTR_PROFILE
+  #include <fcntl.h>
+  #include <execinfo.h>
+#endif
 
+/* The library always builds the out of line accessors.   */
+#undef DSTR_INLINE_API
 #include "dstr.h"
+#include "dstr_d2s_table.h"
+
+/* Immortal strings point into read only memory and are never written to,
+   nor is their memory ever reallocated or free'd.   */
+#define __dstr_immortal(str) ((str)->flags & DSTR_IMMORTAL)
+/* Incref of a string shared between threads, atomic whether or not
+   DSTR_ATOMIC_REF is set. Immortal strings are left as is.   */
+#define __dstr_incref_shared(str) \
+    ((__atomic_load_n(&(str)->flags, __ATOMIC_RELAXED) & DSTR_IMMORTAL) ? \
+     (str)->ref : __atomic_add_fetch(&(str)->ref, 1, __ATOMIC_RELAXED))
+
+#if !defined(DSTR_NO_SIMD) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+  #define __DSTR_X86_SIMD 1
+  #include <immintrin.h>
+#endif
+
+/* Static tracepoints, see DSTR_PROBES in dstr.h.   */
+#ifdef DSTR_PROBES
+  #include <sys/sdt.h>
+  #define __dstr_probe1(name, a) DTRACE_PROBE1(dstr, name, a)
+  #define __dstr_probe2(name, a, b) DTRACE_PROBE2(dstr, name, a, b)
+  #define __dstr_probe3(name, a, b, c) DTRACE_PROBE3(dstr, name, a, b, c)
+#else
+  #define __dstr_probe1(name, a) ((void)0)
+  #define __dstr_probe2(name, a, b) ((void)0)
+  #define __dstr_probe3(name, a, b, c) ((void)0)
+#endif /* DSTR_PROBES */
 
 dstr *dstr_version()
 {
@@ -85,8 +129,752 @@ void dstr_safe_free(void *ptr, size_t sz)
 
 #endif /* DSTR_MEM_CLEAR */
 
+/*                               STATISTICS                                 */
+
+#ifdef DSTR_STATS
+
+static dstr_stats __dstr_stats;
+
+#define __dstr_stat_add(field, n) \
+    __atomic_add_fetch(&__dstr_stats.field, (n), __ATOMIC_RELAXED)
+#define __dstr_stat_sub(field, n) \
+    __atomic_sub_fetch(&__dstr_stats.field, (n), __ATOMIC_RELAXED)
+/* Set length of string, keeping count of bytes used. Unsigned wrap around
+   takes care of shrinking strings. Contents are assumed changed.   */
+#define __dstr_set_sz(str, n) \
+    do { \
+        size_t __sz = (n); \
+        __dstr_stat_add(bytes_used, __sz - (str)->sz); \
+        (str)->sz = __sz; \
+        (str)->flags &= ~DSTR_UTF8_VALID; \
+    } while (0)
+
+/* Record a string buffer going from old_mem to new_mem bytes.   */
+static void __dstr_stat_mem(size_t old_mem, size_t new_mem)
+{
+    int bucket = 0;
+
+    __dstr_stat_add(bytes_allocated, new_mem - old_mem);
+    if (!new_mem)
+        return;
+    if (old_mem)
+        __dstr_stat_add(reallocs, 1);
+    while (new_mem >>= 1)
+        bucket++;
+    if (bucket >= DSTR_STATS_BUCKETS)
+        bucket = DSTR_STATS_BUCKETS - 1;
+    __dstr_stat_add(size_histogram[bucket], 1);
+}
+
+int dstr_stats_snapshot(dstr_stats *stats)
+{
+    int i;
+
+    stats->strings = __atomic_load_n(&__dstr_stats.strings, __ATOMIC_RELAXED);
+    stats->lists = __atomic_load_n(&__dstr_stats.lists, __ATOMIC_RELAXED);
+    stats->list_links = __atomic_load_n(&__dstr_stats.list_links,
+                                        __ATOMIC_RELAXED);
+    stats->vectors = __atomic_load_n(&__dstr_stats.vectors, __ATOMIC_RELAXED);
+    stats->bytes_allocated = __atomic_load_n(&__dstr_stats.bytes_allocated,
+                                             __ATOMIC_RELAXED);
+    stats->bytes_used = __atomic_load_n(&__dstr_stats.bytes_used,
+                                        __ATOMIC_RELAXED);
+    stats->vector_bytes = __atomic_load_n(&__dstr_stats.vector_bytes,
+                                          __ATOMIC_RELAXED);
+    stats->reallocs = __atomic_load_n(&__dstr_stats.reallocs,
+                                      __ATOMIC_RELAXED);
+    stats->vector_reallocs = __atomic_load_n(&__dstr_stats.vector_reallocs,
+                                             __ATOMIC_RELAXED);
+    for (i = 0; i < DSTR_STATS_BUCKETS; i++)
+        stats->size_histogram[i] = __atomic_load_n(
+            &__dstr_stats.size_histogram[i], __ATOMIC_RELAXED);
+    return 1;
+}
+
+#else
+
+#define __dstr_stat_add(field, n) ((void)0)
+#define __dstr_stat_sub(field, n) ((void)0)
+#define __dstr_stat_mem(old_mem, new_mem) ((void)0)
+#define __dstr_set_sz(str, n) \
+    do { \
+        (str)->sz = (n); \
+        (str)->flags &= ~DSTR_UTF8_VALID; \
+    } while (0)
+
+int dstr_stats_snapshot(dstr_stats *stats)
+{
+    memset(stats, 0, sizeof(dstr_stats));
+    return 0;
+}
+
+#endif /* DSTR_STATS */
+
+/*                             SCATTER WRITES                               */
+
+#ifndef IOV_MAX
+  #define IOV_MAX 1024
+#endif
+
+/* Batch of buffers waiting to be written with writev.   */
+typedef struct __dstr_iov_batch{
+    int fd;
+    int cnt;
+    struct iovec iov[IOV_MAX];
+} __dstr_iov_batch;
+
+/* Write all buffers in batch, retrying on partial writes.   */
+static int __dstr_iov_flush(__dstr_iov_batch *batch)
+{
+    struct iovec *iov = batch->iov;
+    int cnt = batch->cnt;
+    ssize_t rc;
+
+    while (cnt){
+        rc = writev(batch->fd, iov, cnt);
+        if (rc == -1){
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        while (cnt && (size_t)rc >= iov->iov_len){
+            rc -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt){
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+    batch->cnt = 0;
+    return 1;
+}
+
+static int __dstr_iov_push(__dstr_iov_batch *batch, const char *buf, size_t n)
+{
+    if (!n)
+        return 1;
+    if (batch->cnt == IOV_MAX && !__dstr_iov_flush(batch))
+        return 0;
+    batch->iov[batch->cnt].iov_base = (void *)buf;
+    batch->iov[batch->cnt].iov_len = n;
+    batch->cnt++;
+    return 1;
+}
+
+/*                          ALLOCATION PROFILER                             */
+
+#ifdef DSTR_PROFILE
+
+#define __DSTR_PROF_DEPTH 32
+#define __DSTR_PROF_BUCKET_BITS 12
+#define __DSTR_PROF_FILTER_BITS 14
+/* Interval at which threads recheck a disabled profiler.   */
+#define __DSTR_PROF_IDLE 1048576
+
+enum {
+    __DSTR_PROF_STRING,
+    __DSTR_PROF_LINK,
+    __DSTR_PROF_VECTOR
+};
+
+static const char *__dstr_prof_kinds[] = { "string", "list link", "vector" };
+
+typedef struct __dstr_prof_record{
+    const void *ptr;
+    size_t bytes;
+    int kind;
+    int depth;
+    void *stack[__DSTR_PROF_DEPTH];
+    struct __dstr_prof_record *next;
+} __dstr_prof_record;
+
+/* Live sampled objects hashed on address. The filter counts sampled objects
+   per hash slot, so free'ing an object that was not sampled costs one load
+   in the common case.   */
+static struct {
+    pthread_mutex_t lock;
+    size_t rate;
+    size_t live;
+    __dstr_prof_record *buckets[1 << __DSTR_PROF_BUCKET_BITS];
+    unsigned int filter[1 << __DSTR_PROF_FILTER_BITS];
+} __dstr_prof = { PTHREAD_MUTEX_INITIALIZER, DSTR_PROFILE_RATE };
+
+static __thread long __dstr_prof_countdown;
+static __thread uint64_t __dstr_prof_seed;
+
+static uint64_t __dstr_prof_hash(const void *ptr)
+{
+    return ((uint64_t)(uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL;
+}
+
+#define __dstr_prof_slot(ptr) \
+    (__dstr_prof_hash(ptr) >> (64 - __DSTR_PROF_FILTER_BITS))
+#define __dstr_prof_bucket(ptr) \
+    (__dstr_prof_hash(ptr) >> (64 - __DSTR_PROF_BUCKET_BITS))
+
+/* Bytes until next sample, uniform with mean of sample rate.   */
+static long __dstr_prof_next()
+{
+    size_t rate = __atomic_load_n(&__dstr_prof.rate, __ATOMIC_RELAXED);
+
+    if (!rate)
+        return __DSTR_PROF_IDLE;
+    __dstr_prof_seed ^= __dstr_prof_seed << 13;
+    __dstr_prof_seed ^= __dstr_prof_seed >> 7;
+    __dstr_prof_seed ^= __dstr_prof_seed << 17;
+    return (long)(__dstr_prof_seed % (2 * rate)) + 1;
+}
+
+static void __attribute__((noinline))
+__dstr_prof_sample(const void *ptr, int kind, size_t bytes)
+{
+    __dstr_prof_record *record;
+    void *stack[__DSTR_PROF_DEPTH + 1];
+    size_t bucket;
+    int depth;
+
+    if (!__dstr_prof_seed){
+        /* First allocation of thread only starts the countdown.   */
+        __dstr_prof_seed = __dstr_prof_hash(&__dstr_prof_seed) | 1;
+        __dstr_prof_countdown = __dstr_prof_next();
+        return;
+    }
+    __dstr_prof_countdown = __dstr_prof_next();
+    if (!__atomic_load_n(&__dstr_prof.rate, __ATOMIC_RELAXED))
+        return;
+    record = malloc(sizeof(__dstr_prof_record));
+    if (!record)
+        return;
+    record->ptr = ptr;
+    record->bytes = bytes;
+    record->kind = kind;
+    /* Leave out this frame.   */
+    depth = backtrace(stack, __DSTR_PROF_DEPTH + 1);
+    record->depth = depth > 1 ? depth - 1 : 0;
+    memcpy(record->stack, stack + 1, record->depth * sizeof(void *));
+    bucket = __dstr_prof_bucket(ptr);
+    pthread_mutex_lock(&__dstr_prof.lock);
+    record->next = __dstr_prof.buckets[bucket];
+    __dstr_prof.buckets[bucket] = record;
+    __dstr_prof.live++;
+    pthread_mutex_unlock(&__dstr_prof.lock);
+    __atomic_add_fetch(&__dstr_prof.filter[__dstr_prof_slot(ptr)], 1,
+                       __ATOMIC_RELAXED);
+}
+
+static void __dstr_prof_forget(const void *ptr)
+{
+    __dstr_prof_record **prev, *record;
+
+    pthread_mutex_lock(&__dstr_prof.lock);
+    prev = &__dstr_prof.buckets[__dstr_prof_bucket(ptr)];
+    for (record = *prev; record; prev = &record->next, record = *prev){
+        if (record->ptr == ptr){
+            *prev = record->next;
+            __dstr_prof.live--;
+            __atomic_sub_fetch(&__dstr_prof.filter[__dstr_prof_slot(ptr)], 1,
+                               __ATOMIC_RELAXED);
+            free(record);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&__dstr_prof.lock);
+}
+
+#define __dstr_prof_alloc(ptr, kind, bytes) \
+    do { \
+        if ((__dstr_prof_countdown -= (long)(bytes)) <= 0) \
+            __dstr_prof_sample(ptr, kind, bytes); \
+    } while (0)
+#define __dstr_prof_free(ptr) \
+    do { \
+        if (__atomic_load_n(&__dstr_prof.filter[__dstr_prof_slot(ptr)], \
+                            __ATOMIC_RELAXED)) \
+            __dstr_prof_forget(ptr); \
+    } while (0)
+
+/* Objects sampled from one allocation site.   */
+typedef struct __dstr_prof_site{
+    const __dstr_prof_record *record;
+    size_t objects;
+    size_t bytes;
+    size_t estimate; /* Bytes scaled up by the chance of being sampled. */
+} __dstr_prof_site;
+
+static int __dstr_prof_record_cmp(const void *a, const void *b)
+{
+    const __dstr_prof_record *x = a, *y = b;
+
+    if (x->kind != y->kind)
+        return x->kind - y->kind;
+    if (x->depth != y->depth)
+        return x->depth - y->depth;
+    return memcmp(x->stack, y->stack, x->depth * sizeof(void *));
+}
+
+static int __dstr_prof_site_cmp(const void *a, const void *b)
+{
+    const __dstr_prof_site *x = a, *y = b;
+    return x->estimate < y->estimate ? 1 : x->estimate > y->estimate ? -1 : 0;
+}
+
+static int __dstr_prof_dump_text(dstr *out, __dstr_prof_site *sites,
+                                 size_t n_sites, size_t rate)
+{
+    size_t i, objects = 0, bytes = 0, estimate = 0;
+    char **symbols;
+    int j, rc = 1;
+
+    for (i = 0; i < n_sites; i++){
+        objects += sites[i].objects;
+        bytes += sites[i].bytes;
+        estimate += sites[i].estimate;
+    }
+    rc &= dstr_sprintf(out, "dstr heap profile: %lu sampled objects, %lu "
+                       "sampled bytes, ~%lu bytes estimated, sample rate %lu\n",
+                       (unsigned long)objects, (unsigned long)bytes,
+                       (unsigned long)estimate, (unsigned long)rate);
+    for (i = 0; i < n_sites && rc; i++){
+        rc &= dstr_sprintf(out, "\n%lu %s objects, %lu bytes, ~%lu bytes "
+                           "estimated\n", (unsigned long)sites[i].objects,
+                           __dstr_prof_kinds[sites[i].record->kind],
+                           (unsigned long)sites[i].bytes,
+                           (unsigned long)sites[i].estimate);
+        symbols = backtrace_symbols((void *const *)sites[i].record->stack,
+                                    sites[i].record->depth);
+        for (j = 0; j < sites[i].record->depth && rc; j++){
+            if (symbols)
+                rc &= dstr_sprintf(out, "    %s\n", symbols[j]);
+            else
+                rc &= dstr_sprintf(out, "    %p\n", sites[i].record->stack[j]);
+        }
+        free(symbols);
+    }
+    return rc;
+}
+
+static int __dstr_prof_dump_pprof(dstr *out, __dstr_prof_site *sites,
+                                  size_t n_sites, size_t rate)
+{
+    size_t i, objects = 0, bytes = 0;
+    dstr *maps;
+    int j, fd, rc = 1;
+
+    for (i = 0; i < n_sites; i++){
+        objects += sites[i].objects;
+        bytes += sites[i].bytes;
+    }
+    rc &= dstr_sprintf(out, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%lu\n",
+                       (unsigned long)objects, (unsigned long)bytes,
+                       (unsigned long)objects, (unsigned long)bytes,
+                       (unsigned long)rate);
+    for (i = 0; i < n_sites && rc; i++){
+        rc &= dstr_sprintf(out, "%lu: %lu [%lu: %lu] @",
+                           (unsigned long)sites[i].objects,
+                           (unsigned long)sites[i].bytes,
+                           (unsigned long)sites[i].objects,
+                           (unsigned long)sites[i].bytes);
+        for (j = 0; j < sites[i].record->depth && rc; j++)
+            rc &= dstr_sprintf(out, " %p", sites[i].record->stack[j]);
+        rc &= dstr_append_cstrn(out, "\n", 1);
+    }
+    /* Pprof maps addresses to binaries with the memory map.   */
+    rc &= dstr_append_cstr(out, "\nMAPPED_LIBRARIES:\n");
+    fd = open("/proc/self/maps", O_RDONLY);
+    if (fd != -1){
+        maps = dstr_read_all(fd);
+        close(fd);
+        if (maps){
+            rc &= dstr_append(out, maps);
+            dstr_decref(maps);
+        }
+    }
+    return rc;
+}
+
+int dstr_profile_dump(int fd, int format)
+{
+    __dstr_prof_record *records, *record;
+    __dstr_prof_site *sites;
+    __dstr_iov_batch batch;
+    size_t i, n = 0, n_sites = 0, rate;
+    dstr *out;
+    int rc = 0;
+
+    pthread_mutex_lock(&__dstr_prof.lock);
+    records = malloc((__dstr_prof.live + 1) * sizeof(__dstr_prof_record));
+    if (!records){
+        pthread_mutex_unlock(&__dstr_prof.lock);
+        return 0;
+    }
+    for (i = 0; i < (1 << __DSTR_PROF_BUCKET_BITS); i++){
+        for (record = __dstr_prof.buckets[i]; record; record = record->next)
+            records[n++] = *record;
+    }
+    pthread_mutex_unlock(&__dstr_prof.lock);
+    rate = __atomic_load_n(&__dstr_prof.rate, __ATOMIC_RELAXED);
+
+    /* Group records with equal backtraces into sites, largest first.   */
+    qsort(records, n, sizeof(__dstr_prof_record), __dstr_prof_record_cmp);
+    sites = malloc((n + 1) * sizeof(__dstr_prof_site));
+    out = dstr_new();
+    if (!sites || !out)
+        goto out;
+    for (i = 0; i < n; i++){
+        if (!i || __dstr_prof_record_cmp(&records[i], &records[i - 1])){
+            sites[n_sites].record = &records[i];
+            sites[n_sites].objects = 0;
+            sites[n_sites].bytes = 0;
+            sites[n_sites].estimate = 0;
+            n_sites++;
+        }
+        sites[n_sites - 1].objects++;
+        sites[n_sites - 1].bytes += records[i].bytes;
+        sites[n_sites - 1].estimate += records[i].bytes < rate ?
+            rate : records[i].bytes;
+    }
+    qsort(sites, n_sites, sizeof(__dstr_prof_site), __dstr_prof_site_cmp);
+
+    if (format == DSTR_PROFILE_PPROF)
+        rc = __dstr_prof_dump_pprof(out, sites, n_sites, rate);
+    else
+        rc = __dstr_prof_dump_text(out, sites, n_sites, rate);
+    if (rc){
+        batch.fd = fd;
+        batch.cnt = 0;
+        rc = __dstr_iov_push(&batch, out->data, out->sz) &&
+            __dstr_iov_flush(&batch);
+    }
+out:
+    if (out)
+        dstr_decref(out);
+    free(sites);
+    free(records);
+    return rc;
+}
+
+void dstr_profile_rate(size_t bytes)
+{
+    __atomic_store_n(&__dstr_prof.rate, bytes, __ATOMIC_RELAXED);
+    /* Other threads pick up the new rate after their next sample.   */
+    if (!__dstr_prof_seed)
+        __dstr_prof_seed = __dstr_prof_hash(&__dstr_prof_seed) | 1;
+    __dstr_prof_countdown = __dstr_prof_next();
+}
+
+#else
+
+#define __dstr_prof_alloc(ptr, kind, bytes) ((void)0)
+#define __dstr_prof_free(ptr) ((void)0)
+
+void dstr_profile_rate(size_t bytes)
+{
+}
+
+int dstr_profile_dump(int fd, int format)
+{
+    return 0;
+}
+
+#endif /* DSTR_PROFILE */
+
+/*                              SIMD SUPPORT                                */
+
+#ifdef __DSTR_X86_SIMD
+
+/* CPU features are probed once, kernels are picked per call.   */
+static int __dstr_cpu_avx2 = -1;
+
+static int __dstr_has_avx2()
+{
+    int has = __atomic_load_n(&__dstr_cpu_avx2, __ATOMIC_RELAXED);
+
+    if (has < 0){
+        __builtin_cpu_init();
+        has = __builtin_cpu_supports("avx2") ? 1 : 0;
+        __atomic_store_n(&__dstr_cpu_avx2, has, __ATOMIC_RELAXED);
+    }
+    return has;
+}
+
+#endif /* __DSTR_X86_SIMD */
+
+/*                               BYTE SETS                                  */
+/* Sets of byte values are kept as a 256 bit table, plus the same bits
+   regrouped for the vector classifier: row by low nibble, bit by high
+   nibble, split over lo (high nibble 0-7) and hi (8-15) so each fits a
+   byte shuffle.   */
+
+#define __dstr_byteset_has(set, c) \
+    ((set)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+
+static void __dstr_byteset_add(unsigned char *set, unsigned char *lo,
+                               unsigned char *hi, unsigned char c)
+{
+    set[c >> 3] |= 1 << (c & 7);
+    if (c < 0x80)
+        lo[c & 0xF] |= 1 << (c >> 4);
+    else
+        hi[c & 0xF] |= 1 << ((c >> 4) - 8);
+}
+
+#ifdef __DSTR_X86_SIMD
+
+/* Bit per byte of p[0..31] in the set.   */
+__attribute__((target("avx2")))
+static unsigned int __dstr_byteset_classify_avx2(const unsigned char *lo_tbl,
+                                                 const unsigned char *hi_tbl,
+                                                 const char *p)
+{
+    const __m256i lo = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)lo_tbl));
+    const __m256i hi = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)hi_tbl));
+    const __m256i bits = _mm256_setr_epi8(
+        1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+        1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i in, low, row, bit;
+
+    in = _mm256_loadu_si256((const __m256i *)p);
+    low = _mm256_and_si256(in, nibble);
+    /* The top bit of each byte picks the table.   */
+    row = _mm256_blendv_epi8(_mm256_shuffle_epi8(lo, low),
+                             _mm256_shuffle_epi8(hi, low), in);
+    bit = _mm256_shuffle_epi8(bits, _mm256_and_si256(
+        _mm256_srli_epi16(in, 4), nibble));
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+        _mm256_and_si256(row, bit), bit));
+}
+
+#endif /* __DSTR_X86_SIMD */
+
 /*                            DYNAMIC STRING                                 */
 
+/* String headers and data buffers are allocated through these helpers, so
+   that they can be recycled by the thread cache.   */
+#if defined(DSTR_THREAD_CACHE) && !defined(DSTR_MEM_CLEAR)
+
+/* Buffers up to 64KB are cached in power of two size classes from 16 bytes.
+   Cached and cacheable buffers are always allocated with the full size of
+   their class, while mem keeps the size asked for. */
+#define __DSTR_TCACHE_MIN_SHIFT 4
+#define __DSTR_TCACHE_CLASSES 13
+#define __DSTR_TCACHE_MAX (((size_t)1) << (__DSTR_TCACHE_MIN_SHIFT + \
+                                          __DSTR_TCACHE_CLASSES - 1))
+#define __DSTR_TCACHE_MAGAZINE 32
+
+typedef struct __dstr_tcache{
+    dstr *headers[__DSTR_TCACHE_MAGAZINE * 2];
+    unsigned int n_headers;
+    void *bufs[__DSTR_TCACHE_CLASSES][__DSTR_TCACHE_MAGAZINE];
+    unsigned int n_bufs[__DSTR_TCACHE_CLASSES];
+    size_t bytes; /* Bytes held by cache. */
+} __dstr_tcache;
+
+static __thread __dstr_tcache *__dstr_tcache_self;
+/* Set once the cache of the thread is released on exit, so that strings
+   free'd by later thread specific destructors go to dstr_free.   */
+static __thread int __dstr_tcache_exiting;
+static size_t __dstr_tcache_budget = DSTR_THREAD_CACHE_BYTES;
+static pthread_key_t __dstr_tcache_key;
+static pthread_once_t __dstr_tcache_once = PTHREAD_ONCE_INIT;
+
+static void __dstr_tcache_release(void *arg)
+{
+    __dstr_tcache *cache = arg;
+    unsigned int i, j;
+
+    for (i = 0; i < cache->n_headers; i++)
+        dstr_free(cache->headers[i]);
+    for (i = 0; i < __DSTR_TCACHE_CLASSES; i++){
+        for (j = 0; j < cache->n_bufs[i]; j++)
+            dstr_free(cache->bufs[i][j]);
+    }
+    dstr_free(cache);
+}
+
+static void __dstr_tcache_thread_exit(void *arg)
+{
+    __dstr_tcache_exiting = 1;
+    __dstr_tcache_self = 0;
+    __dstr_tcache_release(arg);
+}
+
+static void __dstr_tcache_init()
+{
+    pthread_key_create(&__dstr_tcache_key, __dstr_tcache_thread_exit);
+}
+
+/* Get cache of calling thread, created on first free.   */
+static __dstr_tcache *__dstr_tcache_get()
+{
+    __dstr_tcache *cache = __dstr_tcache_self;
+
+    if (cache || __dstr_tcache_exiting)
+        return cache;
+    pthread_once(&__dstr_tcache_once, __dstr_tcache_init);
+    cache = dstr_malloc(sizeof(__dstr_tcache));
+    if (!cache)
+        return 0;
+    memset(cache, 0, sizeof(__dstr_tcache));
+    pthread_setspecific(__dstr_tcache_key, cache);
+    __dstr_tcache_self = cache;
+    return cache;
+}
+
+/* Size class of buffer size, which must be at most __DSTR_TCACHE_MAX.   */
+static unsigned int __dstr_tcache_class(size_t sz)
+{
+    unsigned int class = 0;
+    while ((((size_t)1) << (class + __DSTR_TCACHE_MIN_SHIFT)) < sz)
+        class++;
+    return class;
+}
+
+static size_t __dstr_tcache_class_size(unsigned int class)
+{
+    return ((size_t)1) << (class + __DSTR_TCACHE_MIN_SHIFT);
+}
+
+static int __dstr_tcache_has_room(__dstr_tcache *cache, size_t sz)
+{
+    return cache->bytes + sz <=
+           __atomic_load_n(&__dstr_tcache_budget, __ATOMIC_RELAXED);
+}
+
+static dstr *__dstr_header_alloc()
+{
+    __dstr_tcache *cache = __dstr_tcache_self;
+
+    if (cache && cache->n_headers){
+        cache->bytes -= sizeof(dstr);
+        return cache->headers[--cache->n_headers];
+    }
+    return dstr_malloc(sizeof(dstr));
+}
+
+static void __dstr_header_free(dstr *str)
+{
+    __dstr_tcache *cache = __dstr_tcache_get();
+
+    if (cache && cache->n_headers < __DSTR_TCACHE_MAGAZINE * 2 &&
+            __dstr_tcache_has_room(cache, sizeof(dstr))){
+        cache->headers[cache->n_headers++] = str;
+        cache->bytes += sizeof(dstr);
+        return;
+    }
+    dstr_free(str);
+}
+
+static void *__dstr_buf_alloc(size_t sz)
+{
+    __dstr_tcache *cache = __dstr_tcache_self;
+    unsigned int class;
+
+    if (sz > __DSTR_TCACHE_MAX)
+        return dstr_malloc(sz);
+    class = __dstr_tcache_class(sz);
+    if (cache && cache->n_bufs[class]){
+        cache->bytes -= __dstr_tcache_class_size(class);
+        return cache->bufs[class][--cache->n_bufs[class]];
+    }
+    return dstr_malloc(__dstr_tcache_class_size(class));
+}
+
+static void __dstr_buf_free(void *ptr, size_t sz)
+{
+    __dstr_tcache *cache;
+    unsigned int class;
+
+    if (!ptr)
+        return;
+    if (sz && sz <= __DSTR_TCACHE_MAX){
+        cache = __dstr_tcache_get();
+        class = __dstr_tcache_class(sz);
+        if (cache && cache->n_bufs[class] < __DSTR_TCACHE_MAGAZINE &&
+                __dstr_tcache_has_room(cache, __dstr_tcache_class_size(class))){
+            cache->bufs[class][cache->n_bufs[class]++] = ptr;
+            cache->bytes += __dstr_tcache_class_size(class);
+            return;
+        }
+    }
+    dstr_free(ptr);
+}
+
+static void *__dstr_buf_realloc(void *ptr, size_t sz, size_t old_sz)
+{
+    void *tmp_ptr;
+
+    if (!ptr)
+        return __dstr_buf_alloc(sz);
+    if (old_sz > __DSTR_TCACHE_MAX && sz > __DSTR_TCACHE_MAX)
+        return dstr_realloc(ptr, sz, old_sz);
+    if (old_sz <= __DSTR_TCACHE_MAX && sz <= __DSTR_TCACHE_MAX &&
+            __dstr_tcache_class(sz) == __dstr_tcache_class(old_sz))
+        return ptr; /* Already big enough. */
+    tmp_ptr = __dstr_buf_alloc(sz);
+    if (!tmp_ptr)
+        return 0;
+    memcpy(tmp_ptr, ptr, old_sz < sz ? old_sz : sz);
+    __dstr_buf_free(ptr, old_sz);
+    return tmp_ptr;
+}
+
+/* Buffers taken over from the caller may be reused by the cache, so they
+   must have the full size of their class.   */
+static void *__dstr_buf_adopt(void *ptr, size_t sz)
+{
+    size_t class_sz;
+
+    if (sz > __DSTR_TCACHE_MAX)
+        return ptr;
+    class_sz = __dstr_tcache_class_size(__dstr_tcache_class(sz));
+    if (class_sz == sz)
+        return ptr;
+    return dstr_realloc(ptr, class_sz, sz);
+}
+
+void dstr_thread_cache_budget(size_t bytes)
+{
+    __atomic_store_n(&__dstr_tcache_budget, bytes, __ATOMIC_RELAXED);
+}
+
+void dstr_thread_cache_flush()
+{
+    if (!__dstr_tcache_self)
+        return;
+    pthread_setspecific(__dstr_tcache_key, 0);
+    __dstr_tcache_release(__dstr_tcache_self);
+    __dstr_tcache_self = 0;
+}
+
+#else
+
+#define __dstr_header_alloc() ((dstr *)dstr_malloc(sizeof(dstr)))
+#define __dstr_buf_alloc(sz) dstr_malloc(sz)
+#define __dstr_buf_realloc(ptr, sz, old_sz) dstr_realloc(ptr, sz, old_sz)
+#define __dstr_buf_adopt(ptr, sz) (ptr)
+#ifdef DSTR_MEM_CLEAR
+  #define __dstr_header_free(str) dstr_safe_free(str, sizeof(dstr))
+  #define __dstr_buf_free(ptr, sz) dstr_safe_free(ptr, sz)
+#else
+  #define __dstr_header_free(str) dstr_free(str)
+  #define __dstr_buf_free(ptr, sz) dstr_free(ptr)
+#endif
+
+void dstr_thread_cache_budget(size_t bytes)
+{
+}
+
+void dstr_thread_cache_flush()
+{
+}
+
+#endif /* DSTR_THREAD_CACHE */
+
 /* Allocate memory for dstr. It will allocate according to
    DSTR_MEM_EXPAND_RATE define.   */
 static int __dstr_alloc(dstr* str, size_t sz)
@@ -94,12 +882,16 @@ static int __dstr_alloc(dstr* str, size_t sz)
     size_t more_mem;
     void *tmp_ptr;
 
+    if (__dstr_immortal(str))
+        return 0;
     more_mem = (sz * sizeof(char)) * DSTR_MEM_EXPAND_RATE;
-    tmp_ptr = dstr_realloc(str->data, more_mem, str->mem);
+    tmp_ptr = __dstr_buf_realloc(str->data, more_mem, str->mem);
     if (tmp_ptr)
         str->data = tmp_ptr;
     else
         return 0;
+    __dstr_probe3(string__grow, str, str->mem, more_mem);
+    __dstr_stat_mem(str->mem, more_mem);
     str->mem = more_mem;
     return 1;
 }
@@ -109,12 +901,16 @@ static int __dstr_alloc_no_grow(dstr* str, size_t sz)
     size_t more_mem;
     void *tmp_ptr;
 
+    if (__dstr_immortal(str))
+        return 0;
     more_mem = sz * sizeof(char);
-    tmp_ptr = dstr_realloc(str->data, more_mem, str->mem);
+    tmp_ptr = __dstr_buf_realloc(str->data, more_mem, str->mem);
     if (tmp_ptr)
         str->data = tmp_ptr;
     else
         return 0;
+    __dstr_probe3(string__grow, str, str->mem, more_mem);
+    __dstr_stat_mem(str->mem, more_mem);
     str->mem = more_mem;
     return 1;
 }
@@ -128,17 +924,18 @@ static int __dstr_can_hold(const dstr *str, size_t sz)
         return (sz < str->mem);
 }
 
-/* strdup implementation for those who are not so fortunate.   */
-static char *__dstr_strdup(const char* str)
+/* Append n bytes to string and keep it terminated.   */
+static int __dstr_put_bytes(dstr *dest, const char *src, size_t n)
 {
-    char *cpy;
-    size_t len = strlen(str);
-
-    cpy = dstr_malloc(len + 1);
-    if (!cpy)
-        return 0;
-    cpy[len] = '\0';
-    return memcpy(cpy, str, len);
+    size_t total = dest->sz + n;
+    if (!__dstr_can_hold(dest, total + 1)){
+        if (!__dstr_alloc(dest, total + 1))
+            return 0;
+    }
+    memcpy(dest->data + dest->sz, src, n);
+    __dstr_set_sz(dest, total);
+    dest->data[total] = '\0';
+    return 1;
 }
 
 /* strndup implementation.   */
@@ -158,15 +955,23 @@ static char *__dstr_strndup(const char *str, size_t sz)
 
 void dstr_decref(dstr *str)
 {
+#ifdef DSTR_ATOMIC_REF
+    if (__atomic_load_n(&str->flags, __ATOMIC_RELAXED) & DSTR_IMMORTAL)
+        return;
+    if (!__atomic_sub_fetch(&str->ref, 1, __ATOMIC_ACQ_REL)){
+#else
+    if (__dstr_immortal(str))
+        return;
     str->ref--;
     if (!str->ref){
-#ifdef DSTR_MEM_CLEAR
-        dstr_safe_free(str->data, str->mem);
-        dstr_safe_free(str, sizeof (dstr));
-#else
-        dstr_free(str->data);
-        dstr_free(str);
 #endif
+        __dstr_stat_sub(strings, 1);
+        __dstr_stat_sub(bytes_used, str->sz);
+        __dstr_stat_mem(str->mem, 0);
+        __dstr_probe3(string__free, str, str->sz, str->mem);
+        __dstr_prof_free(str);
+        __dstr_buf_free(str->data, str->mem);
+        __dstr_header_free(str);
     }
 }
 
@@ -177,7 +982,7 @@ const char *dstr_to_cstr_const(const dstr* str)
 
 dstr *dstr_new()
 {
-    dstr *str = dstr_malloc(sizeof(dstr));
+    dstr *str = __dstr_header_alloc();
 
     if (!str)
         return 0;
@@ -185,53 +990,96 @@ dstr *dstr_new()
     str->data = 0;
     str->mem = 0;
     str->ref = 1;
+    str->flags = 0;
+    __dstr_stat_add(strings, 1);
+    __dstr_probe2(string__new, str, str->mem);
+    __dstr_prof_alloc(str, __DSTR_PROF_STRING, sizeof(dstr));
     return str;
 }
 
 dstr *dstr_with_initial(const char *initial)
 {
-    dstr *str = dstr_malloc(sizeof(dstr));
+    return dstr_with_initialn(initial, strlen(initial));
+}
+
+dstr *dstr_with_initialn(const char *initial, size_t n)
+{
+    dstr *str = __dstr_header_alloc();
+    size_t len;
 
     if (!str)
         return 0;
-    str->sz = strlen(initial);
-    str->mem = (str->sz + 1) * sizeof(char);
-    str->data = __dstr_strdup(initial);
-    if (!str->data)
+    str->data = __dstr_buf_alloc(n + 1);
+    if (!str->data){
+        __dstr_header_free(str);
         return 0;
+    }
+    /* Initial string may be shorter than n, fill up with nul.   */
+    len = strnlen(initial, n);
+    memcpy(str->data, initial, len);
+    memset(str->data + len, 0, n - len + 1);
+    str->sz = n;
+    str->mem = (n + 1) * sizeof(char);
     str->ref = 1;
+    str->flags = 0;
+    __dstr_stat_add(strings, 1);
+    __dstr_stat_add(bytes_used, n);
+    __dstr_stat_mem(0, str->mem);
+    __dstr_probe2(string__new, str, str->mem);
+    __dstr_prof_alloc(str, __DSTR_PROF_STRING, sizeof(dstr) + str->mem);
     return str;
 }
 
-dstr *dstr_with_initialn(const char *initial, size_t n)
+dstr *dstr_with_prealloc(size_t sz)
 {
-    dstr *str = dstr_malloc(sizeof(dstr));
+    dstr *str = __dstr_header_alloc();
+    size_t pre_alloc_mem = sizeof(char) * sz;
 
     if (!str)
         return 0;
-    str->sz = n;
-    str->data = __dstr_strndup(initial, n);
-    if (!str->data)
+    str->sz = 0;
+    str->data = __dstr_buf_alloc(pre_alloc_mem ? pre_alloc_mem : 1);
+    if (!str->data){
+        __dstr_header_free(str);
         return 0;
-    str->mem = (str->sz + 1) * sizeof(char);
+    }
+    str->mem = pre_alloc_mem ? pre_alloc_mem : 1;
+    str->data[0] = '\0';
     str->ref = 1;
+    str->flags = 0;
+    __dstr_stat_add(strings, 1);
+    __dstr_stat_mem(0, str->mem);
+    __dstr_probe2(string__new, str, str->mem);
+    __dstr_prof_alloc(str, __DSTR_PROF_STRING, sizeof(dstr) + str->mem);
     return str;
 }
 
-dstr *dstr_with_prealloc(size_t sz)
+dstr *dstr_adopt(char *buf, size_t len, size_t cap)
 {
-    dstr *str = dstr_malloc(sizeof(dstr));
-    size_t pre_alloc_mem = sizeof(char) * sz;
+    dstr *str;
+    char *data;
 
+    if (!buf || len >= cap)
+        return 0;
+    str = __dstr_header_alloc();
     if (!str)
         return 0;
-    str->sz = 0;
-    str->data = dstr_malloc(pre_alloc_mem);
-    if (!str->data)
+    data = __dstr_buf_adopt(buf, cap);
+    if (!data){
+        __dstr_header_free(str);
         return 0;
-    str->mem = pre_alloc_mem;
-    str->data[0] = '\0';
+    }
+    data[len] = '\0';
+    str->data = data;
+    str->sz = len;
+    str->mem = cap;
     str->ref = 1;
+    str->flags = 0;
+    __dstr_stat_add(strings, 1);
+    __dstr_stat_add(bytes_used, len);
+    __dstr_stat_mem(0, str->mem);
+    __dstr_probe2(string__new, str, str->mem);
+    __dstr_prof_alloc(str, __DSTR_PROF_STRING, sizeof(dstr) + str->mem);
     return str;
 }
 
@@ -240,23 +1088,48 @@ char *dstr_copy_to_cstr(const dstr* str)
     return __dstr_strndup(str->data, str->sz + 1);
 }
 
-char dstr_at(const dstr* str, size_t i)
+char *dstr_release(dstr *str, size_t *len)
 {
-    return str->data[i];
-}
+    char *data = str->data;
 
-int dstr_compact(dstr *str)
+    /* Immortal strings never have a count of one.   */
+    if (__atomic_load_n(&str->ref, __ATOMIC_RELAXED) != 1)
+        return 0;
+    if (!data){
+        data = dstr_malloc(1);
+        if (!data)
+            return 0;
+        data[0] = '\0';
+    }
+    if (len)
+        *len = str->sz;
+    __dstr_stat_sub(strings, 1);
+    __dstr_stat_sub(bytes_used, str->sz);
+    __dstr_stat_mem(str->mem, 0);
+    __dstr_probe3(string__free, str, str->sz, str->mem);
+    __dstr_prof_free(str);
+    __dstr_header_free(str);
+    return data;
+}
+
+char dstr_at(const dstr* str, size_t i)
+{
+    return str->data[i];
+}
+
+int dstr_compact(dstr *str)
 {
     int alloc;
     void *tmp_ptr;
 
     if (str->mem > str->sz){
         alloc = (sizeof(char) * str->sz + sizeof(char)) ;
-        tmp_ptr = dstr_realloc(str->data, alloc, str->mem);
+        tmp_ptr = __dstr_buf_realloc(str->data, alloc, str->mem);
         if (tmp_ptr)
             str->data = tmp_ptr;
         else
             return 0;
+        __dstr_stat_mem(str->mem, alloc);
         str->mem = alloc;
         if (str->data)
             return 1;
@@ -279,6 +1152,7 @@ int dstr_contains(const dstr *haystack, const char *needle)
     const char* ptr = haystack->data;
     size_t n = 0;
 
+    __dstr_probe2(search__contains, haystack->sz, needle);
     while ((ptr = strstr(ptr, needle))){
         n++;
         ptr++;
@@ -303,6 +1177,7 @@ dstr_vector *dstr_split_to_vector(const dstr *str, const char *sep)
     size_t count, sep_len, occ_len;
     const char *cstr, *occ_start, *occ_end;
 
+    __dstr_probe2(split__vector, str->sz, sep);
     cstr = dstr_to_cstr_const(str);
     occ_start = cstr;
     count = 0;
@@ -347,6 +1222,7 @@ dstr_list *dstr_split_to_list(const dstr *str, const char *sep)
     size_t occ_len;
     const char *cstr, *occ_start, *occ_end;
 
+    __dstr_probe2(split__list, str->sz, sep);
     cstr = dstr_to_cstr_const(str);
     occ_start = cstr;
 
@@ -451,8 +1327,9 @@ int dstr_append(dstr* dest, const dstr* src)
         if (!__dstr_alloc(dest, total + 1))
             return 0;
     }
-    memcpy(dest->data+dest->sz, src->data, src->sz + 1);
-    dest->sz = total;
+    memcpy(dest->data+dest->sz, src->data, src->sz);
+    dest->data[total] = '\0';
+    __dstr_set_sz(dest, total);
     return 1;
 }
 
@@ -464,7 +1341,7 @@ int dstr_append_cstr(dstr* dest, const char *src)
             return 0;
     }
     strcpy(dest->data+dest->sz, src);
-    dest->sz = total;
+    __dstr_set_sz(dest, total);
     return 1;
 }
 
@@ -476,37 +1353,474 @@ int dstr_append_cstrn(dstr* dest, const char *src, size_t n)
             return 0;
     }
     memcpy(dest->data+dest->sz, src, n);
-    dest->sz = total;
+    dest->data[total] = '\0';
+    __dstr_set_sz(dest, total);
     return 1;
 }
 
 int dstr_sprintf(dstr *str, const char *fmt, ...)
 {
-    int len, new_sz;
-    size_t space = str->mem - (str->sz + 1);
-    char *start_ptr = str->data + str->sz;
+    int len;
+    size_t space = str->mem > str->sz ? str->mem - str->sz : 0;
     va_list ap, ap_c;
 
-    va_copy(ap_c, ap);
     va_start(ap, fmt);
-    len = vsnprintf(start_ptr, space, fmt, ap);
+    va_copy(ap_c, ap);
+    len = vsnprintf(space ? str->data + str->sz : 0, space, fmt, ap);
     va_end(ap);
-    new_sz = str->sz + len + 1;
-    if (space <= len){
-        if (!__dstr_alloc(str, new_sz))
-            return 0;
-        start_ptr = str->data + str->sz;
-        va_start(ap_c, fmt);
-        vsnprintf(start_ptr, new_sz, fmt, ap_c);
+    if (len < 0){
         va_end(ap_c);
+        return 0;
+    }
+    if ((size_t)len >= space){
+        if (!__dstr_alloc(str, str->sz + len + 1)){
+            va_end(ap_c);
+            return 0;
+        }
+        vsnprintf(str->data + str->sz, len + 1, fmt, ap_c);
+    }
+    va_end(ap_c);
+    __dstr_set_sz(str, str->sz + len);
+    return 1;
+}
+
+/* Two digit lookup table for integer formatting.   */
+static const char __dstr_digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static int __dstr_u64_digits(uint64_t value)
+{
+    int n = 1;
+    for (;;){
+        if (value < 10) return n;
+        if (value < 100) return n + 1;
+        if (value < 1000) return n + 2;
+        if (value < 10000) return n + 3;
+        value /= 10000;
+        n += 4;
+    }
+}
+
+/* Write value in decimal to buf, which must hold 20 characters. Returns
+   number of characters written. No sentinel is written.   */
+static int __dstr_fmt_u64(char *buf, uint64_t value)
+{
+    int len = __dstr_u64_digits(value);
+    char *pos = buf + len;
+    unsigned int idx;
+
+    while (value >= 100){
+        idx = (value % 100) * 2;
+        value /= 100;
+        *--pos = __dstr_digit_pairs[idx + 1];
+        *--pos = __dstr_digit_pairs[idx];
+    }
+    if (value >= 10){
+        idx = value * 2;
+        *--pos = __dstr_digit_pairs[idx + 1];
+        *--pos = __dstr_digit_pairs[idx];
+    } else {
+        *--pos = '0' + value;
+    }
+    return len;
+}
+
+int dstr_append_u64(dstr *str, uint64_t value)
+{
+    char buf[20];
+    return __dstr_put_bytes(str, buf, __dstr_fmt_u64(buf, value));
+}
+
+int dstr_append_i64(dstr *str, int64_t value)
+{
+    char buf[21];
+    uint64_t abs_value = value;
+
+    if (value < 0){
+        buf[0] = '-';
+        abs_value = 0 - abs_value;
+        return __dstr_put_bytes(str, buf, __dstr_fmt_u64(buf + 1, abs_value) + 1);
+    }
+    return __dstr_put_bytes(str, buf, __dstr_fmt_u64(buf, abs_value));
+}
+
+int dstr_append_u64_hex(dstr *str, uint64_t value)
+{
+    static const char hex[] = "0123456789abcdef";
+    char buf[16];
+    char *pos = buf + sizeof(buf);
+
+    do {
+        *--pos = hex[value & 0xf];
+        value >>= 4;
+    } while (value);
+    return __dstr_put_bytes(str, pos, buf + sizeof(buf) - pos);
+}
+
+/* Shortest round trip double to decimal conversion. This is the Ryu
+   algorithm by Ulf Adams, "Ryu: Fast Float-to-String Conversion", PLDI 2018.
+   The power of five tables are in dstr_d2s_table.h.   */
+
+/* floor(log10(2^e)) for 0 <= e <= 1650.   */
+static uint32_t __dstr_log10_pow2(int32_t e)
+{
+    return (((uint32_t)e) * 78913) >> 18;
+}
+
+/* floor(log10(5^e)) for 0 <= e <= 2620.   */
+static uint32_t __dstr_log10_pow5(int32_t e)
+{
+    return (((uint32_t)e) * 732923) >> 20;
+}
+
+/* ceil(log2(5^e)), or 1 if e is 0.   */
+static int32_t __dstr_pow5_bits(int32_t e)
+{
+    return (int32_t)(((((uint32_t)e) * 1217359) >> 19) + 1);
+}
+
+static int __dstr_multiple_of_pow5(uint64_t value, uint32_t p)
+{
+    uint32_t count = 0;
+    while (value % 5 == 0){
+        value /= 5;
+        count++;
+    }
+    return count >= p;
+}
+
+static int __dstr_multiple_of_pow2(uint64_t value, uint32_t p)
+{
+    return (value & ((((uint64_t)1) << p) - 1)) == 0;
+}
+
+/* (m * mul) >> j, where mul is a 128 bit value and 64 < j < 128.   */
+#ifdef __SIZEOF_INT128__
+static uint64_t __dstr_mul_shift64(uint64_t m, const uint64_t *mul, int32_t j)
+{
+    unsigned __int128 b0 = ((unsigned __int128)m) * mul[0];
+    unsigned __int128 b2 = ((unsigned __int128)m) * mul[1];
+    return (uint64_t)(((b0 >> 64) + b2) >> (j - 64));
+}
+#else
+/* Full 64x64 bit product from 32 bit halves, low word returned.   */
+static uint64_t __dstr_umul128(uint64_t a, uint64_t b, uint64_t *hi)
+{
+    uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+    uint64_t b00 = a_lo * b_lo, b01 = a_lo * b_hi;
+    uint64_t b10 = a_hi * b_lo, b11 = a_hi * b_hi;
+    uint64_t mid1 = b10 + (b00 >> 32);
+    uint64_t mid2 = b01 + (uint32_t)mid1;
+
+    *hi = b11 + (mid1 >> 32) + (mid2 >> 32);
+    return (mid2 << 32) | (uint32_t)b00;
+}
+
+static uint64_t __dstr_mul_shift64(uint64_t m, const uint64_t *mul, int32_t j)
+{
+    uint64_t hi0, hi2, lo2, lo, hi;
+
+    __dstr_umul128(m, mul[0], &hi0);
+    lo2 = __dstr_umul128(m, mul[1], &hi2);
+    lo = lo2 + hi0;
+    hi = hi2 + (lo < lo2);
+    j -= 64;
+    return (hi << (64 - j)) | (lo >> j);
+}
+#endif /* __SIZEOF_INT128__ */
+
+/* Convert double bits to shortest decimal digits and exponent, such that the
+   value is digits * 10^exponent.   */
+static void __dstr_d2d(uint64_t mantissa, uint32_t exponent,
+                       uint64_t *digits, int32_t *exp10)
+{
+    int32_t e2, e10, removed = 0;
+    uint64_t m2, mv, vr, vp, vm, output;
+    uint32_t mm_shift, q;
+    int32_t k, i, j;
+    int even, vm_trailing_zeros = 0, vr_trailing_zeros = 0;
+    uint8_t last_removed = 0;
+
+    if (exponent == 0){
+        e2 = 1 - 1023 - 52 - 2;
+        m2 = mantissa;
+    } else {
+        e2 = (int32_t)exponent - 1023 - 52 - 2;
+        m2 = (((uint64_t)1) << 52) | mantissa;
+    }
+    even = (m2 & 1) == 0;
+
+    /* Step 2: determine the interval of valid decimal representations.   */
+    mv = 4 * m2;
+    mm_shift = mantissa != 0 || exponent <= 1;
+
+    /* Step 3: convert to a decimal power base using 128 bit arithmetic.   */
+    if (e2 >= 0){
+        q = __dstr_log10_pow2(e2) - (e2 > 3);
+        e10 = (int32_t)q;
+        k = __DSTR_POW5_INV_BITCOUNT + __dstr_pow5_bits((int32_t)q) - 1;
+        i = -e2 + (int32_t)q + k;
+        vr = __dstr_mul_shift64(4 * m2, __DSTR_POW5_INV_SPLIT[q], i);
+        vp = __dstr_mul_shift64(4 * m2 + 2, __DSTR_POW5_INV_SPLIT[q], i);
+        vm = __dstr_mul_shift64(4 * m2 - 1 - mm_shift,
+                                __DSTR_POW5_INV_SPLIT[q], i);
+        if (q <= 21){
+            /* Only one of mp, mv, and mm can be a multiple of 5, if any.   */
+            if (mv % 5 == 0)
+                vr_trailing_zeros = __dstr_multiple_of_pow5(mv, q);
+            else if (even)
+                vm_trailing_zeros = __dstr_multiple_of_pow5(mv - 1 - mm_shift, q);
+            else
+                vp -= __dstr_multiple_of_pow5(mv + 2, q);
+        }
+    } else {
+        q = __dstr_log10_pow5(-e2) - (-e2 > 1);
+        e10 = (int32_t)q + e2;
+        i = -e2 - (int32_t)q;
+        k = __dstr_pow5_bits(i) - __DSTR_POW5_BITCOUNT;
+        j = (int32_t)q - k;
+        vr = __dstr_mul_shift64(4 * m2, __DSTR_POW5_SPLIT[i], j);
+        vp = __dstr_mul_shift64(4 * m2 + 2, __DSTR_POW5_SPLIT[i], j);
+        vm = __dstr_mul_shift64(4 * m2 - 1 - mm_shift, __DSTR_POW5_SPLIT[i], j);
+        if (q <= 1){
+            /* {vr,vp,vm} is trailing zeros if {mv,mp,mm} has at least q
+               trailing 0 bits. mv = 4 * m2, so it always has at least two.  */
+            vr_trailing_zeros = 1;
+            if (even)
+                vm_trailing_zeros = mm_shift == 1;
+            else
+                --vp;
+        } else if (q < 63){
+            vr_trailing_zeros = __dstr_multiple_of_pow2(mv, q);
+        }
+    }
+
+    /* Step 4: find the shortest decimal representation in the interval.   */
+    if (vm_trailing_zeros || vr_trailing_zeros){
+        while (vp / 10 > vm / 10){
+            vm_trailing_zeros &= vm % 10 == 0;
+            vr_trailing_zeros &= last_removed == 0;
+            last_removed = (uint8_t)(vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        if (vm_trailing_zeros){
+            while (vm % 10 == 0){
+                vr_trailing_zeros &= last_removed == 0;
+                last_removed = (uint8_t)(vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed++;
+            }
+        }
+        if (vr_trailing_zeros && last_removed == 5 && vr % 2 == 0)
+            last_removed = 4; /* Round even if exactly between two values. */
+        output = vr + ((vr == vm && (!even || !vm_trailing_zeros))
+                       || last_removed >= 5);
+    } else {
+        int round_up = 0;
+        while (vp / 10 > vm / 10){
+            round_up = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        output = vr + (vr == vm || round_up);
+    }
+    *digits = output;
+    *exp10 = e10 + removed;
+}
+
+int dstr_append_double(dstr *str, double value)
+{
+    char buf[32], digits[20];
+    char *pos = buf;
+    uint64_t bits, mantissa, out_digits;
+    uint32_t exponent;
+    int32_t exp10, sci_exp, n, i;
+
+    memcpy(&bits, &value, sizeof(bits));
+    mantissa = bits & ((((uint64_t)1) << 52) - 1);
+    exponent = (uint32_t)((bits >> 52) & 0x7ff);
+    if (bits >> 63)
+        *pos++ = '-';
+    if (exponent == 0x7ff){
+        if (mantissa)
+            return __dstr_put_bytes(str, "nan", 3);
+        memcpy(pos, "inf", 3);
+        return __dstr_put_bytes(str, buf, pos + 3 - buf);
+    }
+    if (!exponent && !mantissa){
+        *pos++ = '0';
+        return __dstr_put_bytes(str, buf, pos - buf);
+    }
+
+    __dstr_d2d(mantissa, exponent, &out_digits, &exp10);
+    n = __dstr_fmt_u64(digits, out_digits);
+    sci_exp = exp10 + n - 1;
+
+    if (sci_exp >= -5 && sci_exp < 17){
+        if (exp10 >= 0){
+            /* Integer, pad with zeros.   */
+            memcpy(pos, digits, n);
+            pos += n;
+            for (i = 0; i < exp10; i++)
+                *pos++ = '0';
+        } else if (sci_exp >= 0){
+            /* Decimal point inside digits.   */
+            memcpy(pos, digits, sci_exp + 1);
+            pos += sci_exp + 1;
+            *pos++ = '.';
+            memcpy(pos, digits + sci_exp + 1, n - sci_exp - 1);
+            pos += n - sci_exp - 1;
+        } else {
+            /* Leading zeros after the decimal point.   */
+            *pos++ = '0';
+            *pos++ = '.';
+            for (i = -1; i > sci_exp; i--)
+                *pos++ = '0';
+            memcpy(pos, digits, n);
+            pos += n;
+        }
+    } else {
+        *pos++ = digits[0];
+        if (n > 1){
+            *pos++ = '.';
+            memcpy(pos, digits + 1, n - 1);
+            pos += n - 1;
+        }
+        *pos++ = 'e';
+        if (sci_exp < 0){
+            *pos++ = '-';
+            sci_exp = -sci_exp;
+        } else {
+            *pos++ = '+';
+        }
+        pos += __dstr_fmt_u64(pos, sci_exp);
+    }
+    return __dstr_put_bytes(str, buf, pos - buf);
+}
+
+int dstr_to_i64(const dstr *str, int64_t *value)
+{
+    const char *pos = str->data, *end = str->data + str->sz;
+    uint64_t result = 0, limit = INT64_MAX;
+    unsigned int digit;
+    int negative = 0;
+
+    if (!str->sz)
+        return 0;
+    if (*pos == '-' || *pos == '+'){
+        negative = *pos == '-';
+        if (negative)
+            limit = (uint64_t)INT64_MAX + 1;
+        pos++;
+    }
+    if (pos == end)
+        return 0;
+    for (; pos < end; pos++){
+        digit = (unsigned char)*pos - '0';
+        if (digit > 9)
+            return 0;
+        if (result > (limit - digit) / 10)
+            return 0; /* Overflow. */
+        result = result * 10 + digit;
+    }
+    *value = negative ? (int64_t)(0 - result) : (int64_t)result;
+    return 1;
+}
+
+/* C locale for numbers, so strtod takes '.' as decimal point whatever
+   LC_NUMERIC is set to. Stays 0 if it can not be created, strtod then
+   follows the current locale.   */
+static locale_t __dstr_c_numeric;
+static pthread_once_t __dstr_c_numeric_once = PTHREAD_ONCE_INIT;
+
+static void __dstr_c_numeric_init()
+{
+    __dstr_c_numeric = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+}
+
+int dstr_to_double(const dstr *str, double *value)
+{
+    /* Powers of ten that are exact as doubles.   */
+    static const double exact_pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *pos = str->data, *end = str->data + str->sz;
+    uint64_t mantissa = 0;
+    int negative = 0, digits = 0, exp10 = 0, seen_point = 0;
+    unsigned int digit;
+    char *parse_end;
+    double result;
+    locale_t saved = 0;
+    int range;
+
+    if (!str->sz || isspace((unsigned char)*pos))
+        return 0;
+
+    /* Fast path: at most 15 significant digits and a small power of ten can
+       be computed exactly with a single rounding (Clinger's fast path).  */
+    if (*pos == '-' || *pos == '+'){
+        negative = *pos == '-';
+        pos++;
+    }
+    for (; pos < end; pos++){
+        if (*pos == '.' && !seen_point){
+            seen_point = 1;
+            continue;
+        }
+        digit = (unsigned char)*pos - '0';
+        if (digit > 9 || ++digits > 15)
+            break;
+        mantissa = mantissa * 10 + digit;
+        exp10 -= seen_point;
+    }
+    if (pos == end && digits && digits <= 15){
+        result = (double)mantissa;
+        if (exp10 < 0)
+            result /= exact_pow10[-exp10];
+        *value = negative ? -result : result;
+        return 1;
     }
-    str->sz = new_sz - 1;
+
+    pthread_once(&__dstr_c_numeric_once, __dstr_c_numeric_init);
+    if (__dstr_c_numeric)
+        saved = uselocale(__dstr_c_numeric);
+    errno = 0;
+    result = strtod(str->data, &parse_end);
+    range = errno == ERANGE;
+    if (__dstr_c_numeric)
+        uselocale(saved);
+    if (parse_end != end ||
+            (range && (result == HUGE_VAL || result == -HUGE_VAL)))
+        return 0;
+    *value = result;
     return 1;
 }
 
 void dstr_to_upper(dstr *str)
 {
     int sz = str->sz;
+
+    if (__dstr_immortal(str))
+        return;
+    str->flags &= ~DSTR_UTF8_VALID;
     while(sz--){
         str->data[sz] = toupper(str->data[sz]);
     }
@@ -515,6 +1829,10 @@ void dstr_to_upper(dstr *str)
 void dstr_to_lower(dstr *str)
 {
     int sz = str->sz;
+
+    if (__dstr_immortal(str))
+        return;
+    str->flags &= ~DSTR_UTF8_VALID;
     while(sz--){
         str->data[sz] = tolower(str->data[sz]);
     }
@@ -522,8 +1840,9 @@ void dstr_to_lower(dstr *str)
 
 void dstr_capitalize(dstr *str)
 {
-    if (!str->sz)
+    if (!str->sz || __dstr_immortal(str))
         return;
+    str->flags &= ~DSTR_UTF8_VALID;
     str->data[0] = toupper(str->data[0]);
 }
 
@@ -548,7 +1867,7 @@ int dstr_prepend(dstr* dest, const dstr *src)
         return 0;
     if (!memcpy(dest->data, src->data, src->sz))
         return 0;
-    dest->sz = total;
+    __dstr_set_sz(dest, total);
     return 1;
 }
 
@@ -574,7 +1893,7 @@ int dstr_prepend_cstr(dstr* dest, const char *src)
         return 0;
     if (!memcpy(dest->data, src, src_len))
         return 0;
-    dest->sz = total;
+    __dstr_set_sz(dest, total);
     return 1;
 }
 
@@ -590,23 +1909,25 @@ int dstr_prepend_cstrn(dstr* dest, const char *src, size_t n)
         return 0;
     if (!memcpy(dest->data, src, n))
         return 0;
-    dest->sz = total;
+    __dstr_set_sz(dest, total);
     return 1;
 }
 
 int dstr_swap(dstr *dest, const dstr *src)
 {
-    dest->sz = 0;
+    if (__dstr_immortal(dest))
+        return 0;
+    __dstr_set_sz(dest, 0);
     return dstr_append(dest, src);
 }
 
 int dstr_erase(dstr *str, size_t first, size_t last)
 {
-    if (str->sz < first || last == first)
+    if (str->sz < last || last <= first || __dstr_immortal(str))
         return 0;
     memmove(str->data + first, str->data + last, str->sz - last + 1);
-    str->sz -= last - first;
-    return 0;
+    __dstr_set_sz(str, str->sz - (last - first));
+    return 1;
 }
 
 int dstr_insert(dstr *dest, const dstr *src, size_t pos)
@@ -627,8 +1948,9 @@ int dstr_insert_cstrn(dstr *dest, const char *src, size_t pos, size_t n)
     if (!__dstr_can_hold(dest, storage))
         if (!__dstr_alloc(dest, storage))
             return 0;
-    memmove(dest->data + pos + n, dest->data + pos, n + 1);
+    memmove(dest->data + pos + n, dest->data + pos, dest->sz - pos + 1);
     memcpy(dest->data + pos, src, n);
+    __dstr_set_sz(dest, dest->sz + n);
     return 1;
 }
 
@@ -641,17 +1963,22 @@ dstr *dstr_copy(const dstr *copy)
     rc = dstr_append(str, copy);
     if (!rc)
         return 0;
+    str->flags |= __atomic_load_n(&copy->flags, __ATOMIC_RELAXED) &
+        DSTR_UTF8_VALID;
     return str;
 }
 
 void dstr_clear(dstr *str)
 {
     int i = str->mem;
+
+    if (__dstr_immortal(str))
+        return;
     while (i){
         i--;
         str->data[i] = 0;
     }
-    str->sz = 0;
+    __dstr_set_sz(str, 0);
 }
 
 int dstr_print(const dstr *src)
@@ -662,14 +1989,16 @@ int dstr_print(const dstr *src)
 int dstr_resize_fill(dstr *str, size_t n, char fill)
 {
     size_t n_with_sz = n + sizeof(char);
+    if (__dstr_immortal(str))
+        return 0;
     if (n < str->sz){
-        str->sz = n;
+        __dstr_set_sz(str, n);
         str->data[n] = '\0';
     } else {
         if (!__dstr_alloc(str, n_with_sz))
             return 0;
         memset(str->data + str->sz, fill, n);
-        str->sz = n;
+        __dstr_set_sz(str, n);
         str->data[str->sz + 1] = '\0';
     }
     return 1;
@@ -680,449 +2009,3686 @@ int dstr_resize(dstr *str, size_t n)
     return dstr_resize_fill(str, n, '\0');
 }
 
-/*                          DYNAMIC STRING LIST                             */
+/*                                 UTF-8                                    */
 
-dstr_list *dstr_list_new()
+/* Scalar validation following the well formed byte sequences table of the
+   Unicode standard (table 3-7).   */
+static int __dstr_utf8_valid_scalar(const unsigned char *p, size_t n)
 {
-    dstr_list *list = dstr_malloc(sizeof(dstr_list));
-    if (!list)
-        return 0;
-    list->head = 0;
-    list->tail = 0;
-    list->ref = 1;
-    return list;
+    const unsigned char *end = p + n;
+    uint64_t word;
+    unsigned char c;
+
+    while (p < end){
+        /* Skip ASCII eight bytes at a time.   */
+        if (end - p >= 8){
+            memcpy(&word, p, 8);
+            if (!(word & 0x8080808080808080ULL)){
+                p += 8;
+                continue;
+            }
+        }
+        c = *p;
+        if (c < 0x80){
+            p++;
+        } else if (c >= 0xC2 && c <= 0xDF){
+            if (end - p < 2 || (p[1] & 0xC0) != 0x80)
+                return 0;
+            p += 2;
+        } else if (c >= 0xE0 && c <= 0xEF){
+            if (end - p < 3 || (p[1] & 0xC0) != 0x80 ||
+                    (p[2] & 0xC0) != 0x80)
+                return 0;
+            if ((c == 0xE0 && p[1] < 0xA0) || (c == 0xED && p[1] > 0x9F))
+                return 0; /* Overlong or surrogate. */
+            p += 3;
+        } else if (c >= 0xF0 && c <= 0xF4){
+            if (end - p < 4 || (p[1] & 0xC0) != 0x80 ||
+                    (p[2] & 0xC0) != 0x80 || (p[3] & 0xC0) != 0x80)
+                return 0;
+            if ((c == 0xF0 && p[1] < 0x90) || (c == 0xF4 && p[1] > 0x8F))
+                return 0; /* Overlong or above U+10FFFF. */
+            p += 4;
+        } else {
+            return 0;
+        }
+    }
+    return 1;
 }
 
-int dstr_list_add(dstr_list *list, dstr *str)
+static size_t __dstr_utf8_count_scalar(const unsigned char *p, size_t n)
 {
-    dstr_link *link;
-
-    link = calloc(1, sizeof(dstr_link));
-    if (!link)
-        return 0;
+    size_t count = 0, i;
 
-    link->str = str;
-    dstr_incref(str);
+    for (i = 0; i < n; i++)
+        count += (p[i] & 0xC0) != 0x80;
+    return count;
+}
 
-    if (list->tail){
-        list->tail->next = link;
-        link->prev = list->tail;
-        list->tail = link;
-    } else {
-        list->head = link;
-        list->tail = link;
+#ifdef __DSTR_X86_SIMD
+
+/* Error classes of two byte sequences, see "Validating UTF-8 In Less Than
+   One Instruction Per Byte" by Keiser and Lemire. Each table is indexed by
+   a nibble of a byte pair, a pair is invalid if the classes of all three
+   nibbles share a bit.   */
+#define __U8_TOO_SHORT (1 << 0) /* Lead byte not followed by continuation. */
+#define __U8_TOO_LONG (1 << 1) /* Continuation after ASCII. */
+#define __U8_OVERLONG_3 (1 << 2)
+#define __U8_TOO_LARGE (1 << 3)
+#define __U8_SURROGATE (1 << 4)
+#define __U8_OVERLONG_2 (1 << 5)
+#define __U8_TOO_LARGE_1000 (1 << 6)
+#define __U8_OVERLONG_4 (1 << 6)
+#define __U8_TWO_CONTS (1 << 7) /* Continuation may be third or fourth. */
+#define __U8_CARRY (__U8_TOO_SHORT | __U8_TOO_LONG | __U8_TWO_CONTS)
+
+#define __dstr_avx2_table(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p) \
+    _mm256_setr_epi8(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p, \
+                     a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)
+
+__attribute__((target("avx2")))
+static __m256i __dstr_avx2_prev(__m256i input, __m256i prev_input, int n)
+{
+    __m256i shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+
+    switch (n){
+    case 1:
+        return _mm256_alignr_epi8(input, shifted, 15);
+    case 2:
+        return _mm256_alignr_epi8(input, shifted, 14);
+    default:
+        return _mm256_alignr_epi8(input, shifted, 13);
     }
-    return 1;
 }
 
-int dstr_list_add_decref(dstr_list *dest, dstr *str)
+__attribute__((target("avx2")))
+static __m256i __dstr_avx2_utf8_errors(__m256i input, __m256i prev_input)
 {
-    int rc = dstr_list_add(dest, str);
-    if (rc)
-        dstr_decref(str);
-    return rc;
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i byte_1_high_tbl = __dstr_avx2_table(
+        __U8_TOO_LONG, __U8_TOO_LONG, __U8_TOO_LONG, __U8_TOO_LONG,
+        __U8_TOO_LONG, __U8_TOO_LONG, __U8_TOO_LONG, __U8_TOO_LONG,
+        __U8_TWO_CONTS, __U8_TWO_CONTS, __U8_TWO_CONTS, __U8_TWO_CONTS,
+        __U8_TOO_SHORT | __U8_OVERLONG_2,
+        __U8_TOO_SHORT,
+        __U8_TOO_SHORT | __U8_OVERLONG_3 | __U8_SURROGATE,
+        __U8_TOO_SHORT | __U8_TOO_LARGE | __U8_TOO_LARGE_1000 |
+            __U8_OVERLONG_4);
+    const __m256i byte_1_low_tbl = __dstr_avx2_table(
+        __U8_CARRY | __U8_OVERLONG_3 | __U8_OVERLONG_2 | __U8_OVERLONG_4,
+        __U8_CARRY | __U8_OVERLONG_2,
+        __U8_CARRY,
+        __U8_CARRY,
+        __U8_CARRY | __U8_TOO_LARGE,
+        __U8_CARRY | __U8_TOO_LARGE | __U8_TOO_LARGE_1000,
+        __U8_CARRY | __U8_TOO_LARGE | __U8_TOO_LARGE_1000,
+        __U8_CARRY | __U8_TOO_LARGE | __U8_TOO_LARGE_1000,
+        __U8_CARRY | __U8_TOO_LARGE | __U8_TOO_LARGE_1000,
+        __U8_CARRY | __U8_TOO_LARGE | __U8_TOO_LARGE_1000,
+        __U8_CARRY | __U8_TOO_LARGE | __U8_TOO_LARGE_1000,
+        __U8_CARRY | __U8_TOO_LARGE | __U8_TOO_LARGE_1000,
+        __U8_CARRY | __U8_TOO_LARGE | __U8_TOO_LARGE_1000,
+        __U8_CARRY | __U8_TOO_LARGE | __U8_TOO_LARGE_1000 | __U8_SURROGATE,
+        __U8_CARRY | __U8_TOO_LARGE | __U8_TOO_LARGE_1000,
+        __U8_CARRY | __U8_TOO_LARGE | __U8_TOO_LARGE_1000);
+    const __m256i byte_2_high_tbl = __dstr_avx2_table(
+        __U8_TOO_SHORT, __U8_TOO_SHORT, __U8_TOO_SHORT, __U8_TOO_SHORT,
+        __U8_TOO_SHORT, __U8_TOO_SHORT, __U8_TOO_SHORT, __U8_TOO_SHORT,
+        __U8_TOO_LONG | __U8_OVERLONG_2 | __U8_TWO_CONTS | __U8_OVERLONG_3 |
+            __U8_TOO_LARGE_1000 | __U8_OVERLONG_4,
+        __U8_TOO_LONG | __U8_OVERLONG_2 | __U8_TWO_CONTS | __U8_OVERLONG_3 |
+            __U8_TOO_LARGE,
+        __U8_TOO_LONG | __U8_OVERLONG_2 | __U8_TWO_CONTS | __U8_SURROGATE |
+            __U8_TOO_LARGE,
+        __U8_TOO_LONG | __U8_OVERLONG_2 | __U8_TWO_CONTS | __U8_SURROGATE |
+            __U8_TOO_LARGE,
+        __U8_TOO_SHORT, __U8_TOO_SHORT, __U8_TOO_SHORT, __U8_TOO_SHORT);
+    __m256i prev1 = __dstr_avx2_prev(input, prev_input, 1);
+    __m256i prev2 = __dstr_avx2_prev(input, prev_input, 2);
+    __m256i prev3 = __dstr_avx2_prev(input, prev_input, 3);
+    __m256i special, must23;
+
+    special = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(byte_1_high_tbl,
+                _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+            _mm256_shuffle_epi8(byte_1_low_tbl,
+                _mm256_and_si256(prev1, nibble))),
+        _mm256_shuffle_epi8(byte_2_high_tbl,
+            _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+    /* Third and fourth bytes of sequences must be continuations, only
+       111xxxxx two back and 1111xxxx three back get the high bit set.   */
+    must23 = _mm256_or_si256(
+        _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80))),
+        _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80))));
+    must23 = _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must23, special);
 }
 
-void dstr_list_remove(dstr_list *list, dstr_link *link)
+/* Validates whole 32 byte blocks and returns how many bytes were checked,
+   or -1 on error. The last characters of the checked part may continue
+   beyond it, the caller validates those together with the rest.   */
+__attribute__((target("avx2")))
+static long __dstr_utf8_valid_avx2(const unsigned char *p, size_t n)
 {
-    dstr_link * prev;
-    dstr_link * next;
+    /* Bytes of a block that start a sequence not ending within it.   */
+    const __m256i incomplete = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+    __m256i input;
+    size_t i;
 
-    prev = link->prev;
-    next = link->next;
-    if (prev){
-        if (next){
-            prev->next = next;
-            next->prev = prev;
-        } else {
-            prev->next = 0;
-            list->tail = prev;
-        }
-    } else {
-        if (next){
-            next->prev = 0;
-            list->head = next;
-        } else {
-            list->head = 0;
-            list->tail = 0;
+    for (i = 0; i + 32 <= n; i += 32){
+        input = _mm256_loadu_si256((const __m256i *)(p + i));
+        /* ASCII blocks only need to check sequences ending before them. */
+        if (!_mm256_movemask_epi8(input)){
+            error = _mm256_or_si256(error,
+                                    _mm256_subs_epu8(prev_input, incomplete));
+            prev_input = input;
+            continue;
         }
+        error = _mm256_or_si256(error,
+                                __dstr_avx2_utf8_errors(input, prev_input));
+        prev_input = input;
     }
-
-    dstr_decref(link->str);
-    dstr_free(link);
+    if (!_mm256_testz_si256(error, error))
+        return -1;
+    return i;
 }
 
-size_t dstr_list_size(const dstr_list *list)
+__attribute__((target("avx2")))
+static size_t __dstr_utf8_count_avx2(const unsigned char *p, size_t n)
 {
-    dstr_link *link;
-    size_t sz = 0;
-    DSTR_LIST_FOREACH(list, link){
-        sz++;
+    const __m256i cont = _mm256_set1_epi8((char)0xBF);
+    size_t count = 0, i;
+    __m256i input;
+
+    for (i = 0; i + 32 <= n; i += 32){
+        input = _mm256_loadu_si256((const __m256i *)(p + i));
+        /* Continuation bytes are -128 to -65 as signed.   */
+        count += __builtin_popcount(
+            _mm256_movemask_epi8(_mm256_cmpgt_epi8(input, cont)));
     }
-    return sz;
+    return count + __dstr_utf8_count_scalar(p + i, n - i);
 }
 
-void dstr_list_traverse(dstr_list * list,
-                        void (*callback)(dstr *, void *),
-                        void *user_data)
+#endif /* __DSTR_X86_SIMD */
+
+static int __dstr_utf8_valid(const unsigned char *p, size_t n)
 {
-    dstr_link *link;
+#ifdef __DSTR_X86_SIMD
+    long checked;
+    int back;
 
-    for (link = list->head; link; link = link->next){
-        callback((void *) link->str, user_data);
+    if (n >= 32 && __dstr_has_avx2()){
+        checked = __dstr_utf8_valid_avx2(p, n);
+        if (checked < 0)
+            return 0;
+        /* A multibyte sequence starting in the last three bytes may be
+           incomplete, validate it with the remainder.   */
+        for (back = 1; back <= 3 && back <= checked; back++){
+            if (p[checked - back] >= 0xC0){
+                checked -= back;
+                break;
+            }
+            if (p[checked - back] < 0x80)
+                break;
+        }
+        return __dstr_utf8_valid_scalar(p + checked, n - checked);
     }
+#endif
+    return __dstr_utf8_valid_scalar(p, n);
 }
 
-void dstr_list_traverse_reverse (dstr_list *list,
-                                 void (*callback)(dstr *, void *),
-                                 void *userdata)
+static size_t __dstr_utf8_count(const unsigned char *p, size_t n)
 {
-    dstr_link * link;
+#ifdef __DSTR_X86_SIMD
+    if (n >= 32 && __dstr_has_avx2())
+        return __dstr_utf8_count_avx2(p, n);
+#endif
+    return __dstr_utf8_count_scalar(p, n);
+}
 
-    for (link = list->tail; link; link = link->prev) {
-        callback ((void *) link->str, userdata);
+/* Byte offset of codepoint k, or n if string has no more than k.   */
+static size_t __dstr_utf8_offset(const unsigned char *p, size_t n, size_t k)
+{
+    size_t i = 0, count;
+
+    while (n - i >= 256){
+        count = __dstr_utf8_count(p + i, 256);
+        if (count > k)
+            break;
+        k -= count;
+        i += 256;
+    }
+    for (; i < n; i++){
+        if ((p[i] & 0xC0) == 0x80)
+            continue;
+        if (!k)
+            return i;
+        k--;
     }
+    return n;
 }
 
-void dstr_list_traverse_delete (dstr_list * list, int (*callback)(dstr *))
+int dstr_utf8_valid(const dstr *str)
 {
-    dstr_link *link;
+    if (__atomic_load_n(&str->flags, __ATOMIC_RELAXED) & DSTR_UTF8_VALID)
+        return 1;
+    if (!__dstr_utf8_valid((const unsigned char *)str->data, str->sz))
+        return 0;
+    /* Only a cache, set on const strings as well.   */
+    __atomic_or_fetch(&((dstr *)str)->flags, DSTR_UTF8_VALID,
+                      __ATOMIC_RELAXED);
+    return 1;
+}
 
-    for (link = list->head; link; link = link->next) {
-        if (callback((void *) link->str)) {
-            dstr_list_remove(list, link);
-        }
+int dstr_utf8_valid_cstrn(const char *src, size_t n)
+{
+    return __dstr_utf8_valid((const unsigned char *)src, n);
+}
+
+size_t dstr_utf8_length(const dstr *str)
+{
+    return __dstr_utf8_count((const unsigned char *)str->data, str->sz);
+}
+
+dstr *dstr_utf8_substr(const dstr *str, size_t first, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)str->data;
+    size_t start, end;
+    dstr *sub;
+
+    start = __dstr_utf8_offset(p, str->sz, first);
+    end = start + __dstr_utf8_offset(p + start, str->sz - start, n);
+    sub = dstr_with_prealloc(end - start + 1);
+    if (!sub)
+        return 0;
+    if (!__dstr_put_bytes(sub, str->data + start, end - start)){
+        dstr_decref(sub);
+        return 0;
     }
+    return sub;
 }
 
-void dstr_list_decref (dstr_list *list)
+int dstr_utf8_truncate(dstr *str, size_t n)
 {
-    dstr_link *link;
-    dstr_link *next;
+    unsigned int valid = str->flags & DSTR_UTF8_VALID;
+    size_t end = __dstr_utf8_offset((const unsigned char *)str->data,
+                                    str->sz, n);
 
-    list->ref--;
-    if (!list->ref){
-        for (link = list->head; link; link = next){
-            next = link->next;
-            dstr_decref(link->str);
-            dstr_free(link);
-        }
-        dstr_free(list);
-    }
+    if (end == str->sz)
+        return 1;
+    if (__dstr_immortal(str))
+        return 0;
+    __dstr_set_sz(str, end);
+    str->data[end] = '\0';
+    /* Cutting at a codepoint boundary keeps UTF-8 valid.   */
+    str->flags |= valid;
+    return 1;
 }
 
-dstr *dstr_list_to_dstr(const char *sep, dstr_list *list)
+int dstr_utf8_truncate_bytes(dstr *str, size_t n)
 {
-    dstr *str = dstr_new();
-    dstr_link *link;
+    unsigned int valid = str->flags & DSTR_UTF8_VALID;
 
-    if (!str)
+    if (n >= str->sz)
+        return 1;
+    if (__dstr_immortal(str))
         return 0;
+    while (n && ((unsigned char)str->data[n] & 0xC0) == 0x80)
+        n--;
+    __dstr_set_sz(str, n);
+    str->data[n] = '\0';
+    str->flags |= valid;
+    return 1;
+}
 
-    if (sep){
-        DSTR_LIST_FOREACH(list, link){
-            if (!dstr_append(str, link->str)){
-                dstr_decref(str);
-                return 0;
-            }
-            if (link->next)
-                dstr_append_cstr(str, sep);
-        }
-    } else {
-        DSTR_LIST_FOREACH(list, link){
-            if (!dstr_append(str, link->str)){
-                dstr_decref(str);
-                return 0;
-            }
-        }
-    }
+/*                                ENCODING                                  */
 
-    return str;
-}
+static const char __dstr_base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char __dstr_hex_chars[] = "0123456789abcdef";
 
-dstr_list *dstr_list_search_contains(dstr_list *search, const char * substr)
+/* Make room for n more bytes and the nul.   */
+static int __dstr_room_for(dstr *dest, size_t n)
 {
-    dstr_list *found = dstr_list_new();
-    dstr_link *link;
+    size_t total = dest->sz + n + 1;
 
-    if (!found)
-        return 0;
+    if (__dstr_can_hold(dest, total))
+        return 1;
+    return __dstr_alloc(dest, total);
+}
 
-    DSTR_LIST_FOREACH(search, link){
-        if (dstr_contains(link->str, substr)){
-            if (!dstr_list_add(found, link->str)){
-                dstr_list_decref(found);
-                return 0;
-            }
-        }
-    }
+#ifdef __DSTR_X86_SIMD
 
-    return found;
+/* Base64 kernels follow Mula and Lemire, "Faster Base64 Encoding and
+   Decoding Using AVX2 Instructions", 2018.   */
+
+/* Spread 24 bytes, loaded 4 bytes into the register, to 32 six bit
+   values in the low bits of each byte.   */
+__attribute__((target("avx2")))
+static __m256i __dstr_avx2_b64_split(__m256i in)
+{
+    __m256i t0, t1, t2, t3;
+
+    in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+        14, 15, 13, 14, 11, 12, 10, 11, 8, 9, 7, 8, 5, 6, 4, 5));
+    t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0FC0FC00));
+    t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003F03F0));
+    t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    return _mm256_or_si256(t1, t3);
 }
 
-dstr_list *dstr_list_search_contains_dstr(dstr_list *search, const dstr *substr)
+/* Map six bit values to the alphabet by adding a per range offset.   */
+__attribute__((target("avx2")))
+static __m256i __dstr_avx2_b64_chars(__m256i in)
 {
-    return dstr_list_search_contains(search, dstr_to_cstr_const(substr));
+    const __m256i offsets = _mm256_setr_epi8(
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+    __m256i idx = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+
+    idx = _mm256_sub_epi8(idx, _mm256_cmpgt_epi8(in, _mm256_set1_epi8(25)));
+    return _mm256_add_epi8(in, _mm256_shuffle_epi8(offsets, idx));
 }
 
-dstr_list *dstr_list_bdecode(const char *str)
+/* Encode 24 bytes per round, returns bytes consumed.   */
+__attribute__((target("avx2")))
+static size_t __dstr_base64_encode_avx2(char *out, const unsigned char *src,
+                                        size_t n)
 {
-    size_t str_sz;
-    dstr_list *list;
+    __m256i in;
+    size_t i = 0;
 
-    if (str[0] != 'l') /* Formatting might be sane. */
+    if (n < 32)
         return 0;
-    list = dstr_list_new();
-    if (!list)
-        return 0;
-
-    str++;
+    /* First block can not be loaded 4 bytes early, move it in place.   */
+    in = _mm256_loadu_si256((const __m256i *)src);
+    in = _mm256_permutevar8x32_epi32(in, _mm256_setr_epi32(0, 0, 1, 2, 3, 4,
+                                                           5, 6));
     for (;;){
-        str_sz = 0;
-        while (isdigit(*str)){
-            str_sz = str_sz * 10 + (*str - '0');
-            str++;
-        }
-        str++; /* Consume 'l' */
-        if (!dstr_list_add_decref(list, dstr_with_initialn(str, str_sz))){
-            dstr_list_decref(list);
-            return 0;
-        }
-        str += str_sz;
-        if (*str == 'e')
-            break; /* End of list. */
+        _mm256_storeu_si256((__m256i *)out,
+                            __dstr_avx2_b64_chars(__dstr_avx2_b64_split(in)));
+        out += 32;
+        i += 24;
+        if (n - i < 28)
+            break;
+        in = _mm256_loadu_si256((const __m256i *)(src + i - 4));
     }
-    return list;
-
+    return i;
 }
 
-dstr *dstr_list_bencode(const dstr_list *list)
+/* Decode 32 characters per round into 24 bytes, stores write 32 bytes.
+   Stops at the first block with padding or invalid characters and
+   returns characters consumed.   */
+__attribute__((target("avx2")))
+static size_t __dstr_base64_decode_avx2(unsigned char *out, const char *src,
+                                        size_t n)
 {
-    dstr *byte_arr = dstr_with_initial("l");
-    dstr_link *link;
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i slash = _mm256_set1_epi8('/');
+    __m256i in, hi_nibbles, roll;
+    size_t i;
 
-    DSTR_LIST_FOREACH(list, link){
-        if (!dstr_sprintf(byte_arr, "%d:", dstr_length(link->str)) ||
-                !dstr_append(byte_arr, link->str)){
-            dstr_decref(byte_arr);
-            return 0;
-        }
+    for (i = 0; i + 32 <= n; i += 32){
+        in = _mm256_loadu_si256((const __m256i *)(src + i));
+        hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), nibble);
+        /* Class bits of both nibbles overlap only for invalid chars.   */
+        if (!_mm256_testz_si256(
+                _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(in, nibble)),
+                _mm256_shuffle_epi8(lut_hi, hi_nibbles)))
+            break;
+        roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(
+            _mm256_cmpeq_epi8(in, slash), hi_nibbles));
+        in = _mm256_add_epi8(in, roll);
+        /* Merge four six bit values into three bytes.   */
+        in = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+        in = _mm256_madd_epi16(in, _mm256_set1_epi32(0x00011000));
+        in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        in = _mm256_permutevar8x32_epi32(in, _mm256_setr_epi32(0, 1, 2, 4, 5,
+                                                               6, 3, 7));
+        _mm256_storeu_si256((__m256i *)out, in);
+        out += 24;
     }
-    if (!dstr_append_cstr(byte_arr, "e")){
-        dstr_decref(byte_arr);
-        return 0;
+    return i;
+}
+
+/* Encode 32 bytes per round, returns bytes consumed.   */
+__attribute__((target("avx2")))
+static size_t __dstr_hex_encode_avx2(char *out, const unsigned char *src,
+                                     size_t n)
+{
+    const __m256i digits = _mm256_setr_epi8(
+        '0', '1', '2', '3', '4', '5', '6', '7',
+        '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+        '0', '1', '2', '3', '4', '5', '6', '7',
+        '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i in, hi, lo, first, second;
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32){
+        in = _mm256_loadu_si256((const __m256i *)(src + i));
+        hi = _mm256_shuffle_epi8(digits,
+            _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble));
+        lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(in, nibble));
+        first = _mm256_unpacklo_epi8(hi, lo);
+        second = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i *)(out + 2 * i),
+                            _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256((__m256i *)(out + 2 * i + 32),
+                            _mm256_permute2x128_si256(first, second, 0x31));
     }
-    return byte_arr;
+    return i;
 }
 
+/* Decode 32 characters per round into 16 bytes. Stops at the first block
+   with invalid characters and returns characters consumed.   */
+__attribute__((target("avx2")))
+static size_t __dstr_hex_decode_avx2(unsigned char *out, const char *src,
+                                     size_t n)
+{
+    __m256i in, digit, letter, is_digit, is_letter;
+    size_t i;
 
+    for (i = 0; i + 32 <= n; i += 32){
+        in = _mm256_loadu_si256((const __m256i *)(src + i));
+        digit = _mm256_sub_epi8(in, _mm256_set1_epi8('0'));
+        /* Setting bit 5 makes letters lower-case.   */
+        letter = _mm256_sub_epi8(_mm256_or_si256(in, _mm256_set1_epi8(0x20)),
+                                 _mm256_set1_epi8('a' - 10));
+        is_digit = _mm256_cmpeq_epi8(
+            _mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+        is_letter = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_max_epu8(letter, _mm256_set1_epi8(10)),
+                              letter),
+            _mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(15)),
+                              letter));
+        if (~_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_letter)))
+            break;
+        in = _mm256_blendv_epi8(letter, digit, is_digit);
+        /* High nibble times 16 plus low nibble, then pack.   */
+        in = _mm256_maddubs_epi16(in, _mm256_set1_epi16(0x0110));
+        in = _mm256_packus_epi16(in, in);
+        in = _mm256_permute4x64_epi64(in, 0x08);
+        _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(in));
+        out += 16;
+    }
+    return i;
+}
 
-/*                          DYNAMIC STRING VECTOR                           */
+#endif /* __DSTR_X86_SIMD */
 
-dstr_vector *dstr_vector_new()
+int dstr_append_base64(dstr *dest, const void *src, size_t n)
 {
-    dstr_vector *vec = dstr_malloc(sizeof(dstr_vector));
-    if (!vec)
+    const unsigned char *p = src;
+    size_t len = (n + 2) / 3 * 4, i = 0;
+    char *out;
+    uint32_t v;
+
+    if (!__dstr_room_for(dest, len))
         return 0;
-    vec->ref = 1;
-    vec->space = 0;
-    vec->arr = 0;
-    vec->sz = 0;
-    return vec;
+    out = dest->data + dest->sz;
+#ifdef __DSTR_X86_SIMD
+    if (__dstr_has_avx2()){
+        i = __dstr_base64_encode_avx2(out, p, n);
+        out += i / 3 * 4;
+    }
+#endif
+    for (; i + 3 <= n; i += 3){
+        v = (uint32_t)p[i] << 16 | (uint32_t)p[i + 1] << 8 | p[i + 2];
+        *out++ = __dstr_base64_chars[v >> 18];
+        *out++ = __dstr_base64_chars[(v >> 12) & 0x3F];
+        *out++ = __dstr_base64_chars[(v >> 6) & 0x3F];
+        *out++ = __dstr_base64_chars[v & 0x3F];
+    }
+    if (i < n){
+        v = (uint32_t)p[i] << 16;
+        if (i + 1 < n)
+            v |= (uint32_t)p[i + 1] << 8;
+        *out++ = __dstr_base64_chars[v >> 18];
+        *out++ = __dstr_base64_chars[(v >> 12) & 0x3F];
+        *out++ = i + 1 < n ? __dstr_base64_chars[(v >> 6) & 0x3F] : '=';
+        *out++ = '=';
+    }
+    *out = '\0';
+    __dstr_set_sz(dest, dest->sz + len);
+    return 1;
 }
 
-dstr_vector *dstr_vector_prealloc(size_t elements)
+/* Value of base64 character, or 64 if not in the alphabet.   */
+static unsigned int __dstr_base64_value(unsigned char c)
 {
-    dstr_vector *vec = dstr_malloc(sizeof(dstr_vector));
-    if (!vec)
-        return 0;
-    vec->ref = 1;
-    vec->arr = dstr_malloc(elements * sizeof(dstr*));
-    if (!vec->arr){
-        dstr_free(vec);
-        return 0;
-    }
-    vec->space = elements;
-    vec->sz = 0;
-    return vec;
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '+')
+        return 62;
+    if (c == '/')
+        return 63;
+    return 64;
 }
 
-void dstr_vector_decref(dstr_vector *vec)
+int dstr_decode_base64(dstr *dest, const char *src, size_t n)
 {
-    size_t i;
-    vec->ref--;
-    if (!vec->ref){
-        for (i = 0; i < vec->sz; i++){
-            dstr_decref(vec->arr[i]);
-        }
-        dstr_free(vec->arr);
-        dstr_free(vec);
+    const unsigned char *p = (const unsigned char *)src;
+    unsigned char *out;
+    unsigned int a, b, c, d;
+    size_t i = 0;
+
+    /* Strip padding, what is left must not end in a lone character.   */
+    if (n % 4 == 0 && n && p[n - 1] == '='){
+        n--;
+        if (p[n - 1] == '=')
+            n--;
+    }
+    if (n % 4 == 1)
+        return 0;
+    /* Vector stores write 8 bytes past the decoded data.   */
+    if (!__dstr_room_for(dest, n / 4 * 3 + 2 + 8))
+        return 0;
+    out = (unsigned char *)dest->data + dest->sz;
+#ifdef __DSTR_X86_SIMD
+    if (__dstr_has_avx2()){
+        i = __dstr_base64_decode_avx2(out, src, n);
+        out += i / 4 * 3;
+    }
+#endif
+    for (; i + 4 <= n; i += 4){
+        a = __dstr_base64_value(p[i]);
+        b = __dstr_base64_value(p[i + 1]);
+        c = __dstr_base64_value(p[i + 2]);
+        d = __dstr_base64_value(p[i + 3]);
+        if ((a | b | c | d) & 64)
+            goto invalid;
+        *out++ = a << 2 | b >> 4;
+        *out++ = b << 4 | c >> 2;
+        *out++ = c << 6 | d;
     }
+    if (i < n){
+        a = __dstr_base64_value(p[i]);
+        b = __dstr_base64_value(p[i + 1]);
+        c = i + 2 < n ? __dstr_base64_value(p[i + 2]) : 0;
+        if ((a | b | c) & 64)
+            goto invalid;
+        *out++ = a << 2 | b >> 4;
+        if (i + 2 < n)
+            *out++ = b << 4 | c >> 2;
+    }
+    *out = '\0';
+    __dstr_set_sz(dest, out - (unsigned char *)dest->data);
+    return 1;
+invalid:
+    dest->data[dest->sz] = '\0';
+    return 0;
 }
 
-static int __dstr_vector_alloc(dstr_vector *vec, unsigned int elements)
+int dstr_append_hex(dstr *dest, const void *src, size_t n)
 {
-    size_t alloc = elements * sizeof(dstr *) * DSTR_VECTOR_MEM_EXPAND_RATE;
-    vec->arr = (dstr **)dstr_realloc(vec->arr, alloc, vec->space * sizeof(dstr*));
-    if (!vec->arr)
+    const unsigned char *p = src;
+    size_t i = 0;
+    char *out;
+
+    if (!__dstr_room_for(dest, 2 * n))
         return 0;
-    vec->space = elements * DSTR_VECTOR_MEM_EXPAND_RATE;
+    out = dest->data + dest->sz;
+#ifdef __DSTR_X86_SIMD
+    if (__dstr_has_avx2())
+        i = __dstr_hex_encode_avx2(out, p, n);
+#endif
+    for (; i < n; i++){
+        out[2 * i] = __dstr_hex_chars[p[i] >> 4];
+        out[2 * i + 1] = __dstr_hex_chars[p[i] & 0xF];
+    }
+    out[2 * n] = '\0';
+    __dstr_set_sz(dest, dest->sz + 2 * n);
     return 1;
 }
 
-static int __dstr_vector_can_hold(const dstr_vector *vec, unsigned int elements)
+/* Value of hex digit, or 16 if not a hex digit.   */
+static unsigned int __dstr_hex_value(unsigned char c)
 {
-    if (vec->space >= elements)
-        return 1;
-    return 0;
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return 16;
 }
 
-int dstr_vector_insert(dstr_vector *vec, size_t pos, dstr *str)
+int dstr_decode_hex(dstr *dest, const char *src, size_t n)
 {
-    size_t new_sz = vec->sz + 1;
+    const unsigned char *p = (const unsigned char *)src;
+    unsigned char *out;
+    unsigned int hi, lo;
+    size_t i = 0;
 
-#ifdef DSTR_MEM_SECURITY
-    if (vec->sz < pos)
+    if (n % 2)
+        return 0;
+    if (!__dstr_room_for(dest, n / 2))
         return 0;
+    out = (unsigned char *)dest->data + dest->sz;
+#ifdef __DSTR_X86_SIMD
+    if (__dstr_has_avx2())
+        i = __dstr_hex_decode_avx2(out, src, n);
 #endif
-
-    if (!__dstr_vector_can_hold(vec, new_sz)){
-        if (!__dstr_vector_alloc(vec, new_sz))
+    for (; i < n; i += 2){
+        hi = __dstr_hex_value(p[i]);
+        lo = __dstr_hex_value(p[i + 1]);
+        if ((hi | lo) & 16){
+            dest->data[dest->sz] = '\0';
             return 0;
+        }
+        out[i / 2] = hi << 4 | lo;
     }
-    memmove(vec->arr + pos + 1,
-            vec->arr + pos,
-            sizeof(dstr*) * (vec->sz - pos));
-    vec->arr[pos] = str;
-    vec->sz++;
-    dstr_incref(str);
+    out[n / 2] = '\0';
+    __dstr_set_sz(dest, dest->sz + n / 2);
     return 1;
 }
 
-int dstr_vector_insert_decref(dstr_vector *vec, size_t pos, dstr *str)
+/*                                ESCAPING                                  */
+
+/* Bytes that must be escaped inside a JSON string.   */
+#define __dstr_json_special(c) ((c) < 0x20 || (c) == '"' || (c) == '\\')
+
+/* Bytes that are not unreserved in RFC 3986.   */
+#define __dstr_url_special(c) \
+    (!(((c) | 0x20) - 'a' < 26u || (c) - '0' < 10u || (c) == '-' || \
+       (c) == '.' || (c) == '_' || (c) == '~'))
+
+#ifdef __DSTR_X86_SIMD
+
+/* Index of the first byte needing escaping, or the length of the whole
+   blocks scanned if there is none.   */
+__attribute__((target("avx2")))
+static size_t __dstr_json_scan_avx2(const unsigned char *p, size_t n)
 {
-    size_t new_sz = vec->sz + 1;
+    __m256i in, special;
+    unsigned int mask;
+    size_t i;
 
-#ifdef DSTR_MEM_SECURITY
-    if (vec->sz < pos)
-        return 0;
-#endif
+    for (i = 0; i + 32 <= n; i += 32){
+        in = _mm256_loadu_si256((const __m256i *)(p + i));
+        special = _mm256_or_si256(
+            _mm256_cmpeq_epi8(in, _mm256_set1_epi8('"')),
+            _mm256_cmpeq_epi8(in, _mm256_set1_epi8('\\')));
+        special = _mm256_or_si256(special, _mm256_cmpeq_epi8(
+            _mm256_min_epu8(in, _mm256_set1_epi8(0x1F)), in));
+        mask = _mm256_movemask_epi8(special);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i;
+}
 
-    if (!__dstr_vector_can_hold(vec, new_sz)){
-        if (!__dstr_vector_alloc(vec, new_sz))
-            return 0;
+__attribute__((target("avx2")))
+static size_t __dstr_url_scan_avx2(const unsigned char *p, size_t n)
+{
+    __m256i in, t, ok;
+    unsigned int mask;
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32){
+        in = _mm256_loadu_si256((const __m256i *)(p + i));
+        /* Letters of either case.   */
+        t = _mm256_sub_epi8(_mm256_or_si256(in, _mm256_set1_epi8(0x20)),
+                            _mm256_set1_epi8('a'));
+        ok = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(25)), t);
+        t = _mm256_sub_epi8(in, _mm256_set1_epi8('0'));
+        ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(
+            _mm256_min_epu8(t, _mm256_set1_epi8(9)), t));
+        /* '-' and '.' are adjacent.   */
+        t = _mm256_sub_epi8(in, _mm256_set1_epi8('-'));
+        ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(
+            _mm256_min_epu8(t, _mm256_set1_epi8(1)), t));
+        ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(in, _mm256_set1_epi8('_')));
+        ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(in, _mm256_set1_epi8('~')));
+        mask = ~_mm256_movemask_epi8(ok);
+        if (mask)
+            return i + __builtin_ctz(mask);
     }
-    memmove(vec->arr + pos + 1,
-            vec->arr + pos,
-            sizeof(dstr*) * (vec->sz - pos));
-    vec->arr[pos] = str;
-    vec->sz++;
-    return 1;
+    return i;
 }
 
-int dstr_vector_push_front(dstr_vector *vec, dstr *str)
+#endif /* __DSTR_X86_SIMD */
+
+/* Length of the leading run that can be copied unescaped.   */
+static size_t __dstr_json_span(const unsigned char *p, size_t n)
 {
-    return dstr_vector_insert(vec, DSTR_VECTOR_BEGIN, str);
+    size_t i = 0;
+
+#ifdef __DSTR_X86_SIMD
+    if (__dstr_has_avx2())
+        i = __dstr_json_scan_avx2(p, n);
+#endif
+    while (i < n && !__dstr_json_special(p[i]))
+        i++;
+    return i;
 }
 
-int dstr_vector_push_front_decref(dstr_vector *vec, dstr *str)
+static size_t __dstr_url_span(const unsigned char *p, size_t n)
 {
-    return dstr_vector_insert_decref(vec, DSTR_VECTOR_BEGIN, str);
+    size_t i = 0;
+
+#ifdef __DSTR_X86_SIMD
+    if (__dstr_has_avx2())
+        i = __dstr_url_scan_avx2(p, n);
+#endif
+    while (i < n && !__dstr_url_special(p[i]))
+        i++;
+    return i;
 }
 
-int dstr_vector_push_back(dstr_vector *vec, dstr *str)
+int dstr_append_json_escaped(dstr *dest, const char *src, size_t n)
 {
-    size_t new_sz = vec->sz + 1;
+    const unsigned char *p = (const unsigned char *)src;
+    size_t i = 0, len = 0, run;
+    char *out;
+    unsigned char c;
 
-    if (!__dstr_vector_can_hold(vec, new_sz)){
-        if (!__dstr_vector_alloc(vec, new_sz))
+    if (!__dstr_room_for(dest, n))
+        return 0;
+    for (;;){
+        out = dest->data + dest->sz + len;
+        run = __dstr_json_span(p + i, n - i);
+        memcpy(out, p + i, run);
+        len += run;
+        i += run;
+        if (i == n)
+            break;
+        /* An escape takes at most six bytes, keep room for the rest.   */
+        if (!__dstr_room_for(dest, len + 6 + n - i - 1)){
+            dest->data[dest->sz] = '\0';
             return 0;
+        }
+        out = dest->data + dest->sz + len;
+        c = p[i++];
+        *out++ = '\\';
+        switch (c){
+        case '"':  *out = '"'; break;
+        case '\\': *out = '\\'; break;
+        case '\b': *out = 'b'; break;
+        case '\f': *out = 'f'; break;
+        case '\n': *out = 'n'; break;
+        case '\r': *out = 'r'; break;
+        case '\t': *out = 't'; break;
+        default:
+            memcpy(out, "u00", 3);
+            out[3] = __dstr_hex_chars[c >> 4];
+            out[4] = __dstr_hex_chars[c & 0xF];
+            len += 4;
+        }
+        len += 2;
     }
-    vec->arr[vec->sz] = str;
-    vec->sz++;
-    dstr_incref(str);
+    dest->data[dest->sz + len] = '\0';
+    __dstr_set_sz(dest, dest->sz + len);
     return 1;
 }
 
-int dstr_vector_push_back_decref(dstr_vector *vec, dstr *str)
+int dstr_append_url_encoded(dstr *dest, const char *src, size_t n)
 {
-    size_t new_sz = vec->sz + 1;
+    const unsigned char *p = (const unsigned char *)src;
+    size_t i = 0, len = 0, run;
+    char *out;
+    unsigned char c;
 
-    if (!__dstr_vector_can_hold(vec, new_sz)){
-        if (!__dstr_vector_alloc(vec, new_sz))
+    if (!__dstr_room_for(dest, n))
+        return 0;
+    for (;;){
+        out = dest->data + dest->sz + len;
+        run = __dstr_url_span(p + i, n - i);
+        memcpy(out, p + i, run);
+        len += run;
+        i += run;
+        if (i == n)
+            break;
+        if (!__dstr_room_for(dest, len + 3 + n - i - 1)){
+            dest->data[dest->sz] = '\0';
             return 0;
+        }
+        out = dest->data + dest->sz + len;
+        c = p[i++];
+        out[0] = '%';
+        out[1] = "0123456789ABCDEF"[c >> 4];
+        out[2] = "0123456789ABCDEF"[c & 0xF];
+        len += 3;
     }
-    vec->arr[vec->sz] = str;
-    vec->sz++;
+    dest->data[dest->sz + len] = '\0';
+    __dstr_set_sz(dest, dest->sz + len);
     return 1;
 }
 
-void dstr_vector_pop_back(dstr_vector *vec)
+int dstr_url_decode(dstr *dest, const char *src, size_t n)
 {
-    size_t sz = vec->sz - 1;
-#ifdef DSTR_MEM_SECURITY
-    if (!vec->sz)
-        return;
-#endif
+    const char *p = src, *end = src + n, *pct;
+    unsigned int hi, lo;
+    char *out;
 
-    dstr_decref(vec->arr[sz]);
-    vec->arr[sz] = 0;
-    vec->sz--;
+    if (!__dstr_room_for(dest, n))
+        return 0;
+    out = dest->data + dest->sz;
+    /* memchr is vectorized by the C library.   */
+    while ((pct = memchr(p, '%', end - p))){
+        memcpy(out, p, pct - p);
+        out += pct - p;
+        if (end - pct < 3)
+            goto invalid;
+        hi = __dstr_hex_value(pct[1]);
+        lo = __dstr_hex_value(pct[2]);
+        if ((hi | lo) & 16)
+            goto invalid;
+        *out++ = hi << 4 | lo;
+        p = pct + 3;
+    }
+    memcpy(out, p, end - p);
+    out += end - p;
+    *out = '\0';
+    __dstr_set_sz(dest, out - dest->data);
+    return 1;
+invalid:
+    dest->data[dest->sz] = '\0';
+    return 0;
 }
 
-void dstr_vector_pop_front(dstr_vector *vec)
-{
-    dstr_vector_remove(vec, DSTR_VECTOR_BEGIN);
-}
+/*                            SEARCH AND REPLACE                            */
 
-dstr *dstr_vector_back(dstr_vector *vec)
+#ifdef __DSTR_X86_SIMD
+
+/* Candidate positions are those matching both the first and the last byte
+   of the needle, after Mula, "SIMD-friendly algorithms for substring
+   searching". Sets scanned to where the vector search stopped.   */
+__attribute__((target("avx2")))
+static const char *__dstr_find_avx2(const char *h, size_t hn, const char *n,
+                                    size_t nn, size_t *scanned)
 {
-#ifdef DSTR_MEM_SECURITY
-    if (!vec->sz)
-        return 0;
-#endif
-    return vec->arr[vec->sz - 1];
+    const __m256i first = _mm256_set1_epi8(n[0]);
+    const __m256i last = _mm256_set1_epi8(n[nn - 1]);
+    __m256i a, b;
+    unsigned int mask;
+    size_t i;
+
+    for (i = 0; i + nn - 1 + 32 <= hn; i += 32){
+        a = _mm256_cmpeq_epi8(first,
+                              _mm256_loadu_si256((const __m256i *)(h + i)));
+        b = _mm256_cmpeq_epi8(last, _mm256_loadu_si256(
+                                  (const __m256i *)(h + i + nn - 1)));
+        mask = _mm256_movemask_epi8(_mm256_and_si256(a, b));
+        while (mask){
+            if (!memcmp(h + i + __builtin_ctz(mask), n, nn))
+                return h + i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    *scanned = i;
+    return 0;
 }
 
-dstr *dstr_vector_front(dstr_vector *vec)
+#endif /* __DSTR_X86_SIMD */
+
+/* First occurrence of n (nn > 0 bytes) in h, or NULL.   */
+static const char *__dstr_find(const char *h, size_t hn, const char *n,
+                               size_t nn)
 {
-#ifdef DSTR_MEM_SECURITY
-    if (!vec->sz)
+    const char *p, *end;
+    size_t i = 0;
+
+    if (nn > hn)
         return 0;
+    if (nn == 1)
+        return memchr(h, n[0], hn);
+#ifdef __DSTR_X86_SIMD
+    if (hn >= nn + 31 && __dstr_has_avx2() &&
+        (p = __dstr_find_avx2(h, hn, n, nn, &i)))
+        return p;
 #endif
-    return vec->arr[DSTR_VECTOR_BEGIN];
+    end = h + hn - nn + 1;
+    for (p = h + i; p < end && (p = memchr(p, n[0], end - p)); p++)
+        if (!memcmp(p, n, nn))
+            return p;
+    return 0;
+}
+
+typedef struct __dstr_match{
+    size_t pos;
+    size_t pair;
+} __dstr_match;
+
+#define __DSTR_NO_MATCH ((size_t)-1)
+#define __DSTR_LOCAL_PAIRS 8
+#define __DSTR_LOCAL_MATCHES 64
+
+/* Next match at or after pos, earliest start first and the first listed
+   pair on ties. Pending matches starting before pos are searched again.  */
+static size_t __dstr_next_match(const dstr *str, const char *const *pairs,
+                                const size_t *lens, size_t *next, size_t k,
+                                size_t pos)
+{
+    const char *found;
+    size_t i, best = __DSTR_NO_MATCH;
+
+    for (i = 0; i < k; i++){
+        if (next[i] != __DSTR_NO_MATCH && next[i] < pos){
+            found = __dstr_find(str->data + pos, str->sz - pos,
+                                pairs[2 * i], lens[2 * i]);
+            next[i] = found ? (size_t)(found - str->data) : __DSTR_NO_MATCH;
+        }
+        if (next[i] != __DSTR_NO_MATCH &&
+            (best == __DSTR_NO_MATCH || next[i] < next[best]))
+            best = i;
+    }
+    return best;
+}
+
+/* Replacements no longer than their needles: compact while searching.  */
+static void __dstr_replace_shrink(dstr *str, const char *const *pairs,
+                                  const size_t *lens, size_t *next, size_t k)
+{
+    size_t pair, read = 0, write = 0, run;
+
+    while ((pair = __dstr_next_match(str, pairs, lens, next, k, read)) !=
+           __DSTR_NO_MATCH){
+        run = next[pair] - read;
+        memmove(str->data + write, str->data + read, run);
+        write += run;
+        memcpy(str->data + write, pairs[2 * pair + 1], lens[2 * pair + 1]);
+        write += lens[2 * pair + 1];
+        read = next[pair] + lens[2 * pair];
+    }
+    memmove(str->data + write, str->data + read, str->sz - read);
+    write += str->sz - read;
+    str->data[write] = '\0';
+    __dstr_set_sz(str, write);
+}
+
+/* Move the text between matches to its final place, then fill in the
+   replacements. Text moving right is moved last to first and text moving
+   left first to last, so no text is overwritten before it is moved.   */
+static void __dstr_replace_moves(dstr *str, const char *const *pairs,
+                                 const size_t *lens, const __dstr_match *m,
+                                 size_t count, size_t final)
+{
+    size_t i, src, end, dst;
+    ptrdiff_t shift;
+
+    /* Segment i is the text before match i, segment count the tail.   */
+    dst = final;
+    for (i = count + 1; i--; ){
+        end = i < count ? m[i].pos : str->sz;
+        src = i ? m[i - 1].pos + lens[2 * m[i - 1].pair] : 0;
+        dst -= end - src;
+        if (dst > src)
+            memmove(str->data + dst, str->data + src, end - src);
+        if (i)
+            dst -= lens[2 * m[i - 1].pair + 1];
+    }
+    shift = 0;
+    src = 0;
+    for (i = 0; i <= count; i++){
+        end = i < count ? m[i].pos : str->sz;
+        if (shift < 0)
+            memmove(str->data + src + shift, str->data + src, end - src);
+        if (i < count){
+            shift += (ptrdiff_t)lens[2 * m[i].pair + 1] -
+                (ptrdiff_t)lens[2 * m[i].pair];
+            src = end + lens[2 * m[i].pair];
+        }
+    }
+    shift = 0;
+    for (i = 0; i < count; i++){
+        memcpy(str->data + m[i].pos + shift, pairs[2 * m[i].pair + 1],
+               lens[2 * m[i].pair + 1]);
+        shift += (ptrdiff_t)lens[2 * m[i].pair + 1] -
+            (ptrdiff_t)lens[2 * m[i].pair];
+    }
+    str->data[final] = '\0';
+    __dstr_set_sz(str, final);
+}
+
+int dstr_replace_all_pairs(dstr *str, const char *const *pairs, size_t k)
+{
+    size_t local_lens[3 * __DSTR_LOCAL_PAIRS];
+    __dstr_match local_matches[__DSTR_LOCAL_MATCHES];
+    __dstr_match *m = local_matches, *tmp;
+    const char *found;
+    size_t *lens = local_lens, *next;
+    size_t i, pair, pos, count = 0, cap = __DSTR_LOCAL_MATCHES, final;
+    int grows = 0, rc = 1;
+
+    if (!str->data)
+        return 1;
+    if (__dstr_immortal(str))
+        return 0;
+    if (k > __DSTR_LOCAL_PAIRS && !(lens = malloc(3 * k * sizeof(size_t))))
+        return 0;
+    next = lens + 2 * k;
+    for (i = 0; i < k; i++){
+        lens[2 * i] = strlen(pairs[2 * i]);
+        lens[2 * i + 1] = strlen(pairs[2 * i + 1]);
+        if (!lens[2 * i]){
+            rc = 0;
+            goto done;
+        }
+        grows |= lens[2 * i + 1] > lens[2 * i];
+        found = __dstr_find(str->data, str->sz, pairs[2 * i], lens[2 * i]);
+        next[i] = found ? (size_t)(found - str->data) : __DSTR_NO_MATCH;
+    }
+    __dstr_probe2(search__replace, str->sz, k);
+    if (!grows){
+        __dstr_replace_shrink(str, pairs, lens, next, k);
+        goto done;
+    }
+    /* Collect all matches first to size the result exactly.   */
+    final = str->sz;
+    pos = 0;
+    while ((pair = __dstr_next_match(str, pairs, lens, next, k, pos)) !=
+           __DSTR_NO_MATCH){
+        if (count == cap){
+            tmp = m == local_matches ? malloc(2 * cap * sizeof(*m)) :
+                realloc(m, 2 * cap * sizeof(*m));
+            if (!tmp){
+                rc = 0;
+                goto done;
+            }
+            if (m == local_matches)
+                memcpy(tmp, m, count * sizeof(*m));
+            m = tmp;
+            cap *= 2;
+        }
+        m[count].pos = next[pair];
+        m[count].pair = pair;
+        count++;
+        final = final - lens[2 * pair] + lens[2 * pair + 1];
+        pos = next[pair] + lens[2 * pair];
+    }
+    if (!count)
+        goto done;
+    /* Text is moved in place, the buffer must hold both layouts.   */
+    pos = final > str->sz ? final : str->sz;
+    if (!__dstr_can_hold(str, pos) && !__dstr_alloc_no_grow(str, pos + 1)){
+        rc = 0;
+        goto done;
+    }
+    __dstr_replace_moves(str, pairs, lens, m, count, final);
+done:
+    if (m != local_matches)
+        free(m);
+    if (lens != local_lens)
+        free(lens);
+    return rc;
+}
+
+int dstr_replace_all(dstr *str, const char *needle, const char *replacement)
+{
+    const char *pair[2];
+
+    pair[0] = needle;
+    pair[1] = replacement;
+    return dstr_replace_all_pairs(str, pair, 1);
+}
+
+/*                                  TRIM                                    */
+
+typedef struct __dstr_trimset{
+    unsigned char set[32];
+    unsigned char lo[16];
+    unsigned char hi[16];
+} __dstr_trimset;
+
+/* Space, \t, \n, \v, \f and \r as isspace in the C locale.   */
+static const __dstr_trimset __dstr_whitespace = {
+    {0, 0x3E, 0, 0, 0x01},
+    {0x04, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0x01, 0x01, 0x01, 0x01},
+    {0}
+};
+
+/* Length of leading run of bytes in set.   */
+static size_t __dstr_trim_span(const __dstr_trimset *ts, const char *p,
+                               size_t n)
+{
+    size_t i = 0;
+
+#ifdef __DSTR_X86_SIMD
+    if (n >= 32 && __dstr_byteset_has(ts->set, p[0]) && __dstr_has_avx2()){
+        unsigned int mask;
+
+        for (; i + 32 <= n; i += 32){
+            mask = ~__dstr_byteset_classify_avx2(ts->lo, ts->hi, p + i);
+            if (mask)
+                return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (i < n && __dstr_byteset_has(ts->set, p[i]))
+        i++;
+    return i;
+}
+
+/* Length left after dropping the trailing run of bytes in set.   */
+static size_t __dstr_trim_rspan(const __dstr_trimset *ts, const char *p,
+                                size_t n)
+{
+#ifdef __DSTR_X86_SIMD
+    if (n >= 32 && __dstr_byteset_has(ts->set, p[n - 1]) &&
+        __dstr_has_avx2()){
+        unsigned int mask;
+
+        for (; n >= 32; n -= 32){
+            mask = ~__dstr_byteset_classify_avx2(ts->lo, ts->hi, p + n - 32);
+            if (mask)
+                return n - __builtin_clz(mask);
+        }
+    }
+#endif
+    while (n && __dstr_byteset_has(ts->set, p[n - 1]))
+        n--;
+    return n;
+}
+
+/* Trim one or both ends, shifting the remaining data at most once.   */
+static int __dstr_trim(dstr *str, const __dstr_trimset *ts, int left,
+                       int right)
+{
+    size_t first = 0, last = str->sz;
+
+    if (!str->sz)
+        return 1;
+    if (right)
+        last = __dstr_trim_rspan(ts, str->data, last);
+    if (left)
+        first = __dstr_trim_span(ts, str->data, last);
+    if (first == 0 && last == str->sz)
+        return 1;
+    if (__dstr_immortal(str))
+        return 0;
+    if (first)
+        memmove(str->data, str->data + first, last - first);
+    str->data[last - first] = '\0';
+    __dstr_set_sz(str, last - first);
+    return 1;
+}
+
+static void __dstr_trimset_init(__dstr_trimset *ts, const char *chars)
+{
+    memset(ts, 0, sizeof(__dstr_trimset));
+    while (*chars)
+        __dstr_byteset_add(ts->set, ts->lo, ts->hi, *chars++);
+}
+
+int dstr_trim(dstr *str)
+{
+    return __dstr_trim(str, &__dstr_whitespace, 1, 1);
+}
+
+int dstr_ltrim(dstr *str)
+{
+    return __dstr_trim(str, &__dstr_whitespace, 1, 0);
+}
+
+int dstr_rtrim(dstr *str)
+{
+    return __dstr_trim(str, &__dstr_whitespace, 0, 1);
+}
+
+int dstr_trim_chars(dstr *str, const char *chars)
+{
+    __dstr_trimset ts;
+
+    __dstr_trimset_init(&ts, chars);
+    return __dstr_trim(str, &ts, 1, 1);
+}
+
+int dstr_ltrim_chars(dstr *str, const char *chars)
+{
+    __dstr_trimset ts;
+
+    __dstr_trimset_init(&ts, chars);
+    return __dstr_trim(str, &ts, 1, 0);
+}
+
+int dstr_rtrim_chars(dstr *str, const char *chars)
+{
+    __dstr_trimset ts;
+
+    __dstr_trimset_init(&ts, chars);
+    return __dstr_trim(str, &ts, 0, 1);
+}
+
+void dstr_trim_view(const char **data, size_t *n)
+{
+    size_t last = __dstr_trim_rspan(&__dstr_whitespace, *data, *n);
+    size_t first = __dstr_trim_span(&__dstr_whitespace, *data, last);
+
+    *data += first;
+    *n = last - first;
+}
+
+/*                          DYNAMIC STRING LIST                             */
+
+dstr_list *dstr_list_new()
+{
+    dstr_list *list = dstr_malloc(sizeof(dstr_list));
+    if (!list)
+        return 0;
+    list->head = 0;
+    list->tail = 0;
+    list->ref = 1;
+    __dstr_stat_add(lists, 1);
+    return list;
+}
+
+int dstr_list_add(dstr_list *list, dstr *str)
+{
+    dstr_link *link;
+
+    link = calloc(1, sizeof(dstr_link));
+    if (!link)
+        return 0;
+    __dstr_stat_add(list_links, 1);
+    __dstr_prof_alloc(link, __DSTR_PROF_LINK, sizeof(dstr_link));
+
+    link->str = str;
+    dstr_incref(str);
+
+    if (list->tail){
+        list->tail->next = link;
+        link->prev = list->tail;
+        list->tail = link;
+    } else {
+        list->head = link;
+        list->tail = link;
+    }
+    return 1;
+}
+
+int dstr_list_add_decref(dstr_list *dest, dstr *str)
+{
+    int rc = dstr_list_add(dest, str);
+    if (rc)
+        dstr_decref(str);
+    return rc;
+}
+
+void dstr_list_remove(dstr_list *list, dstr_link *link)
+{
+    dstr_link * prev;
+    dstr_link * next;
+
+    prev = link->prev;
+    next = link->next;
+    if (prev){
+        if (next){
+            prev->next = next;
+            next->prev = prev;
+        } else {
+            prev->next = 0;
+            list->tail = prev;
+        }
+    } else {
+        if (next){
+            next->prev = 0;
+            list->head = next;
+        } else {
+            list->head = 0;
+            list->tail = 0;
+        }
+    }
+
+    dstr_decref(link->str);
+    __dstr_prof_free(link);
+    dstr_free(link);
+    __dstr_stat_sub(list_links, 1);
+}
+
+size_t dstr_list_size(const dstr_list *list)
+{
+    dstr_link *link;
+    size_t sz = 0;
+    DSTR_LIST_FOREACH(list, link){
+        sz++;
+    }
+    return sz;
+}
+
+void dstr_list_traverse(dstr_list * list,
+                        void (*callback)(dstr *, void *),
+                        void *user_data)
+{
+    dstr_link *link;
+
+    for (link = list->head; link; link = link->next){
+        callback((void *) link->str, user_data);
+    }
+}
+
+void dstr_list_traverse_reverse (dstr_list *list,
+                                 void (*callback)(dstr *, void *),
+                                 void *userdata)
+{
+    dstr_link * link;
+
+    for (link = list->tail; link; link = link->prev) {
+        callback ((void *) link->str, userdata);
+    }
+}
+
+void dstr_list_traverse_delete (dstr_list * list, int (*callback)(dstr *))
+{
+    dstr_link *link;
+    dstr_link *next;
+
+    for (link = list->head; link; link = next) {
+        next = link->next;
+        if (callback((void *) link->str)) {
+            dstr_list_remove(list, link);
+        }
+    }
+}
+
+void dstr_list_decref (dstr_list *list)
+{
+    dstr_link *link;
+    dstr_link *next;
+
+    list->ref--;
+    if (!list->ref){
+        for (link = list->head; link; link = next){
+            next = link->next;
+            dstr_decref(link->str);
+            __dstr_prof_free(link);
+            dstr_free(link);
+            __dstr_stat_sub(list_links, 1);
+        }
+        __dstr_stat_sub(lists, 1);
+        dstr_free(list);
+    }
+}
+
+/* Join state shared by list and vector joins. The destination is allocated
+   with the exact size once all lengths are known, so appending never has to
+   check capacity.   */
+typedef struct __dstr_join{
+    const char *prefix, *sep, *suffix;
+    size_t prefix_len, sep_len, suffix_len;
+    char *pos;
+} __dstr_join;
+
+static void __dstr_join_init(__dstr_join *join, const char *prefix,
+                             const char *sep, const char *suffix)
+{
+    join->prefix = prefix;
+    join->sep = sep;
+    join->suffix = suffix;
+    join->prefix_len = prefix ? strlen(prefix) : 0;
+    join->sep_len = sep ? strlen(sep) : 0;
+    join->suffix_len = suffix ? strlen(suffix) : 0;
+}
+
+/* Allocate string to hold elem_bytes of n elements plus separators and
+   wrapping.   */
+static dstr *__dstr_join_alloc(__dstr_join *join, size_t elem_bytes, size_t n)
+{
+    size_t total = join->prefix_len + elem_bytes + join->suffix_len;
+    dstr *str;
+
+    if (n)
+        total += join->sep_len * (n - 1);
+    str = dstr_with_prealloc(total + 1);
+    if (!str)
+        return 0;
+    __dstr_set_sz(str, total);
+    join->pos = str->data;
+    if (join->prefix_len){
+        memcpy(join->pos, join->prefix, join->prefix_len);
+        join->pos += join->prefix_len;
+    }
+    return str;
+}
+
+static void __dstr_join_put(__dstr_join *join, const dstr *elem, int first)
+{
+    if (!first && join->sep_len){
+        memcpy(join->pos, join->sep, join->sep_len);
+        join->pos += join->sep_len;
+    }
+    memcpy(join->pos, elem->data, elem->sz);
+    join->pos += elem->sz;
+}
+
+static void __dstr_join_finish(__dstr_join *join)
+{
+    if (join->suffix_len){
+        memcpy(join->pos, join->suffix, join->suffix_len);
+        join->pos += join->suffix_len;
+    }
+    *join->pos = '\0';
+}
+
+dstr *dstr_list_to_dstr(const char *sep, dstr_list *list)
+{
+    return dstr_list_to_dstr_wrap(0, sep, 0, list);
+}
+
+dstr *dstr_list_to_dstr_wrap(const char *prefix, const char *sep,
+                             const char *suffix, const dstr_list *list)
+{
+    __dstr_join join;
+    dstr_link *link;
+    size_t bytes = 0, n = 0;
+    dstr *str;
+
+    __dstr_join_init(&join, prefix, sep, suffix);
+    DSTR_LIST_FOREACH(list, link){
+        bytes += link->str->sz;
+        n++;
+    }
+    str = __dstr_join_alloc(&join, bytes, n);
+    if (!str)
+        return 0;
+    DSTR_LIST_FOREACH(list, link){
+        __dstr_join_put(&join, link->str, link == list->head);
+    }
+    __dstr_join_finish(&join);
+    return str;
+}
+
+int dstr_list_writev(int fd, const dstr_list *list, const char *sep)
+{
+    __dstr_iov_batch batch;
+    size_t sep_len = sep ? strlen(sep) : 0;
+    dstr_link *link;
+
+    batch.fd = fd;
+    batch.cnt = 0;
+    DSTR_LIST_FOREACH(list, link){
+        if (!__dstr_iov_push(&batch, link->str->data, link->str->sz))
+            return 0;
+        if (link->next && !__dstr_iov_push(&batch, sep, sep_len))
+            return 0;
+    }
+    return __dstr_iov_flush(&batch);
+}
+
+dstr_list *dstr_list_search_contains(dstr_list *search, const char * substr)
+{
+    dstr_list *found;
+    dstr_link *link;
+
+    __dstr_probe1(list__search, substr);
+    found = dstr_list_new();
+    if (!found)
+        return 0;
+
+    DSTR_LIST_FOREACH(search, link){
+        if (dstr_contains(link->str, substr)){
+            if (!dstr_list_add(found, link->str)){
+                dstr_list_decref(found);
+                return 0;
+            }
+        }
+    }
+
+    return found;
+}
+
+dstr_list *dstr_list_search_contains_dstr(dstr_list *search, const dstr *substr)
+{
+    return dstr_list_search_contains(search, dstr_to_cstr_const(substr));
+}
+
+dstr_list *dstr_list_bdecode(const char *str)
+{
+    size_t str_sz;
+    dstr_list *list;
+
+    if (str[0] != 'l') /* Formatting might be sane. */
+        return 0;
+    list = dstr_list_new();
+    if (!list)
+        return 0;
+
+    str++;
+    for (;;){
+        str_sz = 0;
+        while (isdigit(*str)){
+            str_sz = str_sz * 10 + (*str - '0');
+            str++;
+        }
+        str++; /* Consume 'l' */
+        if (!dstr_list_add_decref(list, dstr_with_initialn(str, str_sz))){
+            dstr_list_decref(list);
+            return 0;
+        }
+        str += str_sz;
+        if (*str == 'e')
+            break; /* End of list. */
+    }
+    return list;
+
+}
+
+dstr *dstr_list_bencode(const dstr_list *list)
+{
+    dstr *byte_arr = dstr_with_initial("l");
+    dstr_link *link;
+
+    DSTR_LIST_FOREACH(list, link){
+        if (!dstr_append_u64(byte_arr, dstr_length(link->str)) ||
+                !__dstr_put_bytes(byte_arr, ":", 1) ||
+                !dstr_append(byte_arr, link->str)){
+            dstr_decref(byte_arr);
+            return 0;
+        }
+    }
+    if (!dstr_append_cstr(byte_arr, "e")){
+        dstr_decref(byte_arr);
+        return 0;
+    }
+    return byte_arr;
+}
+
+
+
+/*                          DYNAMIC STRING VECTOR                           */
+
+dstr_vector *dstr_vector_new()
+{
+    dstr_vector *vec = dstr_malloc(sizeof(dstr_vector));
+    if (!vec)
+        return 0;
+    vec->ref = 1;
+    vec->space = 0;
+    vec->arr = 0;
+    vec->sz = 0;
+    __dstr_stat_add(vectors, 1);
+    __dstr_prof_alloc(vec, __DSTR_PROF_VECTOR, sizeof(dstr_vector));
+    return vec;
+}
+
+dstr_vector *dstr_vector_prealloc(size_t elements)
+{
+    dstr_vector *vec = dstr_malloc(sizeof(dstr_vector));
+    if (!vec)
+        return 0;
+    vec->ref = 1;
+    vec->arr = dstr_malloc(elements * sizeof(dstr*));
+    if (!vec->arr){
+        dstr_free(vec);
+        return 0;
+    }
+    vec->space = elements;
+    vec->sz = 0;
+    __dstr_stat_add(vectors, 1);
+    __dstr_stat_add(vector_bytes, elements * sizeof(dstr*));
+    __dstr_prof_alloc(vec, __DSTR_PROF_VECTOR,
+                      sizeof(dstr_vector) + elements * sizeof(dstr*));
+    return vec;
+}
+
+void dstr_vector_decref(dstr_vector *vec)
+{
+    size_t i;
+    vec->ref--;
+    if (!vec->ref){
+        for (i = 0; i < vec->sz; i++){
+            dstr_decref(vec->arr[i]);
+        }
+        __dstr_stat_sub(vectors, 1);
+        __dstr_stat_sub(vector_bytes, vec->space * sizeof(dstr*));
+        __dstr_prof_free(vec);
+        dstr_free(vec->arr);
+        dstr_free(vec);
+    }
+}
+
+static int __dstr_vector_alloc(dstr_vector *vec, unsigned int elements)
+{
+    size_t alloc = elements * sizeof(dstr *) * DSTR_VECTOR_MEM_EXPAND_RATE;
+    vec->arr = (dstr **)dstr_realloc(vec->arr, alloc, vec->space * sizeof(dstr*));
+    if (!vec->arr)
+        return 0;
+    __dstr_probe3(vector__grow, vec, vec->space,
+                  elements * DSTR_VECTOR_MEM_EXPAND_RATE);
+    __dstr_stat_add(vector_bytes, alloc - vec->space * sizeof(dstr*));
+    if (vec->space)
+        __dstr_stat_add(vector_reallocs, 1);
+    vec->space = elements * DSTR_VECTOR_MEM_EXPAND_RATE;
+    return 1;
+}
+
+static int __dstr_vector_can_hold(const dstr_vector *vec, unsigned int elements)
+{
+    if (vec->space >= elements)
+        return 1;
+    return 0;
+}
+
+int dstr_vector_insert(dstr_vector *vec, size_t pos, dstr *str)
+{
+    size_t new_sz = vec->sz + 1;
+
+#ifdef DSTR_MEM_SECURITY
+    if (vec->sz < pos)
+        return 0;
+#endif
+
+    if (!__dstr_vector_can_hold(vec, new_sz)){
+        if (!__dstr_vector_alloc(vec, new_sz))
+            return 0;
+    }
+    memmove(vec->arr + pos + 1,
+            vec->arr + pos,
+            sizeof(dstr*) * (vec->sz - pos));
+    vec->arr[pos] = str;
+    vec->sz++;
+    dstr_incref(str);
+    return 1;
+}
+
+int dstr_vector_insert_decref(dstr_vector *vec, size_t pos, dstr *str)
+{
+    size_t new_sz = vec->sz + 1;
+
+#ifdef DSTR_MEM_SECURITY
+    if (vec->sz < pos)
+        return 0;
+#endif
+
+    if (!__dstr_vector_can_hold(vec, new_sz)){
+        if (!__dstr_vector_alloc(vec, new_sz))
+            return 0;
+    }
+    memmove(vec->arr + pos + 1,
+            vec->arr + pos,
+            sizeof(dstr*) * (vec->sz - pos));
+    vec->arr[pos] = str;
+    vec->sz++;
+    return 1;
+}
+
+int dstr_vector_push_front(dstr_vector *vec, dstr *str)
+{
+    return dstr_vector_insert(vec, DSTR_VECTOR_BEGIN, str);
+}
+
+int dstr_vector_push_front_decref(dstr_vector *vec, dstr *str)
+{
+    return dstr_vector_insert_decref(vec, DSTR_VECTOR_BEGIN, str);
+}
+
+int dstr_vector_push_back(dstr_vector *vec, dstr *str)
+{
+    size_t new_sz = vec->sz + 1;
+
+    if (!__dstr_vector_can_hold(vec, new_sz)){
+        if (!__dstr_vector_alloc(vec, new_sz))
+            return 0;
+    }
+    vec->arr[vec->sz] = str;
+    vec->sz++;
+    dstr_incref(str);
+    return 1;
+}
+
+int dstr_vector_push_back_decref(dstr_vector *vec, dstr *str)
+{
+    size_t new_sz = vec->sz + 1;
+
+    if (!__dstr_vector_can_hold(vec, new_sz)){
+        if (!__dstr_vector_alloc(vec, new_sz))
+            return 0;
+    }
+    vec->arr[vec->sz] = str;
+    vec->sz++;
+    return 1;
+}
+
+void dstr_vector_pop_back(dstr_vector *vec)
+{
+    size_t sz = vec->sz - 1;
+#ifdef DSTR_MEM_SECURITY
+    if (!vec->sz)
+        return;
+#endif
+
+    dstr_decref(vec->arr[sz]);
+    vec->arr[sz] = 0;
+    vec->sz--;
+}
+
+void dstr_vector_pop_front(dstr_vector *vec)
+{
+    dstr_vector_remove(vec, DSTR_VECTOR_BEGIN);
+}
+
+dstr *dstr_vector_back(dstr_vector *vec)
+{
+#ifdef DSTR_MEM_SECURITY
+    if (!vec->sz)
+        return 0;
+#endif
+    return vec->arr[vec->sz - 1];
+}
+
+dstr *dstr_vector_front(dstr_vector *vec)
+{
+#ifdef DSTR_MEM_SECURITY
+    if (!vec->sz)
+        return 0;
+#endif
+    return vec->arr[DSTR_VECTOR_BEGIN];
 }
 
 dstr *dstr_vector_at(dstr_vector *vec, size_t pos)
 {
-#ifdef DSTR_MEM_SECURITY
-    if (!vec->sz || vec->sz < pos)
+#ifdef DSTR_MEM_SECURITY
+    if (!vec->sz || vec->sz < pos)
+        return 0;
+#endif
+    return vec->arr[pos];
+}
+
+int dstr_vector_is_empty(const dstr_vector *vec)
+{
+    return !vec->sz;
+}
+
+size_t dstr_vector_size(const dstr_vector *vec)
+{
+    return vec->sz;
+}
+
+dstr *dstr_vector_join(const char *sep, const dstr_vector *vec)
+{
+    return dstr_vector_join_wrap(0, sep, 0, vec);
+}
+
+dstr *dstr_vector_join_wrap(const char *prefix, const char *sep,
+                            const char *suffix, const dstr_vector *vec)
+{
+    __dstr_join join;
+    size_t bytes = 0, i;
+    dstr *str;
+
+    __dstr_join_init(&join, prefix, sep, suffix);
+    for (i = 0; i < vec->sz; i++)
+        bytes += vec->arr[i]->sz;
+    str = __dstr_join_alloc(&join, bytes, vec->sz);
+    if (!str)
+        return 0;
+    for (i = 0; i < vec->sz; i++)
+        __dstr_join_put(&join, vec->arr[i], i == 0);
+    __dstr_join_finish(&join);
+    return str;
+}
+
+int dstr_vector_writev(int fd, const dstr_vector *vec, const char *sep)
+{
+    __dstr_iov_batch batch;
+    size_t sep_len = sep ? strlen(sep) : 0;
+    size_t i;
+
+    batch.fd = fd;
+    batch.cnt = 0;
+    for (i = 0; i < vec->sz; i++){
+        if (i && !__dstr_iov_push(&batch, sep, sep_len))
+            return 0;
+        if (!__dstr_iov_push(&batch, vec->arr[i]->data, vec->arr[i]->sz))
+            return 0;
+    }
+    return __dstr_iov_flush(&batch);
+}
+
+int dstr_vector_remove(dstr_vector *vec, size_t pos)
+{
+#ifdef DSTR_MEM_SECURITY
+    if (!vec->sz || vec->sz - 1 < pos)
+        return 0;
+#endif
+
+    dstr_decref(vec->arr[pos]);
+    memmove(vec->arr + pos,
+            vec->arr + pos + 1,
+            sizeof(dstr*) * (vec->sz - pos - 1));
+    vec->sz--;
+    return 1;
+}
+
+
+/*                          DYNAMIC STRING QUEUE                            */
+
+dstr_queue *dstr_queue_new()
+{
+    dstr_queue *queue = dstr_malloc(sizeof(dstr_queue));
+    dstr_queue_node *stub;
+
+    if (!queue)
+        return 0;
+    stub = dstr_malloc(sizeof(dstr_queue_node));
+    if (!stub){
+        dstr_free(queue);
+        return 0;
+    }
+    stub->next = 0;
+    stub->str = 0;
+    queue->head = stub;
+    queue->tail = stub;
+    return queue;
+}
+
+int dstr_queue_push_decref(dstr_queue *queue, dstr *str)
+{
+    dstr_queue_node *node = dstr_malloc(sizeof(dstr_queue_node)), *prev;
+
+    if (!node)
+        return 0;
+    node->str = str;
+    node->next = 0;
+    prev = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+    /* Consumer may briefly see prev as last node until this store.   */
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Return string of next node without consuming it.   */
+static dstr *__dstr_queue_peek(dstr_queue *queue)
+{
+    dstr_queue_node *next;
+
+    next = __atomic_load_n(&queue->tail->next, __ATOMIC_ACQUIRE);
+    return next ? next->str : 0;
+}
+
+/* Consume next node, which must exist. It becomes the new tail.   */
+static void __dstr_queue_advance(dstr_queue *queue)
+{
+    dstr_queue_node *tail = queue->tail;
+
+    queue->tail = tail->next;
+    queue->tail->str = 0;
+    dstr_free(tail);
+}
+
+dstr *dstr_queue_pop(dstr_queue *queue)
+{
+    dstr *str = __dstr_queue_peek(queue);
+
+    if (str)
+        __dstr_queue_advance(queue);
+    return str;
+}
+
+size_t dstr_queue_drain(dstr_queue *queue, dstr_vector *vec, size_t max)
+{
+    size_t n = 0;
+    dstr *str;
+
+    while ((!max || n < max) && (str = __dstr_queue_peek(queue))){
+        if (!dstr_vector_push_back_decref(vec, str))
+            break; /* String stays queued. */
+        __dstr_queue_advance(queue);
+        n++;
+    }
+    return n;
+}
+
+void dstr_queue_free(dstr_queue *queue)
+{
+    dstr *str;
+
+    while ((str = dstr_queue_pop(queue)))
+        dstr_decref(str);
+    dstr_free(queue->tail);
+    dstr_free(queue);
+}
+
+/*                             THREAD POOL                                  */
+
+/* Next and end chunk of one thread's share of a job. Padded so threads
+   claiming chunks do not share cache lines.   */
+typedef struct __dstr_pool_range{
+    size_t next;
+    size_t end;
+    char pad[64 - 2 * sizeof(size_t)];
+} __dstr_pool_range;
+
+typedef struct __dstr_pool_job{
+    void (*run)(void *arg, size_t chunk);
+    void *arg;
+    __dstr_pool_range *ranges;
+    unsigned int active; /* Pool threads not yet done with job. */
+} __dstr_pool_job;
+
+struct dstr_pool{
+    pthread_t *threads;
+    unsigned int n; /* Threads including the submitting thread. */
+    pthread_mutex_t submit_lock; /* Serializes jobs. */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    __dstr_pool_job *job;
+    unsigned long generation;
+    int shutdown;
+};
+
+typedef struct __dstr_pool_worker{
+    dstr_pool *pool;
+    unsigned int index;
+} __dstr_pool_worker;
+
+/* Claim a chunk from range. Claims past the end are simply discarded, so
+   each chunk is handed out exactly once.   */
+static int __dstr_pool_claim(__dstr_pool_range *range, size_t *chunk)
+{
+    if (__atomic_load_n(&range->next, __ATOMIC_RELAXED) >= range->end)
+        return 0;
+    *chunk = __atomic_fetch_add(&range->next, 1, __ATOMIC_RELAXED);
+    return *chunk < range->end;
+}
+
+/* Run own share of job, then steal from the other threads.   */
+static void __dstr_pool_run(const dstr_pool *pool, __dstr_pool_job *job,
+                            unsigned int index)
+{
+    unsigned int i;
+    size_t chunk;
+
+    while (__dstr_pool_claim(&job->ranges[index], &chunk))
+        job->run(job->arg, chunk);
+    for (i = 1; i < pool->n; i++){
+        __dstr_pool_range *victim = &job->ranges[(index + i) % pool->n];
+        while (__dstr_pool_claim(victim, &chunk))
+            job->run(job->arg, chunk);
+    }
+}
+
+static void *__dstr_pool_thread(void *arg)
+{
+    __dstr_pool_worker *worker = arg;
+    dstr_pool *pool = worker->pool;
+    unsigned long seen = 0;
+    __dstr_pool_job *job;
+
+    for (;;){
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->shutdown)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->shutdown){
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        seen = pool->generation;
+        job = pool->job;
+        pthread_mutex_unlock(&pool->lock);
+
+        __dstr_pool_run(pool, job, worker->index);
+
+        pthread_mutex_lock(&pool->lock);
+        if (!--job->active)
+            pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    dstr_free(worker);
+    return 0;
+}
+
+dstr_pool *dstr_pool_new(unsigned int n)
+{
+    dstr_pool *pool;
+    __dstr_pool_worker *worker;
+    unsigned int i;
+    long cpus;
+
+    if (!n){
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus > 0 ? cpus : 1;
+    }
+    pool = dstr_malloc(sizeof(dstr_pool));
+    if (!pool)
+        return 0;
+    pool->threads = dstr_malloc(n * sizeof(pthread_t));
+    if (!pool->threads){
+        dstr_free(pool);
+        return 0;
+    }
+    pthread_mutex_init(&pool->submit_lock, 0);
+    pthread_mutex_init(&pool->lock, 0);
+    pthread_cond_init(&pool->wake, 0);
+    pthread_cond_init(&pool->done, 0);
+    pool->job = 0;
+    pool->generation = 0;
+    pool->shutdown = 0;
+    /* Index 0 is the submitting thread.   */
+    pool->n = 1;
+    for (i = 1; i < n; i++){
+        worker = dstr_malloc(sizeof(__dstr_pool_worker));
+        if (!worker)
+            break;
+        worker->pool = pool;
+        worker->index = i;
+        if (pthread_create(&pool->threads[i], 0, __dstr_pool_thread, worker)){
+            dstr_free(worker);
+            break;
+        }
+        pool->n++;
+    }
+    return pool;
+}
+
+void dstr_pool_free(dstr_pool *pool)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 1; i < pool->n; i++)
+        pthread_join(pool->threads[i], 0);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->submit_lock);
+    dstr_free(pool->threads);
+    dstr_free(pool);
+}
+
+static dstr_pool *__dstr_default_pool;
+static pthread_once_t __dstr_default_pool_once = PTHREAD_ONCE_INIT;
+
+static void __dstr_default_pool_init()
+{
+    __dstr_default_pool = dstr_pool_new(0);
+}
+
+/* Run job over chunks on pool. Returns 0 on allocation failure, in which
+   case nothing has been run.   */
+static int __dstr_pool_submit(dstr_pool *pool, size_t chunks,
+                              void (*run)(void *, size_t), void *arg)
+{
+    __dstr_pool_job job;
+    size_t share, i;
+
+    if (!pool){
+        pthread_once(&__dstr_default_pool_once, __dstr_default_pool_init);
+        pool = __dstr_default_pool;
+    }
+    if (!pool || pool->n == 1 || chunks <= 1){
+        for (i = 0; i < chunks; i++)
+            run(arg, i);
+        return 1;
+    }
+
+    job.ranges = dstr_malloc(pool->n * sizeof(__dstr_pool_range));
+    if (!job.ranges)
+        return 0;
+    share = (chunks + pool->n - 1) / pool->n;
+    for (i = 0; i < pool->n; i++){
+        job.ranges[i].next = i * share < chunks ? i * share : chunks;
+        job.ranges[i].end = (i + 1) * share < chunks ? (i + 1) * share : chunks;
+    }
+    job.run = run;
+    job.arg = arg;
+
+    pthread_mutex_lock(&pool->submit_lock);
+    pthread_mutex_lock(&pool->lock);
+    job.active = pool->n - 1;
+    pool->job = &job;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    __dstr_pool_run(pool, &job, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (job.active)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pool->job = 0;
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->submit_lock);
+    dstr_free(job.ranges);
+    return 1;
+}
+
+static size_t __dstr_parallel_chunks(size_t sz)
+{
+    return (sz + DSTR_PARALLEL_CHUNK - 1) / DSTR_PARALLEL_CHUNK;
+}
+
+typedef struct __dstr_parallel_for{
+    dstr_vector *vec;
+    void (*callback)(dstr *, void *);
+    void *user_data;
+} __dstr_parallel_for;
+
+static void __dstr_parallel_for_chunk(void *arg, size_t chunk)
+{
+    __dstr_parallel_for *job = arg;
+    size_t i = chunk * DSTR_PARALLEL_CHUNK;
+    size_t end = i + DSTR_PARALLEL_CHUNK;
+
+    if (end > job->vec->sz)
+        end = job->vec->sz;
+    for (; i < end; i++)
+        job->callback(job->vec->arr[i], job->user_data);
+}
+
+void dstr_vector_parallel_for(dstr_pool *pool, dstr_vector *vec,
+                              void (*callback)(dstr *, void *),
+                              void *user_data)
+{
+    __dstr_parallel_for job;
+    size_t i;
+
+    job.vec = vec;
+    job.callback = callback;
+    job.user_data = user_data;
+    if (!__dstr_pool_submit(pool, __dstr_parallel_chunks(vec->sz),
+                            __dstr_parallel_for_chunk, &job)){
+        for (i = 0; i < vec->sz; i++)
+            callback(vec->arr[i], user_data);
+    }
+}
+
+/* Filtering runs in two passes over the chunks. The first pass marks kept
+   elements and counts them per chunk. After the per chunk counts are turned
+   into output offsets, the second pass copies kept elements into place.  */
+typedef struct __dstr_parallel_filter{
+    const dstr_vector *vec;
+    int (*callback)(const dstr *, void *);
+    void *user_data;
+    unsigned char *keep;
+    size_t *offsets;
+    dstr **out;
+} __dstr_parallel_filter;
+
+static void __dstr_parallel_mark_chunk(void *arg, size_t chunk)
+{
+    __dstr_parallel_filter *job = arg;
+    size_t i = chunk * DSTR_PARALLEL_CHUNK;
+    size_t end = i + DSTR_PARALLEL_CHUNK, n = 0;
+
+    if (end > job->vec->sz)
+        end = job->vec->sz;
+    for (; i < end; i++){
+        job->keep[i] = job->callback(job->vec->arr[i], job->user_data) ? 1 : 0;
+        n += job->keep[i];
+    }
+    job->offsets[chunk] = n;
+}
+
+static void __dstr_parallel_copy_chunk(void *arg, size_t chunk)
+{
+    __dstr_parallel_filter *job = arg;
+    size_t i = chunk * DSTR_PARALLEL_CHUNK;
+    size_t end = i + DSTR_PARALLEL_CHUNK;
+    dstr **out = job->out + job->offsets[chunk];
+
+    if (end > job->vec->sz)
+        end = job->vec->sz;
+    for (; i < end; i++){
+        if (job->keep[i]){
+            /* Same string may be in the vector more than once.   */
+            __dstr_incref_shared(job->vec->arr[i]);
+            *out++ = job->vec->arr[i];
+        }
+    }
+}
+
+dstr_vector *dstr_vector_parallel_filter(dstr_pool *pool,
+                                         const dstr_vector *vec,
+                                         int (*callback)(const dstr *, void *),
+                                         void *user_data)
+{
+    __dstr_parallel_filter job;
+    size_t chunks = __dstr_parallel_chunks(vec->sz), total = 0, n, i;
+    dstr_vector *found = 0;
+
+    job.vec = vec;
+    job.callback = callback;
+    job.user_data = user_data;
+    job.keep = dstr_malloc(vec->sz ? vec->sz : 1);
+    job.offsets = dstr_malloc((chunks ? chunks : 1) * sizeof(size_t));
+    if (!job.keep || !job.offsets)
+        goto out;
+    if (!__dstr_pool_submit(pool, chunks, __dstr_parallel_mark_chunk, &job))
+        goto out;
+    for (i = 0; i < chunks; i++){
+        n = job.offsets[i];
+        job.offsets[i] = total;
+        total += n;
+    }
+    found = dstr_vector_prealloc(total ? total : 1);
+    if (!found)
+        goto out;
+    job.out = found->arr;
+    if (!__dstr_pool_submit(pool, chunks, __dstr_parallel_copy_chunk, &job)){
+        dstr_vector_decref(found);
+        found = 0;
+        goto out;
+    }
+    found->sz = total;
+out:
+    dstr_free(job.keep);
+    dstr_free(job.offsets);
+    return found;
+}
+
+static int __dstr_parallel_contains(const dstr *str, void *substr)
+{
+    return str->data && strstr(str->data, substr) != 0;
+}
+
+dstr_vector *dstr_vector_parallel_search_contains(dstr_pool *pool,
+                                                  const dstr_vector *vec,
+                                                  const char *substr)
+{
+    __dstr_probe2(vector__search, vec->sz, substr);
+    return dstr_vector_parallel_filter(pool, vec, __dstr_parallel_contains,
+                                       (void *)substr);
+}
+
+/*                           STRING INTERN TABLE                            */
+
+#define __DSTR_INTERN_MIN_SLOTS 16
+
+typedef struct __dstr_intern_entry{
+    uint64_t hash;
+    dstr *str; /* Zero if slot is free. */
+} __dstr_intern_entry;
+
+/* Open addressing hash table with linear probing. Padded so locks of
+   neighbouring shards are on separate cache lines.   */
+typedef struct __dstr_intern_shard{
+    pthread_mutex_t lock;
+    __dstr_intern_entry *entries;
+    size_t mask; /* Number of slots - 1. */
+    size_t count;
+    char pad[64];
+} __dstr_intern_shard;
+
+struct dstr_intern{
+    __dstr_intern_shard *shards;
+    unsigned int shard_bits;
+};
+
+static uint64_t __dstr_rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Final avalanche of MurmurHash3.   */
+static uint64_t __dstr_fmix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Hash n bytes eight at a time, mixing lanes like MurmurHash3.   */
+static uint64_t __dstr_hash(const char *src, size_t n)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ n, w;
+
+    for (; n >= 8; n -= 8, src += 8){
+        memcpy(&w, src, 8);
+        w *= 0x87c37b91114253d5ULL;
+        w = __dstr_rotl64(w, 31);
+        w *= 0x4cf5ad432745937fULL;
+        h ^= w;
+        h = __dstr_rotl64(h, 27) * 5 + 0x52dce729;
+    }
+    if (n){
+        w = 0;
+        memcpy(&w, src, n);
+        w *= 0x87c37b91114253d5ULL;
+        w = __dstr_rotl64(w, 31);
+        w *= 0x4cf5ad432745937fULL;
+        h ^= w;
+    }
+    return __dstr_fmix64(h);
+}
+
+dstr_intern *dstr_intern_new(unsigned int shards)
+{
+    dstr_intern *table;
+    unsigned int bits = 0, i;
+
+    if (!shards)
+        shards = DSTR_INTERN_SHARDS;
+    while ((1u << bits) < shards)
+        bits++;
+    shards = 1u << bits;
+    table = dstr_malloc(sizeof(dstr_intern));
+    if (!table)
+        return 0;
+    table->shards = dstr_malloc(shards * sizeof(__dstr_intern_shard));
+    if (!table->shards){
+        dstr_free(table);
+        return 0;
+    }
+    table->shard_bits = bits;
+    for (i = 0; i < shards; i++){
+        pthread_mutex_init(&table->shards[i].lock, 0);
+        table->shards[i].entries = 0;
+        table->shards[i].mask = 0;
+        table->shards[i].count = 0;
+    }
+    return table;
+}
+
+static __dstr_intern_shard *__dstr_intern_shard_of(dstr_intern *table,
+                                                   uint64_t hash)
+{
+    /* Top bits pick the shard, low bits the slot within it.   */
+    return &table->shards[table->shard_bits ?
+                          hash >> (64 - table->shard_bits) : 0];
+}
+
+/* Find slot of string, or the free slot where it belongs.   */
+static __dstr_intern_entry *__dstr_intern_find(__dstr_intern_shard *shard,
+                                               uint64_t hash,
+                                               const char *src, size_t n)
+{
+    size_t i = hash & shard->mask;
+    __dstr_intern_entry *entry;
+
+    for (;;){
+        entry = &shard->entries[i];
+        if (!entry->str)
+            return entry;
+        if (entry->hash == hash && entry->str->sz == n &&
+                !memcmp(entry->str->data, src, n))
+            return entry;
+        i = (i + 1) & shard->mask;
+    }
+}
+
+/* Grow shard so it keeps a load factor of at most 3/4.   */
+static int __dstr_intern_grow(__dstr_intern_shard *shard)
+{
+    size_t slots = shard->entries ? (shard->mask + 1) * 2 :
+                                    __DSTR_INTERN_MIN_SLOTS;
+    __dstr_intern_entry *old = shard->entries, *entry;
+    size_t old_slots = shard->entries ? shard->mask + 1 : 0, i;
+
+    shard->entries = dstr_malloc(slots * sizeof(__dstr_intern_entry));
+    if (!shard->entries){
+        shard->entries = old;
+        return 0;
+    }
+    memset(shard->entries, 0, slots * sizeof(__dstr_intern_entry));
+    shard->mask = slots - 1;
+    for (i = 0; i < old_slots; i++){
+        if (!old[i].str)
+            continue;
+        entry = &shard->entries[old[i].hash & shard->mask];
+        while (entry->str){
+            entry++;
+            if (entry == shard->entries + slots)
+                entry = shard->entries;
+        }
+        *entry = old[i];
+    }
+    dstr_free(old);
+    return 1;
+}
+
+/* Look up or insert. If str is given it becomes the canonical string when
+   none exists, otherwise a copy of src is created.   */
+static dstr *__dstr_intern_insert(dstr_intern *table, dstr *str,
+                                  const char *src, size_t n)
+{
+    uint64_t hash = __dstr_hash(src, n);
+    __dstr_intern_shard *shard = __dstr_intern_shard_of(table, hash);
+    __dstr_intern_entry *entry;
+    dstr *canonical = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    if ((shard->count + 1) * 4 > (shard->entries ? shard->mask + 1 : 0) * 3 &&
+            !__dstr_intern_grow(shard))
+        goto out;
+    entry = __dstr_intern_find(shard, hash, src, n);
+    if (!entry->str){
+        if (str){
+            __dstr_incref_shared(str);
+        } else {
+            str = dstr_with_prealloc(n + 1);
+            if (!str)
+                goto out;
+            memcpy(str->data, src, n);
+            str->data[n] = '\0';
+            __dstr_set_sz(str, n);
+        }
+        entry->hash = hash;
+        entry->str = str;
+        shard->count++;
+    }
+    canonical = entry->str;
+    __dstr_incref_shared(canonical);
+out:
+    pthread_mutex_unlock(&shard->lock);
+    return canonical;
+}
+
+dstr *dstr_intern_insert(dstr_intern *table, dstr *str)
+{
+    return __dstr_intern_insert(table, str, str->data ? str->data : "",
+                                str->sz);
+}
+
+dstr *dstr_intern_insert_cstr(dstr_intern *table, const char *src)
+{
+    return __dstr_intern_insert(table, 0, src, strlen(src));
+}
+
+dstr *dstr_intern_insert_cstrn(dstr_intern *table, const char *src, size_t n)
+{
+    return __dstr_intern_insert(table, 0, src, n);
+}
+
+size_t dstr_intern_size(dstr_intern *table)
+{
+    size_t n = 0;
+    unsigned int i;
+
+    for (i = 0; i < (1u << table->shard_bits); i++){
+        pthread_mutex_lock(&table->shards[i].lock);
+        n += table->shards[i].count;
+        pthread_mutex_unlock(&table->shards[i].lock);
+    }
+    return n;
+}
+
+void dstr_intern_free(dstr_intern *table)
+{
+    __dstr_intern_shard *shard;
+    unsigned int i;
+    size_t j;
+
+    for (i = 0; i < (1u << table->shard_bits); i++){
+        shard = &table->shards[i];
+        for (j = 0; shard->entries && j <= shard->mask; j++){
+            if (shard->entries[j].str)
+                dstr_decref(shard->entries[j].str);
+        }
+        dstr_free(shard->entries);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    dstr_free(table->shards);
+    dstr_free(table);
+}
+
+/*                            READ-COPY-UPDATE                              */
+
+/* Three epoch reclamation. A object retired while the global epoch is e can
+   only be seen by readers that entered their read section in epoch e or
+   earlier. The epoch only advances when every reader inside a read section
+   has observed the current epoch, so once the global epoch reaches e + 2 no
+   such reader remains and the object can be decref'ed.   */
+
+typedef struct __dstr_rcu_reader{
+    unsigned long epoch; /* Epoch observed on entry, 0 outside read section. */
+    unsigned int nesting;
+    int in_use;
+    struct __dstr_rcu_reader *next;
+    char pad[64 - 2 * sizeof(unsigned long) - sizeof(void *)];
+} __dstr_rcu_reader;
+
+typedef struct __dstr_rcu_retired{
+    void *obj;
+    int is_vector;
+    unsigned long epoch;
+} __dstr_rcu_retired;
+
+/* Retired objects are kept in retire order, which is also epoch order, so
+   the ones that can be reclaimed are always a prefix starting at head.   */
+static struct {
+    unsigned long epoch;
+    __dstr_rcu_reader *readers; /* Never shrinks, records are reused. */
+    pthread_mutex_t lock; /* Protects retired list. */
+    pthread_mutex_t reclaim_lock; /* Held while releasing retired objects. */
+    __dstr_rcu_retired *retired;
+    size_t head; /* First object still waiting. */
+    size_t retired_sz;
+    size_t retired_space;
+    unsigned long long reclaimed; /* Objects taken off list since start. */
+    pthread_key_t key;
+    pthread_once_t once;
+} __dstr_rcu = { 1, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+                 0, 0, 0, 0, 0, 0, PTHREAD_ONCE_INIT };
+
+static __thread __dstr_rcu_reader *__dstr_rcu_self;
+
+/* Shared by threads that could not allocate a reader record of their own.
+   Its nesting counts read sections of all those threads, and the epoch of
+   the first one entered is kept until all have left, which is
+   conservative.   */
+static __dstr_rcu_reader __dstr_rcu_fallback;
+static pthread_mutex_t __dstr_rcu_fallback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t __dstr_rcu_fallback_once = PTHREAD_ONCE_INIT;
+
+/* Release reader record on thread exit.   */
+static void __dstr_rcu_thread_exit(void *arg)
+{
+    __dstr_rcu_reader *reader = arg;
+
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+    reader->nesting = 0;
+    __atomic_store_n(&reader->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void __dstr_rcu_init()
+{
+    pthread_key_create(&__dstr_rcu.key, __dstr_rcu_thread_exit);
+}
+
+static void __dstr_rcu_link(__dstr_rcu_reader *reader)
+{
+    reader->next = __atomic_load_n(&__dstr_rcu.readers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&__dstr_rcu.readers, &reader->next,
+                                        reader, 0, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED))
+        ;
+}
+
+static void __dstr_rcu_fallback_init()
+{
+    __dstr_rcu_fallback.in_use = 1;
+    __dstr_rcu_link(&__dstr_rcu_fallback);
+}
+
+static __dstr_rcu_reader *__dstr_rcu_register()
+{
+    __dstr_rcu_reader *reader;
+    int unused;
+
+    pthread_once(&__dstr_rcu.once, __dstr_rcu_init);
+    for (reader = __atomic_load_n(&__dstr_rcu.readers, __ATOMIC_ACQUIRE);
+            reader; reader = reader->next){
+        unused = 0;
+        if (__atomic_compare_exchange_n(&reader->in_use, &unused, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+    if (!reader){
+        reader = calloc(1, sizeof(__dstr_rcu_reader));
+        if (!reader){
+            /* Read sections can not fail, share the fallback record.   */
+            pthread_once(&__dstr_rcu_fallback_once, __dstr_rcu_fallback_init);
+            __dstr_rcu_self = &__dstr_rcu_fallback;
+            return &__dstr_rcu_fallback;
+        }
+        reader->in_use = 1;
+        __dstr_rcu_link(reader);
+    }
+    pthread_setspecific(__dstr_rcu.key, reader);
+    __dstr_rcu_self = reader;
+    return reader;
+}
+
+/* Announce the current epoch and order it before loads of published
+   pointers.   */
+static void __dstr_rcu_enter(__dstr_rcu_reader *reader)
+{
+    __atomic_store_n(&reader->epoch,
+                     __atomic_load_n(&__dstr_rcu.epoch, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void dstr_rcu_read_lock()
+{
+    __dstr_rcu_reader *reader = __dstr_rcu_self;
+
+    if (!reader)
+        reader = __dstr_rcu_register();
+    if (reader == &__dstr_rcu_fallback){
+        pthread_mutex_lock(&__dstr_rcu_fallback_lock);
+        if (!reader->nesting++)
+            __dstr_rcu_enter(reader);
+        pthread_mutex_unlock(&__dstr_rcu_fallback_lock);
+        return;
+    }
+    if (reader->nesting++)
+        return;
+    __dstr_rcu_enter(reader);
+}
+
+void dstr_rcu_read_unlock()
+{
+    __dstr_rcu_reader *reader = __dstr_rcu_self;
+
+    if (reader == &__dstr_rcu_fallback){
+        pthread_mutex_lock(&__dstr_rcu_fallback_lock);
+        if (!--reader->nesting)
+            __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&__dstr_rcu_fallback_lock);
+        return;
+    }
+    if (!--reader->nesting)
+        __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Advance global epoch if all readers in read sections observed it. Called
+   with lock held.   */
+static void __dstr_rcu_try_advance()
+{
+    unsigned long epoch = __atomic_load_n(&__dstr_rcu.epoch, __ATOMIC_SEQ_CST);
+    unsigned long seen;
+    __dstr_rcu_reader *reader;
+
+    for (reader = __atomic_load_n(&__dstr_rcu.readers, __ATOMIC_ACQUIRE);
+            reader; reader = reader->next){
+        seen = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+        if (seen && seen != epoch)
+            return;
+    }
+    __atomic_store_n(&__dstr_rcu.epoch, epoch + 1, __ATOMIC_SEQ_CST);
+}
+
+static void __dstr_rcu_release(__dstr_rcu_retired *retired)
+{
+    if (retired->is_vector)
+        dstr_vector_decref(retired->obj);
+    else
+        dstr_decref(retired->obj);
+}
+
+/* Advance epoch and decref everything retired at least two epochs ago,
+   oldest first. Only checks the oldest object when nothing can be
+   reclaimed yet. Called with reclaim_lock held, so objects counted in
+   reclaimed have been released when it is unlocked.   */
+static void __dstr_rcu_reclaim()
+{
+    __dstr_rcu_retired retired;
+    unsigned long epoch;
+
+    pthread_mutex_lock(&__dstr_rcu.lock);
+    __dstr_rcu_try_advance();
+    __dstr_rcu_try_advance();
+    epoch = __atomic_load_n(&__dstr_rcu.epoch, __ATOMIC_SEQ_CST);
+    /* Release outside lock, one at a time, releasing vectors may take a
+       while.   */
+    while (__dstr_rcu.head < __dstr_rcu.retired_sz &&
+           __dstr_rcu.retired[__dstr_rcu.head].epoch + 2 <= epoch){
+        retired = __dstr_rcu.retired[__dstr_rcu.head++];
+        __dstr_rcu.reclaimed++;
+        pthread_mutex_unlock(&__dstr_rcu.lock);
+        __dstr_rcu_release(&retired);
+        pthread_mutex_lock(&__dstr_rcu.lock);
+    }
+    if (__dstr_rcu.head == __dstr_rcu.retired_sz)
+        __dstr_rcu.head = __dstr_rcu.retired_sz = 0;
+    pthread_mutex_unlock(&__dstr_rcu.lock);
+}
+
+void dstr_rcu_synchronize()
+{
+    unsigned long long target, reclaimed;
+
+    /* Wait only for objects retired before the call.   */
+    pthread_mutex_lock(&__dstr_rcu.lock);
+    target = __dstr_rcu.reclaimed + __dstr_rcu.retired_sz - __dstr_rcu.head;
+    pthread_mutex_unlock(&__dstr_rcu.lock);
+    for (;;){
+        pthread_mutex_lock(&__dstr_rcu.reclaim_lock);
+        __dstr_rcu_reclaim();
+        pthread_mutex_lock(&__dstr_rcu.lock);
+        reclaimed = __dstr_rcu.reclaimed;
+        pthread_mutex_unlock(&__dstr_rcu.lock);
+        pthread_mutex_unlock(&__dstr_rcu.reclaim_lock);
+        if (reclaimed >= target)
+            return;
+        sched_yield();
+    }
+}
+
+/* Wait for a grace period, then decref object directly.   */
+static void __dstr_rcu_retire_now(void *obj, int is_vector)
+{
+    __dstr_rcu_retired retired;
+
+    retired.obj = obj;
+    retired.is_vector = is_vector;
+    retired.epoch = __atomic_load_n(&__dstr_rcu.epoch, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&__dstr_rcu.epoch, __ATOMIC_SEQ_CST) <
+            retired.epoch + 2){
+        pthread_mutex_lock(&__dstr_rcu.lock);
+        __dstr_rcu_try_advance();
+        pthread_mutex_unlock(&__dstr_rcu.lock);
+        sched_yield();
+    }
+    __dstr_rcu_release(&retired);
+}
+
+/* Make room for one more retired object. Waiting objects are moved down
+   only when at least half the list is free, so each is moved at most a
+   constant number of times on average. Called with lock held.   */
+static int __dstr_rcu_retired_room()
+{
+    __dstr_rcu_retired *tmp_ptr;
+    size_t space, waiting = __dstr_rcu.retired_sz - __dstr_rcu.head;
+
+    if (__dstr_rcu.retired_sz < __dstr_rcu.retired_space)
+        return 1;
+    if (__dstr_rcu.head && __dstr_rcu.head >= waiting){
+        memmove(__dstr_rcu.retired, __dstr_rcu.retired + __dstr_rcu.head,
+                waiting * sizeof(__dstr_rcu_retired));
+        __dstr_rcu.head = 0;
+        __dstr_rcu.retired_sz = waiting;
+        return 1;
+    }
+    space = (__dstr_rcu.retired_space + 1) * DSTR_VECTOR_MEM_EXPAND_RATE;
+    tmp_ptr = dstr_realloc(__dstr_rcu.retired,
+                           space * sizeof(__dstr_rcu_retired),
+                           __dstr_rcu.retired_space *
+                           sizeof(__dstr_rcu_retired));
+    if (!tmp_ptr)
+        return 0;
+    __dstr_rcu.retired = tmp_ptr;
+    __dstr_rcu.retired_space = space;
+    return 1;
+}
+
+static void __dstr_rcu_retire(void *obj, int is_vector)
+{
+    size_t pending;
+
+    if (!obj)
+        return;
+    pthread_mutex_lock(&__dstr_rcu.lock);
+    if (!__dstr_rcu_retired_room()){
+        /* Can not defer, wait for a grace period instead.   */
+        pthread_mutex_unlock(&__dstr_rcu.lock);
+        __dstr_rcu_retire_now(obj, is_vector);
+        return;
+    }
+    __dstr_rcu.retired[__dstr_rcu.retired_sz].obj = obj;
+    __dstr_rcu.retired[__dstr_rcu.retired_sz].is_vector = is_vector;
+    __dstr_rcu.retired[__dstr_rcu.retired_sz].epoch =
+        __atomic_load_n(&__dstr_rcu.epoch, __ATOMIC_SEQ_CST);
+    pending = ++__dstr_rcu.retired_sz - __dstr_rcu.head;
+    pthread_mutex_unlock(&__dstr_rcu.lock);
+    /* Writers do not wait for each other to reclaim.   */
+    if (pending >= DSTR_RCU_BATCH &&
+            !pthread_mutex_trylock(&__dstr_rcu.reclaim_lock)){
+        __dstr_rcu_reclaim();
+        pthread_mutex_unlock(&__dstr_rcu.reclaim_lock);
+    }
+}
+
+void dstr_rcu_defer_decref(dstr *str)
+{
+    __dstr_rcu_retire(str, 0);
+}
+
+void dstr_rcu_defer_vector_decref(dstr_vector *vec)
+{
+    __dstr_rcu_retire(vec, 1);
+}
+
+int dstr_rcu_publish(dstr **slot, dstr *str)
+{
+    __dstr_rcu_retire(__atomic_exchange_n(slot, str, __ATOMIC_SEQ_CST), 0);
+    return 1;
+}
+
+int dstr_rcu_publish_vector(dstr_vector **slot, dstr_vector *vec)
+{
+    __dstr_rcu_retire(__atomic_exchange_n(slot, vec, __ATOMIC_SEQ_CST), 1);
+    return 1;
+}
+
+/*                          DYNAMIC STRING BUILDER                          */
+
+typedef struct __dstr_piece{
+    const char *ptr;
+    size_t len;
+    dstr *str; /* Set if a reference is held. */
+} __dstr_piece;
+
+typedef struct dstr_builder_chunk{
+    struct dstr_builder_chunk *next;
+    size_t cnt;
+    __dstr_piece pieces[DSTR_BUILDER_CHUNK_SIZE];
+} dstr_builder_chunk;
+
+dstr_builder *dstr_builder_new()
+{
+    dstr_builder *builder = dstr_malloc(sizeof(dstr_builder));
+    if (!builder)
+        return 0;
+    builder->head = 0;
+    builder->tail = 0;
+    builder->sz = 0;
+    builder->ref = 1;
+    return builder;
+}
+
+static int __dstr_builder_put(dstr_builder *builder, const char *ptr,
+                              size_t len, dstr *str)
+{
+    dstr_builder_chunk *chunk = builder->tail;
+    __dstr_piece *piece;
+
+    if (!chunk || chunk->cnt == DSTR_BUILDER_CHUNK_SIZE){
+        if (chunk && chunk->next){
+            /* Reuse chunk kept from a previous clear.   */
+            chunk = chunk->next;
+        } else {
+            chunk = dstr_malloc(sizeof(dstr_builder_chunk));
+            if (!chunk)
+                return 0;
+            chunk->next = 0;
+            if (builder->tail)
+                builder->tail->next = chunk;
+            else
+                builder->head = chunk;
+        }
+        chunk->cnt = 0;
+        builder->tail = chunk;
+    }
+    piece = &chunk->pieces[chunk->cnt++];
+    piece->ptr = ptr;
+    piece->len = len;
+    piece->str = str;
+    builder->sz += len;
+    return 1;
+}
+
+int dstr_builder_add_cstr(dstr_builder *builder, const char *src)
+{
+    return __dstr_builder_put(builder, src, strlen(src), 0);
+}
+
+int dstr_builder_add_cstrn(dstr_builder *builder, const char *src, size_t n)
+{
+    return __dstr_builder_put(builder, src, n, 0);
+}
+
+int dstr_builder_add(dstr_builder *builder, dstr *str)
+{
+    if (!__dstr_builder_put(builder, str->data, str->sz, str))
+        return 0;
+    dstr_incref(str);
+    return 1;
+}
+
+int dstr_builder_add_decref(dstr_builder *builder, dstr *str)
+{
+    return __dstr_builder_put(builder, str->data, str->sz, str);
+}
+
+size_t dstr_builder_length(const dstr_builder *builder)
+{
+    return builder->sz;
+}
+
+/* For each macro over builder pieces. Chunks past tail are kept for reuse
+   and hold no pieces.   */
+#define __DSTR_BUILDER_FOREACH(builder, chunk, i) \
+    for (chunk = builder->head; chunk; \
+         chunk = chunk == builder->tail ? 0 : chunk->next) \
+        for (i = 0; i < chunk->cnt; i++)
+
+dstr *dstr_builder_to_dstr(const dstr_builder *builder)
+{
+    dstr_builder_chunk *chunk;
+    dstr *str;
+    char *pos;
+    size_t i;
+
+    str = dstr_with_prealloc(builder->sz + 1);
+    if (!str)
+        return 0;
+    pos = str->data;
+    __DSTR_BUILDER_FOREACH(builder, chunk, i){
+        memcpy(pos, chunk->pieces[i].ptr, chunk->pieces[i].len);
+        pos += chunk->pieces[i].len;
+    }
+    *pos = '\0';
+    __dstr_set_sz(str, builder->sz);
+    return str;
+}
+
+int dstr_builder_writev(int fd, const dstr_builder *builder)
+{
+    __dstr_iov_batch batch;
+    dstr_builder_chunk *chunk;
+    size_t i;
+
+    batch.fd = fd;
+    batch.cnt = 0;
+    __DSTR_BUILDER_FOREACH(builder, chunk, i){
+        if (!__dstr_iov_push(&batch, chunk->pieces[i].ptr,
+                             chunk->pieces[i].len))
+            return 0;
+    }
+    return __dstr_iov_flush(&batch);
+}
+
+void dstr_builder_clear(dstr_builder *builder)
+{
+    dstr_builder_chunk *chunk;
+    size_t i;
+
+    __DSTR_BUILDER_FOREACH(builder, chunk, i){
+        if (chunk->pieces[i].str)
+            dstr_decref(chunk->pieces[i].str);
+    }
+    if (builder->head){
+        builder->head->cnt = 0;
+        builder->tail = builder->head;
+    }
+    builder->sz = 0;
+}
+
+void dstr_builder_decref(dstr_builder *builder)
+{
+    dstr_builder_chunk *chunk, *next;
+
+    builder->ref--;
+    if (!builder->ref){
+        dstr_builder_clear(builder);
+        for (chunk = builder->head; chunk; chunk = next){
+            next = chunk->next;
+            dstr_free(chunk);
+        }
+        dstr_free(builder);
+    }
+}
+
+/*                          DYNAMIC STRING READER                           */
+
+dstr_reader *dstr_reader_new(int fd)
+{
+    return dstr_reader_with_bufsize(fd, DSTR_READER_BUFSIZE);
+}
+
+dstr_reader *dstr_reader_with_bufsize(int fd, size_t sz)
+{
+    dstr_reader *reader;
+
+    if (!sz)
+        return 0;
+    reader = dstr_malloc(sizeof(dstr_reader));
+    if (!reader)
         return 0;
+    reader->buf = dstr_malloc(sz);
+    if (!reader->buf){
+        dstr_free(reader);
+        return 0;
+    }
+    reader->fd = fd;
+    reader->pos = 0;
+    reader->sz = 0;
+    reader->mem = sz;
+    reader->eof = 0;
+    return reader;
+}
+
+void dstr_reader_free(dstr_reader *reader)
+{
+#ifdef DSTR_MEM_CLEAR
+    dstr_safe_free(reader->buf, reader->mem);
+#else
+    dstr_free(reader->buf);
 #endif
-    return vec->arr[pos];
+    dstr_free(reader);
 }
 
-int dstr_vector_is_empty(const dstr_vector *vec)
+/* Fill the reader buffer. Returns bytes read, 0 on end of file and -1 on
+   error.   */
+static ssize_t __dstr_reader_fill(dstr_reader *reader)
 {
-    return !vec->sz;
+    ssize_t rc;
+
+    do {
+        rc = read(reader->fd, reader->buf, reader->mem);
+    } while (rc == -1 && errno == EINTR);
+    if (rc == 0)
+        reader->eof = 1;
+    reader->pos = 0;
+    reader->sz = rc > 0 ? rc : 0;
+    return rc;
 }
 
-size_t dstr_vector_size(const dstr_vector *vec)
+int dstr_getline(dstr_reader *reader, dstr *out)
 {
-    return vec->sz;
+    const char *start, *nl;
+    size_t avail;
+    int got = 0;
+
+    if (__dstr_immortal(out))
+        return -1;
+    __dstr_set_sz(out, 0);
+    if (out->data)
+        out->data[0] = '\0';
+    for (;;){
+        if (reader->pos == reader->sz){
+            if (reader->eof)
+                return got;
+            switch (__dstr_reader_fill(reader)){
+            case -1:
+                return -1;
+            case 0:
+                return got;
+            }
+        }
+        start = reader->buf + reader->pos;
+        avail = reader->sz - reader->pos;
+        nl = memchr(start, '\n', avail);
+        if (nl){
+            if (!__dstr_put_bytes(out, start, nl - start))
+                return -1;
+            reader->pos += (nl - start) + 1;
+            return 1;
+        }
+        if (!__dstr_put_bytes(out, start, avail))
+            return -1;
+        reader->pos = reader->sz;
+        got = 1;
+    }
 }
 
-int dstr_vector_remove(dstr_vector *vec, size_t pos)
+dstr *dstr_read_all(int fd)
 {
-#ifdef DSTR_MEM_SECURITY
-    if (!vec->sz || vec->sz - 1 < pos)
+    struct stat st;
+    size_t prealloc = DSTR_READER_BUFSIZE;
+    ssize_t rc;
+    dstr *str;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        prealloc = st.st_size;
+    /* One extra byte for the sentinel and one to detect end of file without
+       growing a exactly sized buffer.   */
+    str = dstr_with_prealloc(prealloc + 2);
+    if (!str)
+        return 0;
+    for (;;){
+        if (str->mem - str->sz < 2){
+            if (!__dstr_alloc(str, str->mem)){
+                dstr_decref(str);
+                return 0;
+            }
+        }
+        rc = read(fd, str->data + str->sz, str->mem - str->sz - 1);
+        if (rc == -1){
+            if (errno == EINTR)
+                continue;
+            dstr_decref(str);
+            return 0;
+        }
+        if (rc == 0)
+            break;
+        __dstr_set_sz(str, str->sz + rc);
+    }
+    str->data[str->sz] = '\0';
+    return str;
+}
+
+/*                         DYNAMIC STRING TOKENIZER                         */
+
+dstr_tokenizer *dstr_tokenizer_new(const char *delims, int flags)
+{
+    return dstr_tokenizer_with_delimsn(delims, strlen(delims), flags);
+}
+
+dstr_tokenizer *dstr_tokenizer_with_delimsn(const char *delims, size_t n,
+                                            int flags)
+{
+    dstr_tokenizer *tok = dstr_malloc(sizeof(dstr_tokenizer));
+    size_t i;
+
+    if (!tok)
         return 0;
+    memset(tok, 0, sizeof(dstr_tokenizer));
+    for (i = 0; i < n; i++)
+        __dstr_byteset_add(tok->set, tok->lo, tok->hi, delims[i]);
+    tok->flags = flags;
+    tok->done = 1;
+    return tok;
+}
+
+void dstr_tokenizer_free(dstr_tokenizer *tok)
+{
+    dstr_free(tok);
+}
+
+void dstr_tokenizer_reset(dstr_tokenizer *tok, const char *text, size_t n)
+{
+    tok->text = text;
+    tok->sz = n;
+    tok->pos = 0;
+    tok->block = (size_t)-1;
+    tok->done = 0;
+}
+
+/* Classify the block holding offset pos, unless already done.   */
+static void __dstr_tok_load(dstr_tokenizer *tok, size_t pos)
+{
+    size_t block = pos & ~(size_t)31, i, n;
+    unsigned int mask = 0;
+
+    if (block == tok->block)
+        return;
+    n = tok->sz - block < 32 ? tok->sz - block : 32;
+#ifdef __DSTR_X86_SIMD
+    if (n == 32 && __dstr_has_avx2()){
+        tok->mask = __dstr_byteset_classify_avx2(tok->lo, tok->hi,
+                                                 tok->text + block);
+        tok->block = block;
+        return;
+    }
 #endif
+    for (i = 0; i < n; i++)
+        if (__dstr_byteset_has(tok->set, tok->text[block + i]))
+            mask |= 1u << i;
+    tok->mask = mask;
+    tok->block = block;
+}
 
-    dstr_decref(vec->arr[pos]);
-    memmove(vec->arr + pos,
-            vec->arr + pos + 1,
-            sizeof(dstr*) * (vec->sz - pos - 1));
-    vec->sz--;
+/* Offset of first delimiter (delim set) or non delimiter at or after pos,
+   or the end of text.   */
+static size_t __dstr_tok_find(dstr_tokenizer *tok, size_t pos, int delim)
+{
+    unsigned int mask;
+
+    while (pos < tok->sz){
+        __dstr_tok_load(tok, pos);
+        mask = delim ? tok->mask : ~tok->mask;
+        mask &= ~0u << (pos & 31);
+        if (mask)
+            return tok->block + __builtin_ctz(mask) < tok->sz ?
+                tok->block + __builtin_ctz(mask) : tok->sz;
+        pos = tok->block + 32;
+    }
+    return tok->sz;
+}
+
+int dstr_tokenizer_next_view(dstr_tokenizer *tok, const char **token,
+                             size_t *n)
+{
+    size_t start = tok->pos, end;
+
+    if (tok->done)
+        return 0;
+    if (tok->flags & DSTR_TOKENIZER_COLLAPSE){
+        start = __dstr_tok_find(tok, start, 0);
+        if (start == tok->sz){
+            tok->done = 1;
+            return 0;
+        }
+    }
+    end = __dstr_tok_find(tok, start, 1);
+    *token = tok->text + start;
+    *n = end - start;
+    if (end == tok->sz)
+        tok->done = 1;
+    else
+        tok->pos = end + 1;
+    return 1;
+}
+
+dstr *dstr_tokenizer_next(dstr_tokenizer *tok)
+{
+    const char *token;
+    size_t n;
+
+    if (!dstr_tokenizer_next_view(tok, &token, &n))
+        return 0;
+    return dstr_with_initialn(token, n);
+}
+
+dstr_vector *dstr_tokenizer_split(dstr_tokenizer *tok, const dstr *str)
+{
+    dstr_vector *vec = dstr_vector_new();
+    const char *token;
+    dstr *item;
+    size_t n;
+
+    if (!vec)
+        return 0;
+    dstr_tokenizer_reset(tok, dstr_to_cstr_const(str), dstr_length(str));
+    while (dstr_tokenizer_next_view(tok, &token, &n)){
+        item = dstr_with_initialn(token, n);
+        if (!item || !dstr_vector_push_back_decref(vec, item)){
+            if (item)
+                dstr_decref(item);
+            dstr_vector_decref(vec);
+            return 0;
+        }
+    }
+    return vec;
+}
+
+/*                           DYNAMIC STRING CSV                             */
+
+#define __DSTR_CSV_READ 0
+#define __DSTR_CSV_MAPPED 1
+#define __DSTR_CSV_BORROWED 2
+
+struct dstr_csv_span{
+    size_t off;
+    size_t sz;
+    int escaped; /* Holds doubled quotes. */
+};
+
+static dstr_csv *__dstr_csv_alloc(char delim)
+{
+    dstr_csv *csv = dstr_malloc(sizeof(dstr_csv));
+
+    if (!csv)
+        return 0;
+    memset(csv, 0, sizeof(dstr_csv));
+    csv->fd = -1;
+    csv->delim = delim;
+    csv->block = (size_t)-1;
+    csv->scratch = dstr_new();
+    if (!csv->scratch){
+        dstr_free(csv);
+        return 0;
+    }
+    return csv;
+}
+
+dstr_csv *dstr_csv_new(int fd, char delim)
+{
+    dstr_csv *csv = __dstr_csv_alloc(delim);
+
+    if (!csv)
+        return 0;
+    csv->buf = dstr_malloc(DSTR_CSV_BUFSIZE);
+    if (!csv->buf){
+        dstr_csv_free(csv);
+        return 0;
+    }
+    csv->fd = fd;
+    csv->source = __DSTR_CSV_READ;
+    csv->mem = DSTR_CSV_BUFSIZE;
+    return csv;
+}
+
+dstr_csv *dstr_csv_mmap(int fd, char delim)
+{
+    struct stat st;
+    dstr_csv *csv;
+    void *map;
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+        return 0;
+    if (!st.st_size)
+        return dstr_csv_with_buffer("", 0, delim);
+    map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return 0;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    csv = dstr_csv_with_buffer(map, st.st_size, delim);
+    if (!csv){
+        munmap(map, st.st_size);
+        return 0;
+    }
+    csv->source = __DSTR_CSV_MAPPED;
+    return csv;
+}
+
+dstr_csv *dstr_csv_with_buffer(const char *data, size_t n, char delim)
+{
+    dstr_csv *csv = __dstr_csv_alloc(delim);
+
+    if (!csv)
+        return 0;
+    csv->source = __DSTR_CSV_BORROWED;
+    csv->buf = (char *)data;
+    csv->sz = n;
+    csv->mem = n;
+    csv->eof = 1;
+    return csv;
+}
+
+void dstr_csv_free(dstr_csv *csv)
+{
+    if (csv->source == __DSTR_CSV_READ){
+#ifdef DSTR_MEM_CLEAR
+        dstr_safe_free(csv->buf, csv->mem);
+#else
+        dstr_free(csv->buf);
+#endif
+    } else if (csv->source == __DSTR_CSV_MAPPED){
+        munmap(csv->buf, csv->mem);
+    }
+    dstr_free(csv->spans);
+    dstr_free(csv->views);
+    dstr_decref(csv->scratch);
+    dstr_free(csv);
+}
+
+#ifdef __DSTR_X86_SIMD
+
+__attribute__((target("avx2")))
+static void __dstr_csv_classify_avx2(dstr_csv *csv, const char *p)
+{
+    __m256i in = _mm256_loadu_si256((const __m256i *)p);
+    __m256i quote = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('"'));
+    __m256i special;
+
+    special = _mm256_or_si256(
+        _mm256_cmpeq_epi8(in, _mm256_set1_epi8(csv->delim)),
+        _mm256_cmpeq_epi8(in, _mm256_set1_epi8('\n')));
+    special = _mm256_or_si256(special,
+                              _mm256_cmpeq_epi8(in, _mm256_set1_epi8('\r')));
+    csv->quote = _mm256_movemask_epi8(quote);
+    csv->special = _mm256_movemask_epi8(_mm256_or_si256(special, quote));
+}
+
+#endif /* __DSTR_X86_SIMD */
+
+/* Classify the block holding offset pos, unless already done. Bits past
+   the end of the buffer are left clear.   */
+static void __dstr_csv_load(dstr_csv *csv, size_t pos)
+{
+    size_t block = pos & ~(size_t)31, i, n;
+    unsigned int special = 0, quote = 0;
+    char c;
+
+    if (block == csv->block)
+        return;
+    csv->block = block;
+    n = csv->sz - block < 32 ? csv->sz - block : 32;
+#ifdef __DSTR_X86_SIMD
+    if (n == 32 && __dstr_has_avx2()){
+        __dstr_csv_classify_avx2(csv, csv->buf + block);
+        return;
+    }
+#endif
+    for (i = 0; i < n; i++){
+        c = csv->buf[block + i];
+        if (c == '"')
+            quote |= 1u << i;
+        if (c == '"' || c == csv->delim || c == '\n' || c == '\r')
+            special |= 1u << i;
+    }
+    csv->special = special;
+    csv->quote = quote;
+}
+
+/* Offset of first quote (quote set) or special byte at or after pos, or
+   the end of the buffer.   */
+static size_t __dstr_csv_find(dstr_csv *csv, size_t pos, int quote)
+{
+    unsigned int mask;
+
+    while (pos < csv->sz){
+        __dstr_csv_load(csv, pos);
+        mask = (quote ? csv->quote : csv->special) & (~0u << (pos & 31));
+        if (mask)
+            return csv->block + __builtin_ctz(mask);
+        pos = csv->block + 32;
+    }
+    return csv->sz;
+}
+
+static int __dstr_csv_add(dstr_csv *csv, size_t first, size_t last,
+                          int escaped)
+{
+    struct dstr_csv_span *tmp;
+    size_t mem;
+
+    if (csv->fields == csv->spans_mem){
+        mem = csv->spans_mem ? 2 * csv->spans_mem : 16;
+        tmp = dstr_realloc(csv->spans, mem * sizeof(*tmp),
+                           csv->spans_mem * sizeof(*tmp));
+        if (!tmp)
+            return 0;
+        csv->spans = tmp;
+        csv->spans_mem = mem;
+    }
+    csv->spans[csv->fields].off = first;
+    csv->spans[csv->fields].sz = last - first;
+    csv->spans[csv->fields].escaped = escaped;
+    csv->fields++;
+    return 1;
+}
+
+/* Parse the row at pos into spans. Returns 1 for a row, 0 if more input
+   is needed to tell where it ends and -1 on malformed input.   */
+static int __dstr_csv_parse(dstr_csv *csv)
+{
+    const char *buf = csv->buf;
+    size_t pos = csv->pos, end = csv->sz, q;
+    int escaped;
+
+    csv->fields = 0;
+    for (;;){
+        if (pos < end && buf[pos] == '"'){
+            escaped = 0;
+            q = pos + 1;
+            for (;;){
+                q = __dstr_csv_find(csv, q, 1);
+                /* A quote last in buffer may be the first of a pair.   */
+                if (q + 1 >= end && !csv->eof)
+                    return 0;
+                if (q == end)
+                    return -1;
+                if (q + 1 == end || buf[q + 1] != '"')
+                    break;
+                escaped = 1;
+                q += 2;
+            }
+            if (!__dstr_csv_add(csv, pos + 1, q, escaped))
+                return -1;
+            pos = q + 1;
+            if (pos < end && buf[pos] != csv->delim && buf[pos] != '\n' &&
+                buf[pos] != '\r')
+                return -1;
+        } else {
+            q = __dstr_csv_find(csv, pos, 0);
+            while (q < end && buf[q] == '"')
+                q = __dstr_csv_find(csv, q + 1, 0);
+            if (q == end && !csv->eof)
+                return 0;
+            if (!__dstr_csv_add(csv, pos, q, 0))
+                return -1;
+            pos = q;
+        }
+        if (pos == end)
+            break;
+        if (buf[pos] == csv->delim){
+            pos++;
+            continue;
+        }
+        if (buf[pos] == '\r'){
+            if (pos + 1 == end && !csv->eof)
+                return 0;
+            if (pos + 1 < end && buf[pos + 1] == '\n')
+                pos++;
+        }
+        pos++;
+        break;
+    }
+    csv->pos = pos;
+    return 1;
+}
+
+/* Move the unparsed tail to the front of the buffer, growing it when full,
+   and read more.   */
+static int __dstr_csv_fill(dstr_csv *csv)
+{
+    ssize_t rc;
+    char *tmp;
+
+    if (csv->pos){
+        memmove(csv->buf, csv->buf + csv->pos, csv->sz - csv->pos);
+        csv->sz -= csv->pos;
+        csv->pos = 0;
+    }
+    if (csv->sz == csv->mem){
+        tmp = dstr_realloc(csv->buf, 2 * csv->mem, csv->mem);
+        if (!tmp)
+            return 0;
+        csv->buf = tmp;
+        csv->mem *= 2;
+    }
+    csv->block = (size_t)-1;
+    for (;;){
+        rc = read(csv->fd, csv->buf + csv->sz, csv->mem - csv->sz);
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc == -1)
+            return 0;
+        if (rc == 0)
+            csv->eof = 1;
+        csv->sz += rc;
+        return 1;
+    }
+}
+
+static int __dstr_csv_row(dstr_csv *csv)
+{
+    int rc;
+
+    for (;;){
+        if (csv->pos < csv->sz){
+            rc = __dstr_csv_parse(csv);
+            if (rc == 1)
+                csv->rows++;
+            if (rc)
+                return rc;
+        } else if (csv->eof){
+            return 0;
+        }
+        if (!__dstr_csv_fill(csv))
+            return -1;
+    }
+}
+
+/* Copy n bytes of a quoted field to out, undoubling quotes. Returns the
+   length written.   */
+static size_t __dstr_csv_unescape(char *out, const char *src, size_t n)
+{
+    const char *end = src + n, *q;
+    char *start = out;
+
+    while ((q = memchr(src, '"', end - src))){
+        memcpy(out, src, q - src + 1);
+        out += q - src + 1;
+        src = q + 2;
+    }
+    memcpy(out, src, end - src);
+    return out + (end - src) - start;
+}
+
+int dstr_csv_next_row(dstr_csv *csv, dstr_vector *row)
+{
+    const struct dstr_csv_span *span;
+    dstr *str;
+    size_t i;
+    int rc = __dstr_csv_row(csv);
+
+    if (rc != 1)
+        return rc;
+    for (i = 0; i < csv->fields; i++){
+        span = csv->spans + i;
+        if (i < row->sz && __atomic_load_n(&row->arr[i]->ref,
+                                           __ATOMIC_RELAXED) == 1){
+            str = row->arr[i];
+            __dstr_set_sz(str, 0);
+        } else {
+            str = dstr_new();
+            if (!str)
+                return -1;
+            if (i < row->sz){
+                dstr_decref(row->arr[i]);
+                row->arr[i] = str;
+            } else if (!dstr_vector_push_back_decref(row, str)){
+                dstr_decref(str);
+                return -1;
+            }
+        }
+        if (!__dstr_can_hold(str, span->sz) &&
+            !__dstr_alloc(str, span->sz + 1))
+            return -1;
+        if (span->escaped)
+            __dstr_set_sz(str, __dstr_csv_unescape(str->data,
+                                                   csv->buf + span->off,
+                                                   span->sz));
+        else {
+            memcpy(str->data, csv->buf + span->off, span->sz);
+            __dstr_set_sz(str, span->sz);
+        }
+        str->data[str->sz] = '\0';
+    }
+    while (row->sz > csv->fields)
+        dstr_vector_pop_back(row);
+    return 1;
+}
+
+int dstr_csv_next_row_views(dstr_csv *csv, const dstr_csv_field **fields,
+                            size_t *n)
+{
+    const struct dstr_csv_span *span;
+    size_t i, escaped = 0;
+    int rc = __dstr_csv_row(csv);
+
+    if (rc != 1)
+        return rc;
+    /* Views are sized with the spans so they are never short.   */
+    if (!csv->views || csv->views_mem < csv->spans_mem){
+        dstr_free(csv->views);
+        csv->views = dstr_malloc(csv->spans_mem * sizeof(dstr_csv_field));
+        csv->views_mem = csv->views ? csv->spans_mem : 0;
+        if (!csv->views)
+            return -1;
+    }
+    for (i = 0; i < csv->fields; i++)
+        if (csv->spans[i].escaped)
+            escaped += csv->spans[i].sz;
+    /* Reserve scratch once so views into it stay valid.   */
+    __dstr_set_sz(csv->scratch, 0);
+    if (escaped && !__dstr_can_hold(csv->scratch, escaped) &&
+        !__dstr_alloc(csv->scratch, escaped + 1))
+        return -1;
+    for (i = 0; i < csv->fields; i++){
+        span = csv->spans + i;
+        if (span->escaped){
+            csv->views[i].data = csv->scratch->data + csv->scratch->sz;
+            csv->views[i].sz = __dstr_csv_unescape(
+                csv->scratch->data + csv->scratch->sz,
+                csv->buf + span->off, span->sz);
+            __dstr_set_sz(csv->scratch, csv->scratch->sz + csv->views[i].sz);
+        } else {
+            csv->views[i].data = csv->buf + span->off;
+            csv->views[i].sz = span->sz;
+        }
+    }
+    *fields = csv->views;
+    *n = csv->fields;
     return 1;
 }
@@ -23,6 +23,7 @@
 #ifndef _DSTR_H
 #define _DSTR_H 1
 #include <stdlib.h>
+#include <stdint.h>
 #define DSTR_MAJOR_VERSION 1
 #define DSTR_MINOR_VERSION 0
 #define DSTR_VERSION "1.0"
@@ -38,6 +39,7 @@ typedef struct dstr{
     size_t sz; /* Current size of string. */
     size_t mem; /* Current memory allocated. */
     unsigned int ref; /* Reference count. */
+    unsigned int flags; /* Internal state, e.g. cached UTF-8 validity. */
 } dstr;
 
 typedef struct dstr_link{
@@ -67,7 +69,18 @@ dstr *dstr_version();
 /* Compile time define options:
    DSTR_MEM_EXPAND_RATE: defines how many times to multiply memory
    allocations to avoid allocation thrasing. Default is 2.
-   DSTR_MEM_CLEAR: zero all memory being released to hold char arrays. */
+   DSTR_MEM_CLEAR: zero all memory being released to hold char arrays.
+   DSTR_ATOMIC_REF: make dstr_incref and dstr_decref atomic, for strings
+   referenced from several threads (e.g. interned strings).
+   DSTR_THREAD_CACHE: keep a per thread cache of free'd string headers and
+   buffers up to 64KB, reused by following allocations in the same thread.
+   DSTR_THREAD_CACHE_BYTES: default byte budget per thread cache. Default
+   is 256KB.
+   DSTR_INLINE_API: inline trivial accessors and appends that fit, see
+   INLINE API below. */
+#ifndef DSTR_THREAD_CACHE_BYTES
+  #define DSTR_THREAD_CACHE_BYTES 262144
+#endif
 #ifndef DSTR_MEM_EXPAND_RATE
   #define DSTR_MEM_EXPAND_RATE 3 /* How much to grow per allocation. */
 #endif
@@ -81,6 +94,27 @@ dstr *dstr_with_initial(const char *initial);
 dstr *dstr_with_initialn(const char *initial, size_t n);
 /* Create a new dynamic string object with pre allocated space.   */
 dstr *dstr_with_prealloc(size_t sz);
+/* Create a new dynamic string object taking ownership of buf, which must
+   be allocated with dstr_malloc, hold len bytes of content and be cap bytes
+   large, with cap > len for the sentinel. Nothing is copied. On failure 0 is
+   returned and buf still belongs to the caller. With DSTR_THREAD_CACHE a
+   cap of at most 64KB that is not a power of two of at least 16 is not
+   zero-copy: buf is reallocated to the cache size class.   */
+dstr *dstr_adopt(char *buf, size_t len, size_t cap);
+
+/* Flag bit of strings known to be well formed UTF-8.   */
+#define DSTR_UTF8_VALID 0x1u
+/* Flag bit and reference count of immortal strings, see DSTR_LITERAL.   */
+#define DSTR_IMMORTAL 0x80000000u
+#define DSTR_IMMORTAL_REF 0x40000000u
+/* Static initializer of an immortal string holding string literal s, e.g.
+       static dstr sep = DSTR_LITERAL(", ");
+   The length is computed at compile time and nothing is allocated.
+   dstr_incref and dstr_decref have no effect on immortal strings and
+   functions changing them fail, or do nothing, without touching the data.
+   Do not declare them const, cached UTF-8 validity is kept in flags.   */
+#define DSTR_LITERAL(s) \
+    { (char *)("" s), sizeof("" s) - 1, 0, DSTR_IMMORTAL_REF, DSTR_IMMORTAL }
 
 /* Returns internal pointer to C string from given dynamic string. When the
    dynamic string is changed the data of the pointer is
@@ -91,17 +125,35 @@ const char *dstr_to_cstr_const(const dstr* str);
 /* Copy dynamic string to C string. You must free the returned pointer with free
    when no longer in use.   */
 char *dstr_copy_to_cstr(const dstr* str);
+/* Hand the nul terminated buffer of the string over to the caller, who must
+   free it with dstr_free, and free the string object itself. If len is not 0
+   it is set to the length of the string. Nothing is copied. Fails with 0,
+   leaving the string as is, unless the caller holds the only reference.  */
+char *dstr_release(dstr *str, size_t *len);
 /* Creates a copy of a dynamic string object, with one reference.   */
 dstr *dstr_copy(const dstr *copy);
 /* Returns char at given index.   */
 char dstr_at(const dstr* str, size_t i);
 
+/* Set byte budget of each thread cache. Applies to memory cached from now
+   on. Has no effect unless compiled with DSTR_THREAD_CACHE.   */
+void dstr_thread_cache_budget(size_t bytes);
+/* Free memory held by the thread cache of the calling thread. Caches are
+   also flushed when threads exit.   */
+void dstr_thread_cache_flush();
+
 /* Decreases reference to the dynamic string.
    If no more references exists, the string is free'd.   */
 void dstr_decref(dstr *str);
 /* Increases reference to the string by one.   */
-#define dstr_incref(str) \
-    (str->ref++)
+#ifdef DSTR_ATOMIC_REF
+  #define dstr_incref(str) \
+    ((__atomic_load_n(&(str)->flags, __ATOMIC_RELAXED) & DSTR_IMMORTAL) ? \
+     (str)->ref : __atomic_add_fetch(&(str)->ref, 1, __ATOMIC_RELAXED))
+#else
+  #define dstr_incref(str) \
+    (((str)->flags & DSTR_IMMORTAL) ? (str)->ref : (str)->ref++)
+#endif
 
 /* Return current string length (not including sentinel).   */
 size_t dstr_length(const dstr* str);
@@ -129,7 +181,8 @@ int dstr_prepend_cstr(dstr* dest, const char *src);
 int dstr_prepend_cstrn(dstr* dest, const char *src, size_t n);
 /* Swap contents of string with another string.   */
 int dstr_swap(dstr *dest, const dstr *src);
-/* Erases a part of the string content, shortening the length of the string.  */
+/* Erases characters [first, last) of the string content, shortening the
+   length of the string. Returns 0 if the range is empty or out of bounds.  */
 int dstr_erase(dstr *str, size_t first, size_t last);
 /* Insert dynamic string into given position.   */
 int dstr_insert(dstr *dest, const dstr *src, size_t pos);
@@ -137,8 +190,52 @@ int dstr_insert(dstr *dest, const dstr *src, size_t pos);
 int dstr_insert_cstr(dstr *dest, const char *src, size_t pos);
 /* Insert C string into given position up to n characters.   */
 int dstr_insert_cstrn(dstr *dest, const char *src, size_t pos, size_t n);
+/* Replace every occurrence of needle with replacement in a single pass,
+   scanning left to right without rescanning replaced text. The result is
+   sized exactly with at most one reallocation, and built in place when
+   the replacement is not longer than the needle. needle must not be
+   empty.   */
+int dstr_replace_all(dstr *str, const char *needle, const char *replacement);
+/* Like dstr_replace_all for k pairs given as {needle, replacement, ...}.
+   At each position the earliest starting needle is replaced, on ties the
+   pair listed first.   */
+int dstr_replace_all_pairs(dstr *str, const char *const *pairs, size_t k);
+/* Remove leading and trailing whitespace (space, \t, \n, \v, \f, \r).
+   Data is shifted at most once.   */
+int dstr_trim(dstr *str);
+/* Remove leading whitespace.   */
+int dstr_ltrim(dstr *str);
+/* Remove trailing whitespace.   */
+int dstr_rtrim(dstr *str);
+/* Remove leading and trailing bytes found in the C string chars.   */
+int dstr_trim_chars(dstr *str, const char *chars);
+/* Remove leading bytes found in chars.   */
+int dstr_ltrim_chars(dstr *str, const char *chars);
+/* Remove trailing bytes found in chars.   */
+int dstr_rtrim_chars(dstr *str, const char *chars);
+/* Trim whitespace from a view of n bytes, e.g. a tokenizer or CSV field,
+   by moving data forward and shortening n. Nothing is copied.   */
+void dstr_trim_view(const char **data, size_t *n);
 /* Append string printf style.   */
 int dstr_sprintf(dstr *str, const char *fmt, ...);
+/* Append a signed integer in decimal.   */
+int dstr_append_i64(dstr *str, int64_t value);
+/* Append a unsigned integer in decimal.   */
+int dstr_append_u64(dstr *str, uint64_t value);
+/* Append a unsigned integer in lower-case hexadecimal, without prefix.   */
+int dstr_append_u64_hex(dstr *str, uint64_t value);
+/* Append a double with the shortest representation that reads back to the
+   same value. Scientific notation is used for very large and very small
+   magnitudes. Infinity and NaN are appended as inf, -inf and nan.   */
+int dstr_append_double(dstr *str, double value);
+
+/* Parse the complete string as a signed decimal integer, with an optional
+   leading sign. Returns 0 if the string is not a number or the value does
+   not fit in 64 bits.   */
+int dstr_to_i64(const dstr *str, int64_t *value);
+/* Parse the complete string as a double. Returns 0 if the string is not a
+   number or the value is out of range.   */
+int dstr_to_double(const dstr *str, double *value);
 
 /* Make complete string upper-case.   */
 void dstr_to_upper(dstr *str);
@@ -194,6 +291,62 @@ dstr_list *dstr_split_to_list(const dstr *str, const char *sep);
 int dstr_print(const dstr *src);
 
 
+/*                          UTF-8 PUBLIC API                                */
+/* Codepoint aware operations on UTF-8 encoded strings. Validation uses AVX2
+   when the CPU supports it, and the result is cached in the string until it
+   is modified through the dstr API.
+
+   Compile time define options:
+   DSTR_NO_SIMD: use only portable scalar code.   */
+
+/* Check if string is well formed UTF-8. Overlong encodings, surrogates and
+   codepoints above U+10FFFF are rejected.   */
+int dstr_utf8_valid(const dstr *str);
+/* Check if n bytes at src are well formed UTF-8.   */
+int dstr_utf8_valid_cstrn(const char *src, size_t n);
+/* Number of codepoints in string. For invalid UTF-8 every byte that is not a
+   continuation byte counts as one.   */
+size_t dstr_utf8_length(const dstr *str);
+/* Create a new string of n codepoints starting at codepoint first. The
+   result is cut short at the end of the string.   */
+dstr *dstr_utf8_substr(const dstr *str, size_t first, size_t n);
+/* Shorten string to at most n codepoints.   */
+int dstr_utf8_truncate(dstr *str, size_t n);
+/* Shorten string to at most n bytes without splitting a codepoint.   */
+int dstr_utf8_truncate_bytes(dstr *str, size_t n);
+
+/*                         ENCODING PUBLIC API                              */
+/* Binary to text encodings. Encoders append src to dest, decoders append
+   decoded bytes to dest and leave dest unchanged on malformed input. Output
+   is sized once up front, and AVX2 is used when the CPU supports it (see
+   DSTR_NO_SIMD).   */
+
+/* Append n bytes as base64 (RFC 4648) with padding.   */
+int dstr_append_base64(dstr *dest, const void *src, size_t n);
+/* Decode n characters of base64. Padding is optional, whitespace and
+   other characters outside the alphabet are rejected.   */
+int dstr_decode_base64(dstr *dest, const char *src, size_t n);
+/* Append n bytes as lower-case hexadecimal, two characters per byte.   */
+int dstr_append_hex(dstr *dest, const void *src, size_t n);
+/* Decode n hexadecimal characters, either case. n must be even.   */
+int dstr_decode_hex(dstr *dest, const char *src, size_t n);
+
+/*                         ESCAPING PUBLIC API                              */
+/* Escapers scan for the next byte that needs escaping (with AVX2 when the
+   CPU supports it) and copy the clean runs in between in bulk. All append
+   to dest; dstr_url_decode leaves dest unchanged on malformed input.   */
+
+/* Append n bytes escaped for use inside a JSON string literal. Quote,
+   backslash and control characters are escaped, other bytes (including
+   UTF-8 sequences) are copied as is. No surrounding quotes are added.   */
+int dstr_append_json_escaped(dstr *dest, const char *src, size_t n);
+/* Append n bytes percent-encoded (RFC 3986). Only unreserved characters,
+   ALPHA DIGIT - . _ ~, are left unencoded.   */
+int dstr_append_url_encoded(dstr *dest, const char *src, size_t n);
+/* Decode n percent-encoded characters. '+' is not treated as a space.
+   A '%' not followed by two hexadecimal digits is rejected.   */
+int dstr_url_decode(dstr *dest, const char *src, size_t n);
+
 /*                     DYNAMIC STRING LIST PUBLIC API                       */
 /* Note: The choice between linked lists and vector depends on your need to
    access random elements in the collection. If you are going to operate on your
@@ -236,8 +389,17 @@ void dstr_list_traverse_delete (dstr_list * list, int (*callback)(dstr *));
     for (link = list->head; link; link = link->next)
 
 /* Concat a string list a dynamic string. Seperator to seperate each list
-   element is optional, use 0 if not wanted.   */
+   element is optional, use 0 if not wanted. The result is allocated once with
+   the exact size needed.   */
 dstr *dstr_list_to_dstr(const char *sep, dstr_list *list);
+/* Same as dstr_list_to_dstr, but the result is wrapped in prefix and suffix.
+   All of prefix, sep and suffix are optional, use 0 if not wanted.   */
+dstr *dstr_list_to_dstr_wrap(const char *prefix, const char *sep,
+                             const char *suffix, const dstr_list *list);
+/* Write all list elements to file descriptor with writev, without
+   concatenating them first. Seperator is optional, use 0 if not wanted.
+   Partial writes are retried until everything is written.   */
+int dstr_list_writev(int fd, const dstr_list *list, const char *sep);
 
 /* Returns a new list of strings found in input list that contains
    sub C string.   */
@@ -316,6 +478,19 @@ int dstr_vector_is_empty(const dstr_vector *vec);
 /* Get the size of vector.  */
 size_t dstr_vector_size(const dstr_vector *vec);
 
+/* Concat all vector elements to a new dynamic string. Seperator is optional,
+   use 0 if not wanted. The result is allocated once with the exact size
+   needed.   */
+dstr *dstr_vector_join(const char *sep, const dstr_vector *vec);
+/* Same as dstr_vector_join, but the result is wrapped in prefix and suffix.
+   All of prefix, sep and suffix are optional, use 0 if not wanted.   */
+dstr *dstr_vector_join_wrap(const char *prefix, const char *sep,
+                            const char *suffix, const dstr_vector *vec);
+/* Write all vector elements to file descriptor with writev, without
+   concatenating them first. Seperator is optional, use 0 if not wanted.
+   Partial writes are retried until everything is written.   */
+int dstr_vector_writev(int fd, const dstr_vector *vec, const char *sep);
+
 /* Decrement reference count by one. When no more references exists the
    vector is emptied (and strings decrefed) and free'd.   */
 void dstr_vector_decref(dstr_vector *vec);
@@ -323,6 +498,585 @@ void dstr_vector_decref(dstr_vector *vec);
 #define dstr_vector_incref(vec) \
     (vec->ref++)
 
+/*                    DYNAMIC STRING QUEUE PUBLIC API                       */
+/* Lock-free multi producer, single consumer queue for handing strings over
+   to another thread (Vyukov's non-intrusive MPSC queue). Any number of
+   threads may push concurrently, but only one thread may pop or drain.
+
+   Reference counts are not atomic, so a string must only be referenced by
+   the pushing thread when pushed. Pushing steals that reference and popping
+   hands it over to the consumer. There is therefore no referencing push.   */
+
+typedef struct dstr_queue_node{
+    struct dstr_queue_node *next;
+    dstr *str;
+} dstr_queue_node;
+
+typedef struct dstr_queue{
+    dstr_queue_node *head; /* Producer end. */
+    char pad[64 - sizeof(dstr_queue_node *)]; /* Keep ends on separate cache lines. */
+    dstr_queue_node *tail; /* Consumer end, always a consumed node. */
+} dstr_queue;
+
+/* Create a new empty queue.   */
+dstr_queue *dstr_queue_new();
+/* Push string to queue and steal its reference. Safe to call from any
+   number of threads.   */
+int dstr_queue_push_decref(dstr_queue *queue, dstr *str);
+/* Pop oldest string from queue. The reference pushed is handed over to the
+   caller. Returns 0 if the queue is empty. Consumer thread only.   */
+dstr *dstr_queue_pop(dstr_queue *queue);
+/* Move up to max strings, or all if max is 0, from queue to back of vector,
+   handing references over to the vector. Returns number of strings moved.
+   Consumer thread only.   */
+size_t dstr_queue_drain(dstr_queue *queue, dstr_vector *vec, size_t max);
+/* Free queue, decref'ing strings still queued. No other thread may use the
+   queue concurrently.   */
+void dstr_queue_free(dstr_queue *queue);
+
+/*                       PARALLEL VECTOR PUBLIC API                         */
+/* Vector operations split across a pool of threads. The vector is divided
+   into chunks of DSTR_PARALLEL_CHUNK elements. Each thread, including the
+   calling one, starts on its own share of chunks and steals chunks from the
+   others when done. Vectors of a single chunk are processed in the calling
+   thread.
+
+   Callbacks run concurrently and must not modify strings shared between
+   elements, nor call the parallel functions again. The vector must not be
+   modified while a parallel operation runs on it.
+
+   All functions take a pool argument. Use 0 for a default pool with one
+   thread per online CPU, created on first use.
+
+   Compile time define options:
+   DSTR_PARALLEL_CHUNK: elements per chunk. Default is 4096, which keeps the
+   element pointers of a chunk within a typical L1 cache.   */
+#ifndef DSTR_PARALLEL_CHUNK
+    #define DSTR_PARALLEL_CHUNK 4096
+#endif
+
+typedef struct dstr_pool dstr_pool;
+
+/* Create a pool running jobs on n threads, including the calling thread.
+   If n is 0 the number of online CPUs is used.   */
+dstr_pool *dstr_pool_new(unsigned int n);
+/* Stop all threads and free pool.   */
+void dstr_pool_free(dstr_pool *pool);
+
+/* Call callback for each string in vector. First argument is the string,
+   second is user data if applicable. The order of calls is undefined.   */
+void dstr_vector_parallel_for(dstr_pool *pool, dstr_vector *vec,
+                              void (*callback)(dstr *, void *),
+                              void *user_data);
+/* Returns a new vector of strings for which callback returns 1, in the same
+   order as in the input vector. One reference is added to each string.   */
+dstr_vector *dstr_vector_parallel_filter(dstr_pool *pool,
+                                         const dstr_vector *vec,
+                                         int (*callback)(const dstr *, void *),
+                                         void *user_data);
+/* Returns a new vector of strings in input vector that contains sub C string,
+   in the same order as in the input vector.   */
+dstr_vector *dstr_vector_parallel_search_contains(dstr_pool *pool,
+                                                  const dstr_vector *vec,
+                                                  const char *substr);
+
+/*                     STRING INTERN TABLE PUBLIC API                       */
+/* Concurrent table of canonical strings keyed by content. The table is split
+   into hash sharded segments, each with its own lock, so threads interning
+   different strings rarely contend.
+
+   The table holds one reference to each canonical string. Canonical strings
+   returned to different threads share reference counts, so the library and
+   its users must be compiled with DSTR_ATOMIC_REF when they are decref'ed
+   from several threads.
+
+   Compile time define options:
+   DSTR_INTERN_SHARDS: default number of shards. Default is 64.   */
+#ifndef DSTR_INTERN_SHARDS
+    #define DSTR_INTERN_SHARDS 64
+#endif
+
+typedef struct dstr_intern dstr_intern;
+
+/* Create a new intern table. Shards is rounded up to a power of two, use 0
+   for DSTR_INTERN_SHARDS.   */
+dstr_intern *dstr_intern_new(unsigned int shards);
+/* Return canonical string with same content as str, with one reference
+   added. If none exists, str itself becomes the canonical string.   */
+dstr *dstr_intern_insert(dstr_intern *table, dstr *str);
+/* Return canonical string for C string, with one reference added. If none
+   exists, a new string is created.   */
+dstr *dstr_intern_insert_cstr(dstr_intern *table, const char *src);
+/* Return canonical string for C string up until n characters.   */
+dstr *dstr_intern_insert_cstrn(dstr_intern *table, const char *src, size_t n);
+/* Get number of canonical strings in table.   */
+size_t dstr_intern_size(dstr_intern *table);
+/* Free table and decref all canonical strings. No other thread may use the
+   table concurrently.   */
+void dstr_intern_free(dstr_intern *table);
+
+/*                     READ-COPY-UPDATE PUBLIC API                          */
+/* Epoch based deferred reclamation for strings and vectors that are read by
+   many threads without locks and replaced by writers. Readers wrap access in
+   dstr_rcu_read_lock and dstr_rcu_read_unlock, which only touch a per thread
+   record. Writers publish a new object into a shared pointer, and the
+   replaced object is decref'ed once every reader has left the read section
+   it may have been seen in (a grace period). Deferred decrefs are done in
+   batches of DSTR_RCU_BATCH objects.
+
+   Readers must not keep objects beyond the read section, unless they take
+   a reference with the library compiled with DSTR_ATOMIC_REF.
+
+   E.g:
+       dstr_vector *routes;                 (shared)
+
+       dstr_rcu_read_lock();                (reader)
+       vec = dstr_rcu_dereference(routes);
+       ...
+       dstr_rcu_read_unlock();
+
+       dstr_rcu_publish_vector(&routes, new_routes);   (writer)
+
+   Compile time define options:
+   DSTR_RCU_BATCH: deferred decrefs to collect before trying to reclaim
+   them. Default is 64.   */
+#ifndef DSTR_RCU_BATCH
+    #define DSTR_RCU_BATCH 64
+#endif
+
+/* Enter a read section. Read sections may be nested.   */
+void dstr_rcu_read_lock();
+/* Leave a read section.   */
+void dstr_rcu_read_unlock();
+/* Load a published pointer inside a read section.   */
+#define dstr_rcu_dereference(ptr) \
+    (__atomic_load_n(&(ptr), __ATOMIC_ACQUIRE))
+
+/* Publish string to slot, stealing its reference. The string previously
+   published, if any, is decref'ed after a grace period.   */
+int dstr_rcu_publish(dstr **slot, dstr *str);
+/* Publish vector to slot, stealing its reference. The vector previously
+   published, if any, is decref'ed after a grace period.   */
+int dstr_rcu_publish_vector(dstr_vector **slot, dstr_vector *vec);
+/* Decref string after a grace period.   */
+void dstr_rcu_defer_decref(dstr *str);
+/* Decref vector after a grace period.   */
+void dstr_rcu_defer_vector_decref(dstr_vector *vec);
+/* Wait until all deferred decrefs so far have been done. Must not be called
+   from inside a read section.   */
+void dstr_rcu_synchronize();
+
+/*                   DYNAMIC STRING BUILDER PUBLIC API                      */
+/* A builder records pieces to be concatenated without copying them. The
+   result is produced once, either as a exactly sized dynamic string or by
+   writing the pieces directly to a file descriptor.
+
+   Compile time define options:
+   DSTR_BUILDER_CHUNK_SIZE: pieces stored per allocated chunk. Default is
+   64.   */
+#ifndef DSTR_BUILDER_CHUNK_SIZE
+    #define DSTR_BUILDER_CHUNK_SIZE 64
+#endif
+
+typedef struct dstr_builder{
+    struct dstr_builder_chunk *head;
+    struct dstr_builder_chunk *tail;
+    size_t sz; /* Total length of all pieces. */
+    unsigned int ref;
+} dstr_builder;
+
+/* Create a new empty builder.   */
+dstr_builder *dstr_builder_new();
+
+/* Add a borrowed C string. The memory is not copied and must stay valid and
+   unchanged until the builder is cleared or free'd.   */
+int dstr_builder_add_cstr(dstr_builder *builder, const char *src);
+/* Add a borrowed C string up until n characters.   */
+int dstr_builder_add_cstrn(dstr_builder *builder, const char *src, size_t n);
+/* Add a dynamic string. One reference is added to the string, which is
+   removed when the builder is cleared or free'd. The string must not be
+   modified while held by the builder.   */
+int dstr_builder_add(dstr_builder *builder, dstr *str);
+/* Add a dynamic string and steal its reference.   */
+int dstr_builder_add_decref(dstr_builder *builder, dstr *str);
+
+/* Get total length of all pieces added.   */
+size_t dstr_builder_length(const dstr_builder *builder);
+/* Concat all pieces into a new dynamic string, allocated once with the exact
+   size needed.   */
+dstr *dstr_builder_to_dstr(const dstr_builder *builder);
+/* Write all pieces to file descriptor with writev. Partial writes are retried
+   until everything is written.   */
+int dstr_builder_writev(int fd, const dstr_builder *builder);
+
+/* Remove all pieces so the builder can be reused. Strings held are
+   decref'ed.   */
+void dstr_builder_clear(dstr_builder *builder);
+/* Decrement one reference from builder. When no more references exists the
+   builder is cleared and free'd.   */
+void dstr_builder_decref(dstr_builder *builder);
+/* Add one reference to the builder.   */
+#define dstr_builder_incref(builder) \
+    (builder->ref++)
+
+/*                    DYNAMIC STRING READER PUBLIC API                      */
+/* Buffered line reader over a file descriptor. The reader does not own the
+   file descriptor, closing it is left to the caller.
+
+   Compile time define options:
+   DSTR_READER_BUFSIZE: size of the internal read buffer. Default is 64KB. */
+#ifndef DSTR_READER_BUFSIZE
+    #define DSTR_READER_BUFSIZE 65536
+#endif
+
+typedef struct dstr_reader{
+    int fd;
+    char *buf; /* Read buffer. */
+    size_t pos; /* Offset of first unconsumed byte in buffer. */
+    size_t sz; /* Bytes currently held in buffer. */
+    size_t mem; /* Size of buffer. */
+    int eof;
+} dstr_reader;
+
+/* Create a new reader over file descriptor with the default buffer size.   */
+dstr_reader *dstr_reader_new(int fd);
+/* Create a new reader over file descriptor with a buffer of sz bytes.   */
+dstr_reader *dstr_reader_with_bufsize(int fd, size_t sz);
+/* Free the reader. The file descriptor is not closed.   */
+void dstr_reader_free(dstr_reader *reader);
+
+/* Read next line into out, replacing its contents. The newline is not
+   included. Memory already allocated by out is reused. Returns 1 if a line
+   was read, 0 on end of file and -1 on read or allocation errors.   */
+int dstr_getline(dstr_reader *reader, dstr *out);
+/* Read everything from file descriptor until end of file into a new dynamic
+   string. Regular files are read into a single allocation sized from
+   fstat.   */
+dstr *dstr_read_all(int fd);
+
+/*                   DYNAMIC STRING TOKENIZER PUBLIC API                    */
+/* Splits text on any byte of a delimiter set in a single pass. The set is
+   compiled once into a 256 bit class table. With AVX2 (see DSTR_NO_SIMD)
+   32 bytes are classified at a time by two nibble shuffles.   */
+
+/* Adjacent, leading and trailing delimiters yield no empty tokens. Without
+   it n delimiters always separate n + 1 tokens, like dstr_split_to_vector.  */
+#define DSTR_TOKENIZER_COLLAPSE 0x1
+
+typedef struct dstr_tokenizer{
+    unsigned char set[32]; /* Bit per byte value, set for delimiters. */
+    unsigned char lo[16]; /* By low nibble, bit per high nibble 0-7. */
+    unsigned char hi[16]; /* By low nibble, bit per high nibble 8-15. */
+    int flags;
+    const char *text; /* Text being tokenized, not owned. */
+    size_t sz;
+    size_t pos; /* Offset of next token. */
+    size_t block; /* Offset of the 32 byte block classified in mask. */
+    unsigned int mask; /* Bit per delimiter in block. */
+    int done;
+} dstr_tokenizer;
+
+/* Create a tokenizer splitting on any of the bytes in delims.   */
+dstr_tokenizer *dstr_tokenizer_new(const char *delims, int flags);
+/* Create a tokenizer splitting on any of n bytes, nul included.   */
+dstr_tokenizer *dstr_tokenizer_with_delimsn(const char *delims, size_t n,
+                                            int flags);
+/* Free the tokenizer.   */
+void dstr_tokenizer_free(dstr_tokenizer *tok);
+
+/* Start tokenizing n bytes of text. The text is not copied and must stay
+   valid and unchanged while tokens are read.   */
+void dstr_tokenizer_reset(dstr_tokenizer *tok, const char *text, size_t n);
+/* Get next token as a view into the text, not nul terminated. Returns 1 if
+   a token was found, 0 when there are no more tokens.   */
+int dstr_tokenizer_next_view(dstr_tokenizer *tok, const char **token,
+                             size_t *n);
+/* Get next token as a new dynamic string. Returns 0 when there are no more
+   tokens or on allocation failure.   */
+dstr *dstr_tokenizer_next(dstr_tokenizer *tok);
+/* Tokenize a dynamic string into a new vector of new dynamic strings.   */
+dstr_vector *dstr_tokenizer_split(dstr_tokenizer *tok, const dstr *str);
+
+/*                     DYNAMIC STRING CSV PUBLIC API                        */
+/* Streaming RFC 4180 parser for CSV, TSV or any single byte delimiter.
+   Quoted fields may hold delimiters, line breaks and doubled quotes. Rows
+   end with LF, CRLF or CR. A quote inside an unquoted field is taken
+   literally. With AVX2 (see DSTR_NO_SIMD) delimiters, quotes and line ends
+   are located 32 bytes at a time.
+
+   Compile time define options:
+   DSTR_CSV_BUFSIZE: initial read buffer when parsing from a file
+   descriptor, grown when a row does not fit. Default is 64KB.   */
+#ifndef DSTR_CSV_BUFSIZE
+    #define DSTR_CSV_BUFSIZE 65536
+#endif
+
+typedef struct dstr_csv_field{
+    const char *data; /* Not nul terminated. */
+    size_t sz;
+} dstr_csv_field;
+
+typedef struct dstr_csv{
+    int fd;
+    char delim;
+    int source; /* Read buffer, mapped file or borrowed memory. */
+    char *buf;
+    size_t pos; /* Offset of next row in buffer. */
+    size_t sz; /* Bytes held in buffer. */
+    size_t mem; /* Size of buffer. */
+    int eof;
+    size_t block; /* Offset of the 32 byte block classified. */
+    unsigned int special; /* Bit per delimiter, quote or line end. */
+    unsigned int quote; /* Bit per quote. */
+    struct dstr_csv_span *spans; /* Fields of current row. */
+    size_t fields;
+    size_t spans_mem;
+    dstr_csv_field *views;
+    size_t views_mem;
+    dstr *scratch; /* Unquoted copies of fields with doubled quotes. */
+    size_t rows; /* Rows read so far. */
+} dstr_csv;
+
+/* Create a parser reading from file descriptor, which is not closed by
+   the parser.   */
+dstr_csv *dstr_csv_new(int fd, char delim);
+/* Create a parser over a regular file mapped into memory. Returns 0 if
+   the file can not be mapped, e.g. a pipe, then use dstr_csv_new.   */
+dstr_csv *dstr_csv_mmap(int fd, char delim);
+/* Create a parser over n bytes of memory, which is not copied and must
+   stay valid while rows are read.   */
+dstr_csv *dstr_csv_with_buffer(const char *data, size_t n, char delim);
+/* Free the parser, unmapping the file if mapped.   */
+void dstr_csv_free(dstr_csv *csv);
+
+/* Read next row into row, one dynamic string per field. Strings in row
+   referenced only by row are reused, others are replaced. Returns 1 if a
+   row was read, 0 at end of input and -1 on malformed input, read or
+   allocation errors.   */
+int dstr_csv_next_row(dstr_csv *csv, dstr_vector *row);
+/* Read next row as n field views without copying. Views are valid until
+   the next call. Returns like dstr_csv_next_row.   */
+int dstr_csv_next_row_views(dstr_csv *csv, const dstr_csv_field **fields,
+                            size_t *n);
+
+/*                              TRACE PROBES                                */
+/* Optional USDT static tracepoints for profiling with bpftrace, perf or
+   SystemTap without a debug build. Probes cost a single nop when no tracer
+   is attached.
+
+   Compile time define options:
+   DSTR_PROBES: emit probes, needs sys/sdt.h (systemtap-sdt-dev on
+   debian/ubuntu). Disabled by default, when disabled probes compile to
+   nothing.
+
+   Provider is dstr, probes and their arguments are:
+   string__new(dstr *str, size_t mem)
+   string__grow(dstr *str, size_t old_mem, size_t new_mem)
+   string__free(dstr *str, size_t sz, size_t mem)
+   vector__grow(dstr_vector *vec, size_t old_space, size_t new_space)
+   split__vector(size_t sz, const char *sep)
+   split__list(size_t sz, const char *sep)
+   search__contains(size_t sz, const char *needle)
+   search__replace(size_t sz, size_t pairs)
+   list__search(const char *substr)
+   vector__search(size_t elements, const char *substr)
+
+   E.g. to see which call sites grow strings the most:
+   bpftrace -e 'usdt:./libdstr.so:dstr:string__grow
+       { @[ustack] = sum(arg2 - arg1); }'   */
+
+/*                        STATISTICS PUBLIC API                             */
+/* Optional process wide allocation statistics, kept with relaxed atomic
+   counters. Useful to see how much memory strings hold versus use, e.g. when
+   tuning DSTR_MEM_EXPAND_RATE.
+
+   Compile time define options:
+   DSTR_STATS: enable statistics. Disabled by default, when disabled no
+   counters are updated and dstr_stats_snapshot returns 0.   */
+#define DSTR_STATS_BUCKETS 32
+
+typedef struct dstr_stats{
+    size_t strings; /* Live strings. */
+    size_t lists; /* Live lists. */
+    size_t list_links; /* Live list links. */
+    size_t vectors; /* Live vectors. */
+    size_t bytes_allocated; /* Bytes held by live string buffers. */
+    size_t bytes_used; /* Bytes of live string contents, excluding nul. */
+    size_t vector_bytes; /* Bytes held by live vector arrays. */
+    size_t reallocs; /* String buffer reallocations. */
+    size_t vector_reallocs; /* Vector array reallocations. */
+    /* String buffer allocations by size, bucket i counts sizes from 2^i up
+       to 2^(i + 1) - 1. Last bucket holds all larger sizes.   */
+    size_t size_histogram[DSTR_STATS_BUCKETS];
+} dstr_stats;
+
+/* Copy current statistics to stats. Counters are read one at a time, so
+   figures may be slightly skewed while other threads are working. Returns
+   0 and zeroes stats if the library is built without DSTR_STATS.   */
+int dstr_stats_snapshot(dstr_stats *stats);
+
+/*                     ALLOCATION PROFILER PUBLIC API                       */
+/* Optional sampling profiler of live strings, list links and vectors. On
+   average one allocation every DSTR_PROFILE_RATE bytes is sampled together
+   with its backtrace, and tracked until free'd. Sizes are recorded at
+   allocation time, later growth of a string is not accounted for. Link with
+   -rdynamic to get function names in text dumps. Taking a sample costs a
+   few microseconds, mostly unwinding, which at the default rate averages
+   to well under a nanosecond per KB allocated.
+
+   Compile time define options:
+   DSTR_PROFILE: enable profiler. Disabled by default, when disabled
+   nothing is sampled and dstr_profile_dump returns 0.
+   DSTR_PROFILE_RATE: default average bytes between samples. Default is
+   512KB.   */
+#ifndef DSTR_PROFILE_RATE
+    #define DSTR_PROFILE_RATE 524288
+#endif
+
+/* Dump formats, text is grouped by allocation site and symbolized. Pprof
+   is the gperftools heap profile format, readable by pprof together with
+   the binary.   */
+#define DSTR_PROFILE_TEXT 0
+#define DSTR_PROFILE_PPROF 1
+
+/* Set average bytes allocated between samples. 0 stops sampling, objects
+   already sampled are still tracked. 1 samples every allocation. Takes
+   effect at once for the calling thread, other threads pick it up after
+   their next sample.   */
+void dstr_profile_rate(size_t bytes);
+/* Write profile of live sampled objects to file descriptor in format
+   DSTR_PROFILE_TEXT or DSTR_PROFILE_PPROF.   */
+int dstr_profile_dump(int fd, int format);
+
+/*                              INLINE API                                  */
+/* With DSTR_INLINE_API defined, the accessors below and the path of
+   dstr_append, dstr_append_cstr and dstr_append_cstrn that needs no
+   allocation are expanded inline, instead of being called through the PLT
+   of the shared library. Functions are still exported by the library, and
+   their address can be taken as usual. Define the same DSTR_STATS and
+   DSTR_MEM_SECURITY options as the library was built with. Appends are
+   never inlined with DSTR_STATS, as the counters are kept by the library. */
+#ifdef DSTR_INLINE_API
+#include <string.h>
+
+static __inline__ const char *__dstr_inline_to_cstr_const(const dstr *str)
+{
+    return str->data;
+}
+
+static __inline__ char __dstr_inline_at(const dstr *str, size_t i)
+{
+    return str->data[i];
+}
+
+static __inline__ size_t __dstr_inline_length(const dstr *str)
+{
+    return str->sz;
+}
+
+static __inline__ size_t __dstr_inline_capacity(const dstr *str)
+{
+    return str->mem;
+}
+
+static __inline__ int __dstr_inline_empty(const dstr *str)
+{
+    return str->sz == 0;
+}
+
+static __inline__ dstr *__dstr_inline_vector_back(dstr_vector *vec)
+{
+#ifdef DSTR_MEM_SECURITY
+    if (!vec->sz)
+        return 0;
+#endif
+    return vec->arr[vec->sz - 1];
+}
+
+static __inline__ dstr *__dstr_inline_vector_front(dstr_vector *vec)
+{
+#ifdef DSTR_MEM_SECURITY
+    if (!vec->sz)
+        return 0;
+#endif
+    return vec->arr[DSTR_VECTOR_BEGIN];
+}
+
+static __inline__ dstr *__dstr_inline_vector_at(dstr_vector *vec, size_t pos)
+{
+#ifdef DSTR_MEM_SECURITY
+    if (!vec->sz || vec->sz < pos)
+        return 0;
+#endif
+    return vec->arr[pos];
+}
+
+static __inline__ int __dstr_inline_vector_is_empty(const dstr_vector *vec)
+{
+    return !vec->sz;
+}
+
+static __inline__ size_t __dstr_inline_vector_size(const dstr_vector *vec)
+{
+    return vec->sz;
+}
+
+#define dstr_to_cstr_const(str) __dstr_inline_to_cstr_const(str)
+#define dstr_at(str, i) __dstr_inline_at(str, i)
+#define dstr_length(str) __dstr_inline_length(str)
+#define dstr_capacity(str) __dstr_inline_capacity(str)
+#define dstr_empty(str) __dstr_inline_empty(str)
+#define dstr_vector_back(vec) __dstr_inline_vector_back(vec)
+#define dstr_vector_front(vec) __dstr_inline_vector_front(vec)
+#define dstr_vector_at(vec, pos) __dstr_inline_vector_at(vec, pos)
+#define dstr_vector_is_empty(vec) __dstr_inline_vector_is_empty(vec)
+#define dstr_vector_size(vec) __dstr_inline_vector_size(vec)
+
+#ifndef DSTR_STATS
+/* Strings without room, including immortal ones which have no memory,
+   take the library path.   */
+static __inline__ int __dstr_inline_append_cstrn(dstr *dest, const char *src,
+                                             size_t n)
+{
+    size_t total = dest->sz + n;
+
+    if (!dest->data || total + 1 >= dest->mem)
+        return (dstr_append_cstrn)(dest, src, n);
+    memcpy(dest->data + dest->sz, src, n);
+    dest->data[total] = '\0';
+    dest->sz = total;
+    dest->flags &= ~DSTR_UTF8_VALID;
+    return 1;
+}
+
+/* Growing goes through the out of line dstr_append, which reads src->data
+   after the reallocation and so handles dstr_append(s, s).   */
+static __inline__ int __dstr_inline_append(dstr *dest, const dstr *src)
+{
+    size_t total = dest->sz + src->sz;
+
+    if (!dest->data || total + 1 >= dest->mem)
+        return (dstr_append)(dest, src);
+    memcpy(dest->data + dest->sz, src->data, src->sz);
+    dest->data[total] = '\0';
+    dest->sz = total;
+    dest->flags &= ~DSTR_UTF8_VALID;
+    return 1;
+}
+
+static __inline__ int __dstr_inline_append_cstr(dstr *dest, const char *src)
+{
+    return __dstr_inline_append_cstrn(dest, src, strlen(src));
+}
+
+#define dstr_append(dest, src) __dstr_inline_append(dest, src)
+#define dstr_append_cstr(dest, src) __dstr_inline_append_cstr(dest, src)
+#define dstr_append_cstrn(dest, src, n) \
+    __dstr_inline_append_cstrn(dest, src, n)
+#endif /* DSTR_STATS */
+
+#endif /* DSTR_INLINE_API */
+
 #ifdef DSTR_MEM_CLEAR
 void dstr_safe_memset(void *ptr, int c, size_t sz);
 void *dstr_safe_realloc(void *ptr, size_t new_sz, size_t old_sz);
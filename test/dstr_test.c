@@ -23,6 +23,9 @@
 #include <string.h>
 #include <time.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <locale.h>
 #include <CUnit/CUnit.h>
 #include "CUnit/Basic.h"
 #include "dstr.h"
@@ -97,6 +100,98 @@ void test_incref()
     dstr_decref(str);
 }
 
+void test_dstr_adopt_release()
+{
+    char *buf = dstr_malloc(32), *out;
+    dstr *str, *other;
+    size_t len = 0;
+
+    memcpy(buf, "payload", 7);
+    CU_ASSERT_PTR_NULL(dstr_adopt(buf, 32, 32));
+    str = dstr_adopt(buf, 7, 32);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(str);
+    CU_ASSERT_PTR_EQUAL(dstr_to_cstr_const(str), buf);
+    CU_ASSERT_EQUAL(dstr_length(str), 7);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "payload");
+    CU_ASSERT(dstr_append_cstr(str, " and more than fits in the buffer"));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str),
+                           "payload and more than fits in the buffer");
+
+    /* Only the sole owner may take the buffer.   */
+    dstr_incref(str);
+    CU_ASSERT_PTR_NULL(dstr_release(str, &len));
+    dstr_decref(str);
+    out = dstr_release(str, &len);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(out);
+    CU_ASSERT_EQUAL(len, 40);
+    CU_ASSERT_STRING_EQUAL(out, "payload and more than fits in the buffer");
+    dstr_free(out);
+
+    /* Released buffer of an unallocated string is still a C string.   */
+    other = dstr_new();
+    out = dstr_release(other, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(out);
+    CU_ASSERT_STRING_EQUAL(out, "");
+    dstr_free(out);
+
+    /* Round trip.   */
+    other = dstr_with_initial("round trip");
+    out = dstr_release(other, &len);
+    str = dstr_adopt(out, len, len + 1);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(str);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "round trip");
+    dstr_decref(str);
+}
+
+void test_dstr_literal()
+{
+    static dstr lit = DSTR_LITERAL("Content-Type");
+    static dstr empty = DSTR_LITERAL("");
+    dstr *str = &lit, *copy;
+    dstr_vector *vec = dstr_vector_new();
+
+    CU_ASSERT_EQUAL(dstr_length(str), 12);
+    CU_ASSERT_EQUAL(dstr_length(&empty), 0);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "Content-Type");
+    CU_ASSERT(dstr_starts_with(str, "Content"));
+    CU_ASSERT(dstr_utf8_valid(str));
+
+    /* Reference counting never frees it.   */
+    dstr_incref(str);
+    dstr_decref(str);
+    dstr_decref(str);
+    dstr_decref(str);
+    CU_ASSERT_EQUAL(str->ref, DSTR_IMMORTAL_REF);
+    dstr_vector_push_back(vec, str);
+    dstr_vector_push_back(vec, str);
+    dstr_vector_decref(vec);
+
+    /* Changes are rejected and leave it untouched.   */
+    CU_ASSERT_FALSE(dstr_append_cstr(str, "x"));
+    CU_ASSERT_FALSE(dstr_prepend_cstr(str, "x"));
+    CU_ASSERT_FALSE(dstr_insert_cstr(str, "x", 1));
+    CU_ASSERT_FALSE(dstr_sprintf(str, "%d", 1));
+    CU_ASSERT_FALSE(dstr_erase(str, 0, 1));
+    CU_ASSERT_FALSE(dstr_resize(str, 1));
+    CU_ASSERT_FALSE(dstr_reserve(str, 64));
+    CU_ASSERT_FALSE(dstr_replace_all(str, "Type", "T"));
+    CU_ASSERT_FALSE(dstr_trim_chars(str, "Ce"));
+    CU_ASSERT_FALSE(dstr_swap(str, str));
+    CU_ASSERT_FALSE(dstr_utf8_truncate_bytes(str, 4));
+    dstr_to_upper(str);
+    dstr_clear(str);
+    CU_ASSERT_EQUAL(dstr_length(str), 12);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "Content-Type");
+
+    /* Copies are ordinary strings.   */
+    copy = dstr_copy(str);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(copy);
+    CU_ASSERT(dstr_append_cstr(copy, ": text/plain"));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(copy),
+                           "Content-Type: text/plain");
+    dstr_decref(copy);
+}
+
 void test_dstr_copy_to_cstr()
 {
     dstr *str = dstr_with_initial("something here");
@@ -149,6 +244,50 @@ void test_dstr_append_cstr()
     dstr_decref(str);
 }
 
+void test_dstr_append_fits()
+{
+    static dstr sep = DSTR_LITERAL(", ");
+    dstr *str = dstr_with_prealloc(64);
+    dstr *part = dstr_with_initial("part");
+
+    CU_ASSERT(dstr_append_cstrn(str, "valid", 5));
+    CU_ASSERT(dstr_utf8_valid(str));
+    /* Appends within capacity must still drop cached UTF-8 validity.   */
+    CU_ASSERT(dstr_append_cstrn(str, "\xFF", 1));
+    CU_ASSERT_FALSE(dstr_utf8_valid(str));
+    CU_ASSERT_EQUAL(dstr_capacity(str), 64);
+    CU_ASSERT(dstr_append(str, &sep));
+    CU_ASSERT(dstr_append(str, part));
+    CU_ASSERT(dstr_append_cstr(str, ""));
+    CU_ASSERT_EQUAL(dstr_length(str), 12);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "valid\xFF, part");
+    /* Up to the last byte that fits, then growing.   */
+    CU_ASSERT(dstr_append_cstrn(str, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx", 50));
+    CU_ASSERT_EQUAL(dstr_capacity(str), 64);
+    CU_ASSERT(dstr_append_cstr(str, "y"));
+    CU_ASSERT(dstr_capacity(str) > 64);
+    CU_ASSERT_EQUAL(dstr_length(str), 63);
+    CU_ASSERT_EQUAL(dstr_at(str, 62), 'y');
+    CU_ASSERT_FALSE(dstr_append(&sep, part));
+    dstr_decref(part);
+    dstr_decref(str);
+}
+
+void test_dstr_append_self()
+{
+    dstr *str = dstr_with_initial("abcdefgh");
+    size_t i;
+
+    /* Every other append outgrows the buffer the source lives in.   */
+    for (i = 0; i < 6; i++)
+        CU_ASSERT_FATAL(dstr_append(str, str));
+    CU_ASSERT_EQUAL(dstr_length(str), 8 * 64);
+    for (i = 0; i < 8 * 64; i += 8)
+        CU_ASSERT_EQUAL(memcmp(dstr_to_cstr_const(str) + i, "abcdefgh", 8), 0);
+    CU_ASSERT_EQUAL(dstr_to_cstr_const(str)[8 * 64], '\0');
+    dstr_decref(str);
+}
+
 void test_dstr_swap()
 {
     dstr *str = dstr_with_initial("replace me");
@@ -163,17 +302,96 @@ void test_dstr_swap()
 void test_dstr_erase()
 {
     dstr *str = dstr_with_initial("delete me");
-    dstr_erase(str, 0, 6);
+    CU_ASSERT(dstr_erase(str, 0, 6));
     CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), " me");
     CU_ASSERT_EQUAL(dstr_length(str), 3);
+    CU_ASSERT(!dstr_erase(str, 1, 1));
+    CU_ASSERT(!dstr_erase(str, 2, 4));
+    CU_ASSERT_EQUAL(dstr_length(str), 3);
     dstr_decref(str);
 }
 
 void test_dstr_insert()
 {
     dstr *str = dstr_with_initial("insert || <- here");
-    dstr_insert_cstr(str, "something", 8);
+    CU_ASSERT(dstr_insert_cstr(str, "something", 8));
     CU_ASSERT_STRING_EQUAL("insert |something| <- here", dstr_to_cstr_const(str));
+    CU_ASSERT_EQUAL(dstr_length(str), 26);
+    CU_ASSERT(dstr_insert_cstr(str, ">", 0));
+    CU_ASSERT_STRING_EQUAL(">insert |something| <- here", dstr_to_cstr_const(str));
+    dstr_decref(str);
+}
+
+void test_dstr_replace_all()
+{
+    static const char *pairs[] = {"&", "&amp;", "<", "&lt;", ">", "&gt;"};
+    static const char *shrink[] = {"aa", "b", "a", ""};
+    dstr *str = dstr_with_initial("one two one three one");
+
+    CU_ASSERT(dstr_replace_all(str, "one", "1"));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "1 two 1 three 1");
+    CU_ASSERT(dstr_replace_all(str, "1", "eleven"));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "eleven two eleven three eleven");
+    CU_ASSERT_EQUAL(dstr_length(str), 30);
+    CU_ASSERT(dstr_replace_all(str, "missing", "x"));
+    CU_ASSERT(dstr_replace_all(str, "eleven", "eleven"));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "eleven two eleven three eleven");
+    CU_ASSERT(!dstr_replace_all(str, "", "x"));
+    /* Replaced text is not scanned again.   */
+    dstr_clear(str);
+    dstr_append_cstr(str, "aaa");
+    CU_ASSERT(dstr_replace_all(str, "a", "aa"));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "aaaaaa");
+
+    dstr_clear(str);
+    dstr_append_cstr(str, "<a href=\"x&y\">b</a> and a long tail past one vector block");
+    CU_ASSERT(dstr_replace_all_pairs(str, pairs, 3));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str),
+                           "&lt;a href=\"x&amp;y\"&gt;b&lt;/a&gt; and a long tail past one vector block");
+    dstr_clear(str);
+    dstr_append_cstr(str, "aaaaa");
+    CU_ASSERT(dstr_replace_all_pairs(str, shrink, 2));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "bb");
+    dstr_decref(str);
+}
+
+void test_dstr_trim()
+{
+    dstr *str = dstr_with_initial(" \t\r\n trim me \v\f ");
+    const char *view = "   a view\n";
+    size_t n = strlen(view);
+
+    CU_ASSERT(dstr_rtrim(str));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), " \t\r\n trim me");
+    CU_ASSERT(dstr_ltrim(str));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "trim me");
+    CU_ASSERT_EQUAL(dstr_length(str), 7);
+    CU_ASSERT(dstr_trim(str));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "trim me");
+
+    /* Padding longer than a vector block on both sides.   */
+    dstr_clear(str);
+    dstr_append_cstr(str, "                                        x y"
+                          "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t");
+    CU_ASSERT(dstr_trim(str));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "x y");
+    dstr_clear(str);
+    dstr_append_cstr(str, " \n ");
+    CU_ASSERT(dstr_trim(str));
+    CU_ASSERT_EQUAL(dstr_length(str), 0);
+
+    dstr_clear(str);
+    dstr_append_cstr(str, "--==value==--");
+    CU_ASSERT(dstr_ltrim_chars(str, "-"));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "==value==--");
+    CU_ASSERT(dstr_rtrim_chars(str, "-"));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "==value==");
+    CU_ASSERT(dstr_trim_chars(str, "=\xE9"));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "value");
+
+    dstr_trim_view(&view, &n);
+    CU_ASSERT_EQUAL(n, 6);
+    CU_ASSERT(strncmp(view, "a view", n) == 0);
     dstr_decref(str);
 }
 
@@ -185,6 +403,146 @@ void test_dstr_sprintf()
     dstr_decref(str);
 }
 
+void test_dstr_sprintf_grow()
+{
+    dstr *str = dstr_new();
+    CU_ASSERT(dstr_sprintf(str, "%s-%d", "grown from empty", 42));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "grown from empty-42");
+    CU_ASSERT(dstr_sprintf(str, "%s", " and again"));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "grown from empty-42 and again");
+    CU_ASSERT_EQUAL(dstr_length(str), 29);
+    dstr_decref(str);
+}
+
+void test_dstr_append_i64()
+{
+    dstr *str = dstr_new();
+    dstr_append_i64(str, 0);
+    dstr_append_cstr(str, " ");
+    dstr_append_i64(str, -1234567890123LL);
+    dstr_append_cstr(str, " ");
+    dstr_append_i64(str, INT64_MIN);
+    dstr_append_cstr(str, " ");
+    dstr_append_u64(str, UINT64_MAX);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str),
+        "0 -1234567890123 -9223372036854775808 18446744073709551615");
+    dstr_decref(str);
+}
+
+void test_dstr_append_u64_hex()
+{
+    dstr *str = dstr_with_initial("0x");
+    dstr_append_u64_hex(str, 0xdeadbeef);
+    dstr_append_cstr(str, " ");
+    dstr_append_u64_hex(str, 0);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "0xdeadbeef 0");
+    dstr_decref(str);
+}
+
+void test_dstr_append_double()
+{
+    dstr *str = dstr_new();
+    dstr_append_double(str, 0.1);
+    dstr_append_cstr(str, " ");
+    dstr_append_double(str, -2.5);
+    dstr_append_cstr(str, " ");
+    dstr_append_double(str, 100);
+    dstr_append_cstr(str, " ");
+    dstr_append_double(str, 1e-7);
+    dstr_append_cstr(str, " ");
+    dstr_append_double(str, 1.7976931348623157e308);
+    dstr_append_cstr(str, " ");
+    dstr_append_double(str, 0.000123);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str),
+        "0.1 -2.5 100 1e-7 1.7976931348623157e+308 0.000123");
+    dstr_decref(str);
+}
+
+void test_dstr_to_i64()
+{
+    dstr *str = dstr_with_initial("-9223372036854775808");
+    int64_t value = 0;
+
+    CU_ASSERT(dstr_to_i64(str, &value));
+    CU_ASSERT(value == INT64_MIN);
+    dstr_decref(str);
+
+    str = dstr_with_initial("9223372036854775808");
+    CU_ASSERT(!dstr_to_i64(str, &value));
+    dstr_decref(str);
+
+    str = dstr_with_initial("+42");
+    CU_ASSERT(dstr_to_i64(str, &value));
+    CU_ASSERT_EQUAL(value, 42);
+    dstr_decref(str);
+
+    str = dstr_with_initial("42x");
+    CU_ASSERT(!dstr_to_i64(str, &value));
+    dstr_decref(str);
+}
+
+void test_dstr_to_double()
+{
+    dstr *str = dstr_with_initial("-12.375");
+    double value = 0;
+
+    CU_ASSERT(dstr_to_double(str, &value));
+    CU_ASSERT(value == -12.375);
+    dstr_decref(str);
+
+    str = dstr_with_initial("0.1");
+    CU_ASSERT(dstr_to_double(str, &value));
+    CU_ASSERT(value == 0.1);
+    dstr_decref(str);
+
+    str = dstr_with_initial("2.2250738585072014e-308");
+    CU_ASSERT(dstr_to_double(str, &value));
+    CU_ASSERT(value == 2.2250738585072014e-308);
+    dstr_decref(str);
+
+    str = dstr_with_initial("1e400");
+    CU_ASSERT(!dstr_to_double(str, &value));
+    dstr_decref(str);
+
+    str = dstr_with_initial("1.5 ");
+    CU_ASSERT(!dstr_to_double(str, &value));
+    dstr_decref(str);
+}
+
+/* 17 significant digits take the strtod path, which must not follow
+   LC_NUMERIC. Checked in a comma decimal locale when one is installed.  */
+void test_dstr_to_double_locale()
+{
+    static const char *locales[] = {
+        "de_DE.UTF-8", "de_DE.utf8", "fr_FR.UTF-8", "fr_FR.utf8", "de_DE", "fr_FR"
+    };
+    const double in = 0.30000000000000004;
+    dstr *str = dstr_new();
+    char *saved = setlocale(LC_NUMERIC, 0);
+    double out = 0;
+    size_t i;
+
+    saved = saved ? strdup(saved) : 0;
+    for (i = 0; i < sizeof(locales) / sizeof(locales[0]); i++){
+        if (setlocale(LC_NUMERIC, locales[i]))
+            break;
+    }
+    CU_ASSERT_FATAL(dstr_append_double(str, in));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "0.30000000000000004");
+    CU_ASSERT(dstr_to_double(str, &out));
+    CU_ASSERT(memcmp(&in, &out, sizeof(in)) == 0);
+    dstr_resize(str, 0);
+    dstr_append_cstr(str, "-1.2345678901234567e-89");
+    CU_ASSERT(dstr_to_double(str, &out));
+    CU_ASSERT(out == -1.2345678901234567e-89);
+    dstr_resize(str, 0);
+    dstr_append_cstr(str, "0,30000000000000004");
+    CU_ASSERT(!dstr_to_double(str, &out));
+    setlocale(LC_NUMERIC, saved ? saved : "C");
+    free(saved);
+    dstr_decref(str);
+}
+
 void test_dstr_to_upper()
 {
     dstr *str = dstr_with_initial("test me!");
@@ -375,6 +733,764 @@ void test_dstr_split_to_list()
     dstr_list_decref(list);
 }
 
+void test_dstr_thread_cache()
+{
+    dstr *str = dstr_with_prealloc(100);
+    dstr *header = str;
+    const char *buf = str->data;
+
+    dstr_decref(str);
+    /* Same size class as the buffer just free'd.   */
+    str = dstr_with_prealloc(120);
+    CU_ASSERT_PTR_EQUAL(str, header);
+    CU_ASSERT_PTR_EQUAL(dstr_to_cstr_const(str), buf);
+    CU_ASSERT_EQUAL(dstr_capacity(str), 120);
+    dstr_append_cstr(str, "fits in the cached buffer");
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "fits in the cached buffer");
+    dstr_decref(str);
+
+    dstr_thread_cache_flush();
+    dstr_thread_cache_budget(0);
+    str = dstr_with_prealloc(100);
+    dstr_decref(str);
+    dstr_thread_cache_budget(DSTR_THREAD_CACHE_BYTES);
+}
+
+static pthread_key_t thread_cache_exit_key;
+static int thread_cache_exit_rounds;
+
+/* Runs again in a later destructor round, after the thread cache has been
+   released, and frees strings then.   */
+static void __thread_cache_exit_destructor(void *arg)
+{
+    dstr *str = arg;
+
+    if (!thread_cache_exit_rounds++){
+        pthread_setspecific(thread_cache_exit_key, str);
+        return;
+    }
+    dstr_decref(str);
+    str = dstr_with_initial("allocated while exiting");
+    dstr_decref(str);
+}
+
+static void *__thread_cache_exit(void *arg)
+{
+    dstr *str = dstr_with_prealloc(100);
+
+    /* Fill the cache of this thread.   */
+    dstr_decref(dstr_with_prealloc(100));
+    pthread_setspecific(thread_cache_exit_key, str);
+    return 0;
+}
+
+void test_dstr_thread_cache_exit()
+{
+    pthread_t thread;
+
+    thread_cache_exit_rounds = 0;
+    pthread_key_create(&thread_cache_exit_key, __thread_cache_exit_destructor);
+    pthread_create(&thread, 0, __thread_cache_exit, 0);
+    pthread_join(thread, 0);
+    CU_ASSERT_EQUAL(thread_cache_exit_rounds, 2);
+    pthread_key_delete(thread_cache_exit_key);
+}
+
+void test_dstr_stats()
+{
+    dstr_stats before, after;
+    dstr_list *list;
+    dstr_vector *vec;
+    dstr *str;
+
+    if (!dstr_stats_snapshot(&before)){
+        /* Built without DSTR_STATS.   */
+        CU_ASSERT_EQUAL(before.strings, 0);
+        CU_ASSERT_EQUAL(before.bytes_allocated, 0);
+        return;
+    }
+    str = dstr_with_initial("stats");
+    dstr_append_cstr(str, " grow the buffer");
+    list = dstr_list_new();
+    dstr_list_add(list, str);
+    vec = dstr_vector_new();
+    dstr_vector_push_back(vec, str);
+    dstr_stats_snapshot(&after);
+
+    CU_ASSERT_EQUAL(after.strings, before.strings + 1);
+    CU_ASSERT_EQUAL(after.lists, before.lists + 1);
+    CU_ASSERT_EQUAL(after.list_links, before.list_links + 1);
+    CU_ASSERT_EQUAL(after.vectors, before.vectors + 1);
+    CU_ASSERT_EQUAL(after.bytes_used, before.bytes_used + dstr_length(str));
+    CU_ASSERT_EQUAL(after.bytes_allocated,
+                    before.bytes_allocated + dstr_capacity(str));
+    CU_ASSERT_EQUAL(after.reallocs, before.reallocs + 1);
+    CU_ASSERT(after.vector_bytes > before.vector_bytes);
+
+    dstr_list_decref(list);
+    dstr_vector_decref(vec);
+    dstr_decref(str);
+    dstr_stats_snapshot(&after);
+    CU_ASSERT_EQUAL(after.strings, before.strings);
+    CU_ASSERT_EQUAL(after.lists, before.lists);
+    CU_ASSERT_EQUAL(after.list_links, before.list_links);
+    CU_ASSERT_EQUAL(after.vectors, before.vectors);
+    CU_ASSERT_EQUAL(after.bytes_used, before.bytes_used);
+    CU_ASSERT_EQUAL(after.bytes_allocated, before.bytes_allocated);
+    CU_ASSERT_EQUAL(after.vector_bytes, before.vector_bytes);
+}
+
+#ifdef DSTR_PROFILE
+void test_dstr_profile()
+{
+    dstr *str, *profile;
+    dstr_vector *vec;
+    FILE *fp = tmpfile();
+    int i;
+
+    dstr_profile_rate(1);
+    vec = dstr_vector_new();
+    for (i = 0; i < 10; i++)
+        dstr_vector_push_back_decref(vec, dstr_with_initial("sampled"));
+    str = dstr_new();
+    dstr_profile_rate(DSTR_PROFILE_RATE);
+
+    CU_ASSERT(dstr_profile_dump(fileno(fp), DSTR_PROFILE_TEXT));
+    lseek(fileno(fp), 0, SEEK_SET);
+    profile = dstr_read_all(fileno(fp));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(profile);
+    CU_ASSERT(dstr_starts_with(profile, "dstr heap profile:"));
+    CU_ASSERT(dstr_contains(profile, "10 string objects"));
+    CU_ASSERT(dstr_contains(profile, "1 string objects"));
+    CU_ASSERT(dstr_contains(profile, "1 vector objects"));
+    dstr_decref(profile);
+
+    dstr_vector_decref(vec);
+    dstr_decref(str);
+    CU_ASSERT_EQUAL(ftruncate(fileno(fp), 0), 0);
+    lseek(fileno(fp), 0, SEEK_SET);
+    CU_ASSERT(dstr_profile_dump(fileno(fp), DSTR_PROFILE_PPROF));
+    lseek(fileno(fp), 0, SEEK_SET);
+    profile = dstr_read_all(fileno(fp));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(profile);
+    CU_ASSERT(dstr_starts_with(profile, "heap profile: 0: 0 [0: 0] @ heap_v2/"));
+    CU_ASSERT(dstr_contains(profile, "MAPPED_LIBRARIES:"));
+    dstr_decref(profile);
+    fclose(fp);
+}
+#endif
+
+void test_dstr_utf8()
+{
+    dstr *str = dstr_with_initial("Gr\xC3\xBC\xC3\x9F" "e, \xE4\xB8\x96\xE7\x95\x8C "
+                                  "\xF0\x9F\x98\x80 and some ascii to pass 32 bytes");
+    dstr *sub;
+
+    CU_ASSERT(dstr_utf8_valid(str));
+    CU_ASSERT_EQUAL(dstr_utf8_length(str), dstr_length(str) - 9);
+    /* Cached flag is dropped when the string changes.   */
+    CU_ASSERT(dstr_utf8_valid(str));
+    dstr_append_cstr(str, "\xE4\xB8");
+    CU_ASSERT(!dstr_utf8_valid(str));
+    dstr_utf8_truncate_bytes(str, dstr_length(str) - 1);
+    CU_ASSERT(dstr_utf8_valid(str));
+
+    sub = dstr_utf8_substr(str, 7, 3);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(sub), "\xE4\xB8\x96\xE7\x95\x8C ");
+    dstr_decref(sub);
+    sub = dstr_utf8_substr(str, 1000, 3);
+    CU_ASSERT_EQUAL(dstr_length(sub), 0);
+    dstr_decref(sub);
+
+    dstr_utf8_truncate(str, 11);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str),
+                           "Gr\xC3\xBC\xC3\x9F" "e, \xE4\xB8\x96\xE7\x95\x8C \xF0\x9F\x98\x80");
+    dstr_utf8_truncate_bytes(str, 16);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str),
+                           "Gr\xC3\xBC\xC3\x9F" "e, \xE4\xB8\x96\xE7\x95\x8C ");
+    dstr_decref(str);
+
+    CU_ASSERT(dstr_utf8_valid_cstrn("", 0));
+    CU_ASSERT(!dstr_utf8_valid_cstrn("\xC0\x80", 2)); /* Overlong. */
+    CU_ASSERT(!dstr_utf8_valid_cstrn("\xED\xA0\x80", 3)); /* Surrogate. */
+    CU_ASSERT(!dstr_utf8_valid_cstrn("\xF4\x90\x80\x80", 4)); /* > U+10FFFF. */
+    CU_ASSERT(!dstr_utf8_valid_cstrn("0123456789012345678901234567890\xE4\xB8", 33));
+    CU_ASSERT(!dstr_utf8_valid_cstrn("01234567890123456789012345678901\x80"
+                                     "23456789012345678901234567890123", 65));
+}
+
+void test_dstr_base64()
+{
+    static const char *plain[] = {"", "f", "fo", "foo", "foob", "fooba", "foobar"};
+    static const char *coded[] = {"", "Zg==", "Zm8=", "Zm9v", "Zm9vYg==",
+                                  "Zm9vYmE=", "Zm9vYmFy"};
+    unsigned char bytes[300];
+    dstr *str = dstr_new();
+    dstr *back = dstr_new();
+    size_t i;
+
+    for (i = 0; i < sizeof(plain) / sizeof(plain[0]); i++){
+        dstr_clear(str);
+        dstr_clear(back);
+        CU_ASSERT(dstr_append_base64(str, plain[i], strlen(plain[i])));
+        CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), coded[i]);
+        CU_ASSERT(dstr_decode_base64(back, coded[i], strlen(coded[i])));
+        CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(back), plain[i]);
+    }
+    /* Long enough for the vector paths, every byte value.   */
+    for (i = 0; i < sizeof(bytes); i++)
+        bytes[i] = (unsigned char)(i * 7);
+    for (i = 0; i < sizeof(bytes); i += 37){
+        dstr_clear(str);
+        dstr_clear(back);
+        CU_ASSERT(dstr_append_base64(str, bytes, i));
+        CU_ASSERT_EQUAL(dstr_length(str), (i + 2) / 3 * 4);
+        CU_ASSERT(dstr_decode_base64(back, dstr_to_cstr_const(str), dstr_length(str)));
+        CU_ASSERT_EQUAL(dstr_length(back), i);
+        CU_ASSERT(memcmp(dstr_to_cstr_const(back), bytes, i) == 0);
+    }
+    /* Padding is optional, malformed input leaves dest alone.   */
+    dstr_clear(back);
+    dstr_append_cstr(back, "keep");
+    CU_ASSERT(dstr_decode_base64(back, "Zm9vYg", 6));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(back), "keepfoob");
+    CU_ASSERT(!dstr_decode_base64(back, "Zm9vY", 5));
+    CU_ASSERT(!dstr_decode_base64(back, "Zm9v*mFy", 8));
+    CU_ASSERT(!dstr_decode_base64(back, "Zm9vYmFyZm9vYmFyZm9vYmFyZm9vYmF!Zm9v", 36));
+    CU_ASSERT(!dstr_decode_base64(back, "Zg==Zm9v", 8));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(back), "keepfoob");
+    dstr_decref(str);
+    dstr_decref(back);
+}
+
+void test_dstr_hex()
+{
+    unsigned char bytes[100];
+    dstr *str = dstr_new();
+    dstr *back = dstr_new();
+    size_t i;
+
+    CU_ASSERT(dstr_append_hex(str, "\x00\x7f\xff", 3));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "007fff");
+    CU_ASSERT(dstr_decode_hex(back, "007FfF", 6));
+    CU_ASSERT_EQUAL(dstr_length(back), 3);
+    CU_ASSERT(memcmp(dstr_to_cstr_const(back), "\x00\x7f\xff", 3) == 0);
+
+    for (i = 0; i < sizeof(bytes); i++)
+        bytes[i] = (unsigned char)(i * 13);
+    dstr_clear(str);
+    dstr_clear(back);
+    CU_ASSERT(dstr_append_hex(str, bytes, sizeof(bytes)));
+    CU_ASSERT_EQUAL(dstr_length(str), 2 * sizeof(bytes));
+    CU_ASSERT(dstr_decode_hex(back, dstr_to_cstr_const(str), dstr_length(str)));
+    CU_ASSERT_EQUAL(dstr_length(back), sizeof(bytes));
+    CU_ASSERT(memcmp(dstr_to_cstr_const(back), bytes, sizeof(bytes)) == 0);
+
+    dstr_clear(back);
+    CU_ASSERT(!dstr_decode_hex(back, "abc", 3));
+    CU_ASSERT(!dstr_decode_hex(back, "0123456789abcdef0123456789abcdeg", 32));
+    CU_ASSERT(!dstr_decode_hex(back, "0x", 2));
+    CU_ASSERT_EQUAL(dstr_length(back), 0);
+    dstr_decref(str);
+    dstr_decref(back);
+}
+
+void test_dstr_escape()
+{
+    dstr *str = dstr_new();
+    dstr *back = dstr_new();
+    char bytes[256];
+    size_t i;
+
+    CU_ASSERT(dstr_append_json_escaped(str, "say \"hi\"\\\n\t\x01 \xC3\xBC", 15));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str),
+                           "say \\\"hi\\\"\\\\\\n\\t\\u0001 \xC3\xBC");
+    /* Escapes past the first vector block.   */
+    dstr_clear(str);
+    CU_ASSERT(dstr_append_json_escaped(str, "0123456789012345678901234567890123456789\"x", 42));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str),
+                           "0123456789012345678901234567890123456789\\\"x");
+
+    dstr_clear(str);
+    CU_ASSERT(dstr_append_url_encoded(str, "a b/c?d=e&f~g-h.i_j", 19));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "a%20b%2Fc%3Fd%3De%26f~g-h.i_j");
+    CU_ASSERT(dstr_url_decode(back, dstr_to_cstr_const(str), dstr_length(str)));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(back), "a b/c?d=e&f~g-h.i_j");
+
+    for (i = 0; i < sizeof(bytes); i++)
+        bytes[i] = (char)i;
+    dstr_clear(str);
+    dstr_clear(back);
+    CU_ASSERT(dstr_append_url_encoded(str, bytes, sizeof(bytes)));
+    CU_ASSERT_EQUAL(dstr_length(str), 66 + 3 * (256 - 66));
+    CU_ASSERT(dstr_url_decode(back, dstr_to_cstr_const(str), dstr_length(str)));
+    CU_ASSERT_EQUAL(dstr_length(back), sizeof(bytes));
+    CU_ASSERT(memcmp(dstr_to_cstr_const(back), bytes, sizeof(bytes)) == 0);
+
+    /* Malformed input leaves dest unchanged.   */
+    dstr_clear(back);
+    CU_ASSERT(dstr_url_decode(back, "a+b%2b", 6));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(back), "a+b+");
+    CU_ASSERT(!dstr_url_decode(back, "abc%2", 5));
+    CU_ASSERT(!dstr_url_decode(back, "abc%zz", 6));
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(back), "a+b+");
+    dstr_decref(str);
+    dstr_decref(back);
+}
+
+void test_dstr_getline()
+{
+    const char *input = "first line\n\nthird line without newline";
+    dstr_reader *reader;
+    dstr *line = dstr_new();
+    int fds[2];
+
+    CU_ASSERT_FATAL(pipe(fds) == 0);
+    CU_ASSERT(write(fds[1], input, strlen(input)) == strlen(input));
+    close(fds[1]);
+
+    /* Small buffer to force lines across buffer refills.   */
+    reader = dstr_reader_with_bufsize(fds[0], 4);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(reader);
+    CU_ASSERT_EQUAL(dstr_getline(reader, line), 1);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(line), "first line");
+    CU_ASSERT_EQUAL(dstr_length(line), 10);
+    CU_ASSERT_EQUAL(dstr_getline(reader, line), 1);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(line), "");
+    CU_ASSERT_EQUAL(dstr_getline(reader, line), 1);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(line), "third line without newline");
+    CU_ASSERT_EQUAL(dstr_getline(reader, line), 0);
+
+    dstr_reader_free(reader);
+    close(fds[0]);
+    dstr_decref(line);
+}
+
+void test_dstr_read_all()
+{
+    FILE *fp = tmpfile();
+    dstr *str;
+    int i;
+
+    CU_ASSERT_PTR_NOT_NULL_FATAL(fp);
+    for (i = 0; i < 1000; i++)
+        fputs("read me ", fp);
+    fflush(fp);
+    rewind(fp);
+
+    str = dstr_read_all(fileno(fp));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(str);
+    CU_ASSERT_EQUAL(dstr_length(str), 8000);
+    CU_ASSERT(dstr_starts_with(str, "read me read me"));
+    CU_ASSERT_EQUAL(dstr_contains(str, "read me"), 1000);
+    dstr_decref(str);
+    fclose(fp);
+}
+
+void test_dstr_tokenizer()
+{
+    dstr_tokenizer *tok = dstr_tokenizer_new(" \t,;|", 0);
+    dstr_tokenizer *collapse = dstr_tokenizer_with_delimsn(" \xFF\0", 3,
+                                                           DSTR_TOKENIZER_COLLAPSE);
+    dstr *str = dstr_with_initial("a,b;;c|d\te ");
+    dstr_vector *vec;
+    const char *token;
+    dstr *next;
+    size_t n;
+
+    CU_ASSERT_PTR_NOT_NULL_FATAL(tok);
+    vec = dstr_tokenizer_split(tok, str);
+    CU_ASSERT_EQUAL(dstr_vector_size(vec), 7);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(dstr_vector_at(vec, 2)), "");
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(dstr_vector_at(vec, 5)), "e");
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(dstr_vector_at(vec, 6)), "");
+    dstr_vector_decref(vec);
+
+    dstr_tokenizer_reset(tok, "", 0);
+    CU_ASSERT(dstr_tokenizer_next_view(tok, &token, &n));
+    CU_ASSERT_EQUAL(n, 0);
+    CU_ASSERT(!dstr_tokenizer_next_view(tok, &token, &n));
+
+    /* Long runs go through the vector path, high bytes and nul included. */
+    dstr_tokenizer_reset(collapse, "   first\xFF\xFF\0token_longer_than_one_vector_block"
+                         "   \xFF third  ", 56);
+    next = dstr_tokenizer_next(collapse);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(next), "first");
+    dstr_decref(next);
+    next = dstr_tokenizer_next(collapse);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(next), "token_longer_than_one_vector_block");
+    dstr_decref(next);
+    CU_ASSERT(dstr_tokenizer_next_view(collapse, &token, &n));
+    CU_ASSERT_EQUAL(n, 5);
+    CU_ASSERT(strncmp(token, "third", 5) == 0);
+    CU_ASSERT_PTR_NULL(dstr_tokenizer_next(collapse));
+
+    dstr_tokenizer_free(tok);
+    dstr_tokenizer_free(collapse);
+    dstr_decref(str);
+}
+
+void test_dstr_csv()
+{
+    static const char text[] = "a,\"b,1\",\"say \"\"hi\"\"\"\r\n"
+                               ",\"multi\nline\",\n"
+                               "last,\"\"";
+    dstr_vector *row = dstr_vector_new();
+    const dstr_csv_field *fields;
+    dstr_csv *csv;
+    size_t n;
+
+    csv = dstr_csv_with_buffer(text, sizeof(text) - 1, ',');
+    CU_ASSERT_PTR_NOT_NULL_FATAL(csv);
+    CU_ASSERT_EQUAL(dstr_csv_next_row(csv, row), 1);
+    CU_ASSERT_EQUAL(dstr_vector_size(row), 3);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(dstr_vector_at(row, 1)), "b,1");
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(dstr_vector_at(row, 2)), "say \"hi\"");
+    CU_ASSERT_EQUAL(dstr_csv_next_row(csv, row), 1);
+    CU_ASSERT_EQUAL(dstr_vector_size(row), 3);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(dstr_vector_at(row, 0)), "");
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(dstr_vector_at(row, 1)), "multi\nline");
+    CU_ASSERT_EQUAL(dstr_csv_next_row_views(csv, &fields, &n), 1);
+    CU_ASSERT_EQUAL(n, 2);
+    CU_ASSERT(fields[0].sz == 4 && strncmp(fields[0].data, "last", 4) == 0);
+    CU_ASSERT_EQUAL(fields[1].sz, 0);
+    CU_ASSERT_EQUAL(dstr_csv_next_row(csv, row), 0);
+    CU_ASSERT_EQUAL(csv->rows, 3);
+    dstr_csv_free(csv);
+
+    csv = dstr_csv_with_buffer("\"open,x\n", 8, ',');
+    CU_ASSERT_EQUAL(dstr_csv_next_row(csv, row), -1);
+    dstr_csv_free(csv);
+    csv = dstr_csv_with_buffer("\"a\"b,c\n", 7, ',');
+    CU_ASSERT_EQUAL(dstr_csv_next_row(csv, row), -1);
+    dstr_csv_free(csv);
+    dstr_vector_decref(row);
+}
+
+void test_dstr_csv_stream()
+{
+    FILE *fp = tmpfile();
+    dstr_vector *row = dstr_vector_new();
+    const dstr_csv_field *fields;
+    dstr_csv *csv, *mapped;
+    size_t n;
+    int i, rc;
+
+    CU_ASSERT_PTR_NOT_NULL_FATAL(fp);
+    for (i = 0; i < 5000; i++)
+        fprintf(fp, "%d\t\"quoted\t\"\"%d\"\"\"\tplain field\n", i, i);
+    /* A field larger than the read buffer.   */
+    fputc('"', fp);
+    for (i = 0; i < DSTR_CSV_BUFSIZE; i++)
+        fputc('x', fp);
+    fputs("\"\tend", fp);
+    fflush(fp);
+    rewind(fp);
+
+    csv = dstr_csv_new(fileno(fp), '\t');
+    mapped = dstr_csv_mmap(fileno(fp), '\t');
+    CU_ASSERT_PTR_NOT_NULL_FATAL(csv);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(mapped);
+    for (i = 0; (rc = dstr_csv_next_row(csv, row)) == 1; i++){
+        rc = dstr_csv_next_row_views(mapped, &fields, &n);
+        CU_ASSERT_FATAL(rc == 1);
+        CU_ASSERT_EQUAL(n, dstr_vector_size(row));
+        CU_ASSERT_EQUAL(fields[1].sz, dstr_length(dstr_vector_at(row, 1)));
+        CU_ASSERT(memcmp(fields[1].data, dstr_to_cstr_const(dstr_vector_at(row, 1)),
+                         fields[1].sz) == 0);
+        if (i == 1234){
+            CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(dstr_vector_at(row, 1)),
+                                   "quoted\t\"1234\"");
+        }
+    }
+    CU_ASSERT_EQUAL(rc, 0);
+    CU_ASSERT_EQUAL(i, 5001);
+    CU_ASSERT_EQUAL(dstr_length(dstr_vector_at(row, 0)), DSTR_CSV_BUFSIZE);
+    CU_ASSERT_EQUAL(dstr_csv_next_row_views(mapped, &fields, &n), 0);
+    dstr_csv_free(csv);
+    dstr_csv_free(mapped);
+    dstr_vector_decref(row);
+    fclose(fp);
+}
+
+void test_dstr_builder()
+{
+    dstr_builder *builder = dstr_builder_new();
+    dstr *held = dstr_with_initial("held");
+    dstr *built;
+    int i;
+
+    CU_ASSERT_PTR_NOT_NULL_FATAL(builder);
+    CU_ASSERT(dstr_builder_add_cstr(builder, "<p>"));
+    CU_ASSERT(dstr_builder_add(builder, held));
+    CU_ASSERT_EQUAL(held->ref, 2);
+    CU_ASSERT(dstr_builder_add_decref(builder, dstr_with_initial(" and owned")));
+    CU_ASSERT(dstr_builder_add_cstrn(builder, "</p>trailing", 4));
+    CU_ASSERT_EQUAL(dstr_builder_length(builder), 21);
+
+    built = dstr_builder_to_dstr(builder);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(built), "<p>held and owned</p>");
+    CU_ASSERT_EQUAL(dstr_capacity(built), 22);
+    dstr_decref(built);
+
+    dstr_builder_clear(builder);
+    CU_ASSERT_EQUAL(held->ref, 1);
+    CU_ASSERT_EQUAL(dstr_builder_length(builder), 0);
+
+    /* Span several chunks.   */
+    for (i = 0; i < DSTR_BUILDER_CHUNK_SIZE * 3 + 1; i++)
+        dstr_builder_add(builder, held);
+    built = dstr_builder_to_dstr(builder);
+    CU_ASSERT_EQUAL(dstr_length(built), (DSTR_BUILDER_CHUNK_SIZE * 3 + 1) * 4);
+    CU_ASSERT_EQUAL(dstr_contains(built, "held"), DSTR_BUILDER_CHUNK_SIZE * 3 + 1);
+    dstr_decref(built);
+
+    dstr_builder_decref(builder);
+    CU_ASSERT_EQUAL(held->ref, 1);
+    dstr_decref(held);
+}
+
+void test_dstr_builder_writev()
+{
+    dstr_builder *builder = dstr_builder_new();
+    FILE *fp = tmpfile();
+    dstr *written;
+
+    CU_ASSERT_PTR_NOT_NULL_FATAL(fp);
+    dstr_builder_add_cstr(builder, "HTTP/1.1 200 OK\r\n");
+    dstr_builder_add_decref(builder, dstr_with_initial("Content-Length: 0"));
+    dstr_builder_add_cstr(builder, "\r\n\r\n");
+    CU_ASSERT(dstr_builder_writev(fileno(fp), builder));
+    rewind(fp);
+    written = dstr_read_all(fileno(fp));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(written);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(written),
+                           "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+    dstr_decref(written);
+    dstr_builder_decref(builder);
+    fclose(fp);
+}
+
+void test_dstr_queue()
+{
+    dstr_queue *queue = dstr_queue_new();
+    dstr_vector *vec = dstr_vector_new();
+    dstr *str;
+
+    CU_ASSERT_PTR_NOT_NULL_FATAL(queue);
+    CU_ASSERT_PTR_NULL(dstr_queue_pop(queue));
+    dstr_queue_push_decref(queue, dstr_with_initial("first"));
+    dstr_queue_push_decref(queue, dstr_with_initial("second"));
+    dstr_queue_push_decref(queue, dstr_with_initial("third"));
+    dstr_queue_push_decref(queue, dstr_with_initial("fourth"));
+
+    str = dstr_queue_pop(queue);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(str), "first");
+    CU_ASSERT_EQUAL(str->ref, 1);
+    dstr_decref(str);
+
+    CU_ASSERT_EQUAL(dstr_queue_drain(queue, vec, 2), 2);
+    CU_ASSERT_EQUAL(dstr_vector_size(vec), 2);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(dstr_vector_at(vec, 0)), "second");
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(dstr_vector_at(vec, 1)), "third");
+
+    /* Remaining strings are decref'ed by free.   */
+    dstr_queue_free(queue);
+    dstr_vector_decref(vec);
+}
+
+void test_dstr_intern()
+{
+    dstr_intern *table = dstr_intern_new(4);
+    dstr *str = dstr_with_initial("canonical");
+    dstr *a, *b, *c;
+    char key[32];
+    int i;
+
+    CU_ASSERT_PTR_NOT_NULL_FATAL(table);
+    a = dstr_intern_insert(table, str);
+    CU_ASSERT_PTR_EQUAL(a, str);
+    CU_ASSERT_EQUAL(str->ref, 3);
+    b = dstr_intern_insert_cstr(table, "canonical");
+    CU_ASSERT_PTR_EQUAL(b, str);
+    c = dstr_intern_insert_cstrn(table, "canonical and more", 9);
+    CU_ASSERT_PTR_EQUAL(c, str);
+    CU_ASSERT_EQUAL(str->ref, 5);
+    dstr_decref(a);
+    dstr_decref(b);
+    dstr_decref(c);
+
+    c = dstr_intern_insert_cstrn(table, "other", 5);
+    CU_ASSERT_PTR_NOT_EQUAL(c, str);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(c), "other");
+    CU_ASSERT_EQUAL(dstr_intern_size(table), 2);
+    dstr_decref(c);
+
+    /* Force shards to grow.   */
+    for (i = 0; i < 1000; i++){
+        snprintf(key, sizeof(key), "key%d", i % 500);
+        dstr_decref(dstr_intern_insert_cstr(table, key));
+    }
+    CU_ASSERT_EQUAL(dstr_intern_size(table), 502);
+
+    dstr_intern_free(table);
+    CU_ASSERT_EQUAL(str->ref, 1);
+    dstr_decref(str);
+}
+
+void test_dstr_intern_literal()
+{
+    static dstr lit = DSTR_LITERAL("Content-Length");
+    dstr_intern *table = dstr_intern_new(0);
+    dstr *a, *b;
+
+    CU_ASSERT_PTR_NOT_NULL_FATAL(table);
+    a = dstr_intern_insert(table, &lit);
+    CU_ASSERT_PTR_EQUAL(a, &lit);
+    b = dstr_intern_insert_cstr(table, "Content-Length");
+    CU_ASSERT_PTR_EQUAL(b, &lit);
+    /* Lookups leave the reference count of immortal strings alone.   */
+    CU_ASSERT_EQUAL(lit.ref, DSTR_IMMORTAL_REF);
+    dstr_decref(a);
+    dstr_decref(b);
+    dstr_intern_free(table);
+    CU_ASSERT_EQUAL(lit.ref, DSTR_IMMORTAL_REF);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(&lit), "Content-Length");
+}
+
+void test_dstr_rcu()
+{
+    dstr *config = 0, *old, *seen;
+
+    dstr_rcu_publish(&config, dstr_with_initial("version 1"));
+    old = config;
+    dstr_incref(old);
+
+    dstr_rcu_read_lock();
+    seen = dstr_rcu_dereference(config);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(seen), "version 1");
+    dstr_rcu_publish(&config, dstr_with_initial("version 2"));
+    /* Old version must survive while this reader may still use it.   */
+    CU_ASSERT_EQUAL(old->ref, 2);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(seen), "version 1");
+    dstr_rcu_read_unlock();
+
+    dstr_rcu_synchronize();
+    CU_ASSERT_EQUAL(old->ref, 1);
+    dstr_decref(old);
+
+    dstr_rcu_read_lock();
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(dstr_rcu_dereference(config)), "version 2");
+    dstr_rcu_read_unlock();
+    dstr_rcu_defer_decref(config);
+    dstr_rcu_synchronize();
+}
+
+struct rcu_stalled{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int entered;
+    int leave;
+};
+
+void *__rcu_stalled_reader(void *arg)
+{
+    struct rcu_stalled *stalled = arg;
+
+    dstr_rcu_read_lock();
+    pthread_mutex_lock(&stalled->lock);
+    stalled->entered = 1;
+    pthread_cond_broadcast(&stalled->cond);
+    while (!stalled->leave)
+        pthread_cond_wait(&stalled->cond, &stalled->lock);
+    pthread_mutex_unlock(&stalled->lock);
+    dstr_rcu_read_unlock();
+    return 0;
+}
+
+void test_dstr_rcu_stalled_reader()
+{
+    struct rcu_stalled stalled;
+    dstr *strs[5000];
+    pthread_t thread;
+    int i, alive = 0;
+
+    pthread_mutex_init(&stalled.lock, 0);
+    pthread_cond_init(&stalled.cond, 0);
+    stalled.entered = 0;
+    stalled.leave = 0;
+    pthread_create(&thread, 0, __rcu_stalled_reader, &stalled);
+    pthread_mutex_lock(&stalled.lock);
+    while (!stalled.entered)
+        pthread_cond_wait(&stalled.cond, &stalled.lock);
+    pthread_mutex_unlock(&stalled.lock);
+
+    /* Nothing retired while the reader is inside may be released.   */
+    for (i = 0; i < 5000; i++){
+        strs[i] = dstr_with_initial("retired");
+        dstr_incref(strs[i]);
+        dstr_rcu_defer_decref(strs[i]);
+    }
+    for (i = 0; i < 5000; i++)
+        alive += strs[i]->ref == 2;
+    CU_ASSERT_EQUAL(alive, 5000);
+
+    pthread_mutex_lock(&stalled.lock);
+    stalled.leave = 1;
+    pthread_cond_broadcast(&stalled.cond);
+    pthread_mutex_unlock(&stalled.lock);
+    pthread_join(thread, 0);
+    dstr_rcu_synchronize();
+    alive = 0;
+    for (i = 0; i < 5000; i++){
+        alive += strs[i]->ref != 1;
+        dstr_decref(strs[i]);
+    }
+    CU_ASSERT_EQUAL(alive, 0);
+    pthread_cond_destroy(&stalled.cond);
+    pthread_mutex_destroy(&stalled.lock);
+}
+
+struct rcu_publisher{
+    dstr *slot;
+    int stop;
+};
+
+void *__rcu_publisher(void *arg)
+{
+    struct rcu_publisher *publisher = arg;
+
+    while (!__atomic_load_n(&publisher->stop, __ATOMIC_ACQUIRE)){
+        dstr_rcu_publish(&publisher->slot, dstr_with_initial("churn"));
+        sched_yield();
+    }
+    return 0;
+}
+
+void test_dstr_rcu_synchronize_publisher()
+{
+    struct rcu_publisher publisher;
+    dstr *marker = dstr_with_initial("marker");
+    pthread_t thread;
+    int i;
+
+    publisher.slot = 0;
+    publisher.stop = 0;
+    pthread_create(&thread, 0, __rcu_publisher, &publisher);
+    /* Objects retired after the call must not hold synchronize up.   */
+    for (i = 0; i < 20; i++){
+        dstr_incref(marker);
+        dstr_rcu_defer_decref(marker);
+        dstr_rcu_synchronize();
+        CU_ASSERT_EQUAL(marker->ref, 1);
+    }
+    __atomic_store_n(&publisher.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, 0);
+    dstr_rcu_defer_decref(publisher.slot);
+    dstr_rcu_synchronize();
+    dstr_decref(marker);
+}
+
 /**************************** DYNAMIC STRING LIST  ****************************/
 
 void test_dstr_list_new()
@@ -542,6 +1658,28 @@ void test_dstr_list_traverse_reverse()
     dstr_list_decref(list);
 }
 
+int __traverse_delete_callback(dstr *str)
+{
+    return dstr_matches(str, "str2") || dstr_matches(str, "str3");
+}
+
+void test_dstr_list_traverse_delete()
+{
+    dstr *joined;
+    dstr_list *list = dstr_list_new();
+    dstr_list_add_decref(list, dstr_with_initial("str1"));
+    dstr_list_add_decref(list, dstr_with_initial("str2"));
+    dstr_list_add_decref(list, dstr_with_initial("str3"));
+    dstr_list_add_decref(list, dstr_with_initial("str4"));
+    dstr_list_traverse_delete(list, __traverse_delete_callback);
+
+    joined = dstr_list_to_dstr(",", list);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(joined), "str1,str4");
+    CU_ASSERT_EQUAL(dstr_list_size(list), 2);
+    dstr_decref(joined);
+    dstr_list_decref(list);
+}
+
 void test_dstr_list_size()
 {
     dstr_list *list = dstr_list_new();
@@ -552,6 +1690,49 @@ void test_dstr_list_size()
     dstr_list_decref(list);
 }
 
+void test_dstr_list_to_dstr_wrap()
+{
+    dstr_list *list = dstr_list_new();
+    dstr *joined;
+
+    joined = dstr_list_to_dstr_wrap("[", ", ", "]", list);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(joined), "[]");
+    dstr_decref(joined);
+
+    dstr_list_add_decref(list, dstr_with_initial("str1"));
+    dstr_list_add_decref(list, dstr_with_initial("str2"));
+    dstr_list_add_decref(list, dstr_with_initial("str3"));
+    joined = dstr_list_to_dstr_wrap("[", ", ", "]", list);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(joined), "[str1, str2, str3]");
+    CU_ASSERT_EQUAL(dstr_length(joined), 18);
+    CU_ASSERT_EQUAL(dstr_capacity(joined), 19);
+    dstr_decref(joined);
+    dstr_list_decref(list);
+}
+
+void test_dstr_list_writev()
+{
+    dstr_list *list = dstr_list_new();
+    FILE *fp = tmpfile();
+    dstr *written;
+    int i;
+
+    CU_ASSERT_PTR_NOT_NULL_FATAL(fp);
+    /* More elements than fits in one writev batch.   */
+    for (i = 0; i < 3000; i++)
+        dstr_list_add_decref(list, dstr_with_initial("str"));
+    CU_ASSERT(dstr_list_writev(fileno(fp), list, ", "));
+    rewind(fp);
+    written = dstr_read_all(fileno(fp));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(written);
+    CU_ASSERT_EQUAL(dstr_length(written), 3000 * 3 + 2999 * 2);
+    CU_ASSERT(dstr_starts_with(written, "str, str, str"));
+    CU_ASSERT(dstr_ends_with(written, "str, str"));
+    dstr_decref(written);
+    dstr_list_decref(list);
+    fclose(fp);
+}
+
 /************************** DYNAMIC STRING VECTOR  ****************************/
 
 void test_dstr_vector_new()
@@ -763,6 +1944,108 @@ void test_dstr_vector_size()
     dstr_vector_decref(vec);
 }
 
+void test_dstr_vector_join()
+{
+    dstr_vector *vec = dstr_vector_new();
+    dstr *joined;
+
+    dstr_vector_push_back_decref(vec, dstr_with_initial("some data"));
+    dstr_vector_push_back_decref(vec, dstr_with_initial("some more data"));
+    joined = dstr_vector_join(", ", vec);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(joined), "some data, some more data");
+    CU_ASSERT_EQUAL(dstr_capacity(joined), dstr_length(joined) + 1);
+    dstr_decref(joined);
+
+    joined = dstr_vector_join(0, vec);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(joined), "some datasome more data");
+    dstr_decref(joined);
+
+    joined = dstr_vector_join_wrap("(", "|", ")", vec);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(joined), "(some data|some more data)");
+    dstr_decref(joined);
+    dstr_vector_decref(vec);
+}
+
+void __parallel_length_callback(dstr *str, void *total)
+{
+    __atomic_add_fetch((size_t *)total, dstr_length(str), __ATOMIC_RELAXED);
+}
+
+int __parallel_odd_callback(const dstr *str, void *user_data)
+{
+    int64_t value;
+    return dstr_to_i64(str, &value) && value % 2;
+}
+
+void test_dstr_vector_parallel()
+{
+    static dstr lit = DSTR_LITERAL("7");
+    dstr_pool *pool = dstr_pool_new(4);
+    dstr_vector *vec = dstr_vector_new(), *found;
+    dstr *shared = dstr_with_initial("1");
+    size_t total = 0, i;
+    int64_t value;
+
+    CU_ASSERT_PTR_NOT_NULL_FATAL(pool);
+    for (i = 0; i < DSTR_PARALLEL_CHUNK * 5 + 7; i++){
+        dstr *str = dstr_new();
+        dstr_append_u64(str, i);
+        dstr_vector_push_back_decref(vec, str);
+    }
+    /* The same string in many places of the vector.   */
+    for (i = 0; i < 1000; i++)
+        dstr_vector_push_back(vec, shared);
+    /* Immortal strings are kept without touching their reference count.   */
+    for (i = 0; i < 10; i++)
+        dstr_vector_push_back(vec, &lit);
+
+    dstr_vector_parallel_for(pool, vec, __parallel_length_callback, &total);
+    CU_ASSERT_EQUAL(total, 91325 + 1000 + 10);
+
+    found = dstr_vector_parallel_filter(pool, vec, __parallel_odd_callback, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(found);
+    CU_ASSERT_EQUAL(dstr_vector_size(found), (DSTR_PARALLEL_CHUNK * 5 + 7) / 2 + 1010);
+    for (i = 0; i < (DSTR_PARALLEL_CHUNK * 5 + 7) / 2; i++){
+        CU_ASSERT(dstr_to_i64(dstr_vector_at(found, i), &value) && value == i * 2 + 1);
+    }
+    CU_ASSERT_EQUAL(shared->ref, 2001);
+    CU_ASSERT_EQUAL(lit.ref, DSTR_IMMORTAL_REF);
+    dstr_vector_decref(found);
+    CU_ASSERT_EQUAL(shared->ref, 1001);
+    CU_ASSERT_EQUAL(lit.ref, DSTR_IMMORTAL_REF);
+
+    found = dstr_vector_parallel_search_contains(0, vec, "999");
+    CU_ASSERT_PTR_NOT_NULL_FATAL(found);
+    CU_ASSERT_EQUAL(dstr_vector_size(found), 38);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(dstr_vector_front(found)), "999");
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(dstr_vector_back(found)), "19999");
+    dstr_vector_decref(found);
+
+    dstr_vector_decref(vec);
+    dstr_decref(shared);
+    dstr_pool_free(pool);
+}
+
+void test_dstr_vector_writev()
+{
+    dstr_vector *vec = dstr_vector_new();
+    FILE *fp = tmpfile();
+    dstr *written;
+
+    CU_ASSERT_PTR_NOT_NULL_FATAL(fp);
+    dstr_vector_push_back_decref(vec, dstr_with_initial("some data"));
+    dstr_vector_push_back_decref(vec, dstr_new());
+    dstr_vector_push_back_decref(vec, dstr_with_initial("more data"));
+    CU_ASSERT(dstr_vector_writev(fileno(fp), vec, "|"));
+    rewind(fp);
+    written = dstr_read_all(fileno(fp));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(written);
+    CU_ASSERT_STRING_EQUAL(dstr_to_cstr_const(written), "some data||more data");
+    dstr_decref(written);
+    dstr_vector_decref(vec);
+    fclose(fp);
+}
+
 void test_some_concat()
 {
     dstr *str = dstr_with_prealloc(1000);
@@ -931,6 +2214,197 @@ void test_list_decode_speed()
     printf("time used for bencoded 10000 element list to dstr_list: %d seconds %d milliseconds. ", msec/1000, msec%1000);
 }
 
+#define QUEUE_SPEED_ITEMS 400000
+
+struct queue_producer{
+    pthread_t thread;
+    dstr_queue *queue;
+    int items;
+};
+
+void *__queue_producer(void *arg)
+{
+    struct queue_producer *producer = arg;
+    int i;
+
+    for (i = 0; i < producer->items; i++){
+        dstr *str = dstr_new();
+        dstr_append_i64(str, i);
+        dstr_queue_push_decref(producer->queue, str);
+    }
+    return 0;
+}
+
+void test_queue_producer_speed()
+{
+    struct queue_producer producers[16];
+    dstr_vector *vec = dstr_vector_prealloc(4096);
+    struct timespec start, end;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n, i, received, msec;
+    dstr_queue *queue;
+
+    if (cpus < 4)
+        cpus = 4;
+    printf("\n");
+    for (n = 1; n <= 16 && n <= cpus; n *= 2){
+        queue = dstr_queue_new();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < n; i++){
+            producers[i].queue = queue;
+            producers[i].items = QUEUE_SPEED_ITEMS / n;
+            pthread_create(&producers[i].thread, 0, __queue_producer, &producers[i]);
+        }
+        received = 0;
+        while (received < QUEUE_SPEED_ITEMS / n * n){
+            received += dstr_queue_drain(queue, vec, 4096);
+            while (!dstr_vector_is_empty(vec))
+                dstr_vector_pop_back(vec);
+        }
+        for (i = 0; i < n; i++)
+            pthread_join(producers[i].thread, 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        CU_ASSERT_PTR_NULL(dstr_queue_pop(queue));
+        dstr_queue_free(queue);
+        msec = (end.tv_sec - start.tv_sec) * 1000 +
+               (end.tv_nsec - start.tv_nsec) / 1000000;
+        printf("time used for %d strings through queue with %d producers: %d seconds %d milliseconds.\n",
+               received, n, msec/1000, msec%1000);
+    }
+    dstr_vector_decref(vec);
+}
+
+#define INTERN_SPEED_ITEMS 1000000
+#define INTERN_SPEED_KEYS 10000
+
+struct intern_thread{
+    pthread_t thread;
+    dstr_intern *table;
+    dstr_vector *keys;
+    int items;
+    int seed;
+};
+
+void *__intern_thread(void *arg)
+{
+    struct intern_thread *t = arg;
+    dstr *key, *canonical;
+    int i;
+
+    for (i = 0; i < t->items; i++){
+        key = dstr_vector_at(t->keys, ((unsigned int)i * 7919 + t->seed) % INTERN_SPEED_KEYS);
+        canonical = dstr_intern_insert_cstrn(t->table, dstr_to_cstr_const(key),
+                                             dstr_length(key));
+        /* The table holds a reference, so this never frees the string and
+           does not race with other threads.   */
+        __atomic_sub_fetch(&canonical->ref, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+void test_intern_thread_speed()
+{
+    struct intern_thread threads[32];
+    dstr_vector *keys = dstr_vector_prealloc(INTERN_SPEED_KEYS);
+    struct timespec start, end;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    dstr_intern *table;
+    dstr *key;
+    int n, i, msec;
+
+    for (i = 0; i < INTERN_SPEED_KEYS; i++){
+        key = dstr_with_initial("interned key number ");
+        dstr_append_i64(key, i);
+        dstr_vector_push_back_decref(keys, key);
+    }
+    if (cpus < 4)
+        cpus = 4;
+    printf("\n");
+    for (n = 1; n <= 32 && n <= cpus; n *= 2){
+        table = dstr_intern_new(0);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < n; i++){
+            threads[i].table = table;
+            threads[i].keys = keys;
+            threads[i].items = INTERN_SPEED_ITEMS / n;
+            threads[i].seed = i;
+            pthread_create(&threads[i].thread, 0, __intern_thread, &threads[i]);
+        }
+        for (i = 0; i < n; i++)
+            pthread_join(threads[i].thread, 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        CU_ASSERT_EQUAL(dstr_intern_size(table), INTERN_SPEED_KEYS);
+        dstr_intern_free(table);
+        msec = (end.tv_sec - start.tv_sec) * 1000 +
+               (end.tv_nsec - start.tv_nsec) / 1000000;
+        printf("time used for %d interns with %d threads: %d seconds %d milliseconds.\n",
+               INTERN_SPEED_ITEMS / n * n, n, msec/1000, msec%1000);
+    }
+    dstr_vector_decref(keys);
+}
+
+struct rcu_reader{
+    pthread_t thread;
+    dstr_vector **routes;
+    int stop;
+    long reads;
+};
+
+void *__rcu_reader(void *arg)
+{
+    struct rcu_reader *reader = arg;
+    dstr_vector *vec;
+    size_t i, len;
+
+    while (!__atomic_load_n(&reader->stop, __ATOMIC_RELAXED)){
+        dstr_rcu_read_lock();
+        vec = dstr_rcu_dereference(*reader->routes);
+        for (i = 0, len = 0; i < dstr_vector_size(vec); i++)
+            len += dstr_length(dstr_vector_at(vec, i));
+        if (len != 3 * dstr_vector_size(vec))
+            abort();
+        dstr_rcu_read_unlock();
+        reader->reads++;
+    }
+    return 0;
+}
+
+void test_rcu_reload_speed()
+{
+    struct rcu_reader readers[4];
+    struct timespec start, end;
+    dstr_vector *routes = dstr_vector_new(), *vec;
+    long reads = 0;
+    int i, j, msec;
+
+    dstr_vector_push_back_decref(routes, dstr_with_initial("/v1"));
+    for (i = 0; i < 4; i++){
+        readers[i].routes = &routes;
+        readers[i].stop = 0;
+        readers[i].reads = 0;
+        pthread_create(&readers[i].thread, 0, __rcu_reader, &readers[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < 10000; i++){
+        vec = dstr_vector_prealloc(8);
+        for (j = 0; j < 8; j++)
+            dstr_vector_push_back_decref(vec, dstr_with_initial("/v2"));
+        dstr_rcu_publish_vector(&routes, vec);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (i = 0; i < 4; i++){
+        __atomic_store_n(&readers[i].stop, 1, __ATOMIC_RELAXED);
+        pthread_join(readers[i].thread, 0);
+        reads += readers[i].reads;
+    }
+    dstr_rcu_defer_vector_decref(routes);
+    dstr_rcu_synchronize();
+    msec = (end.tv_sec - start.tv_sec) * 1000 +
+           (end.tv_nsec - start.tv_nsec) / 1000000;
+    printf("time used for 10000 reloads with 4 readers (%ld reads): %d seconds %d milliseconds. ",
+           reads, msec/1000, msec%1000);
+}
+
 int main()
 {
    CU_pSuite dstr_suite, dstr_list_suite, dstr_vector_suite, typical;
@@ -976,11 +2450,24 @@ int main()
            !CU_add_test(dstr_suite, "dstr_append", test_dstr_append) ||
            !CU_add_test(dstr_suite, "dstr_append_decref", test_dstr_append_decref) ||
            !CU_add_test(dstr_suite, "dstr_append_cstr", test_dstr_append_cstr) ||
+           !CU_add_test(dstr_suite, "dstr_append_fits", test_dstr_append_fits) ||
+           !CU_add_test(dstr_suite, "dstr_append_self", test_dstr_append_self) ||
            !CU_add_test(dstr_suite, "dstr_swap", test_dstr_swap) ||
            !CU_add_test(dstr_suite, "dstr_erase", test_dstr_erase) ||
            !CU_add_test(dstr_suite, "dstr_insert", test_dstr_insert) ||
+           !CU_add_test(dstr_suite, "dstr_replace_all", test_dstr_replace_all) ||
+           !CU_add_test(dstr_suite, "dstr_trim", test_dstr_trim) ||
+           !CU_add_test(dstr_suite, "dstr_literal", test_dstr_literal) ||
+           !CU_add_test(dstr_suite, "dstr_adopt_release", test_dstr_adopt_release) ||
            !CU_add_test(dstr_suite, "dstr_empty", test_dstr_empty) ||
            !CU_add_test(dstr_suite, "dstr_sprintf", test_dstr_sprintf) ||
+           !CU_add_test(dstr_suite, "dstr_sprintf_grow", test_dstr_sprintf_grow) ||
+           !CU_add_test(dstr_suite, "dstr_append_i64", test_dstr_append_i64) ||
+           !CU_add_test(dstr_suite, "dstr_append_u64_hex", test_dstr_append_u64_hex) ||
+           !CU_add_test(dstr_suite, "dstr_append_double", test_dstr_append_double) ||
+           !CU_add_test(dstr_suite, "dstr_to_i64", test_dstr_to_i64) ||
+           !CU_add_test(dstr_suite, "dstr_to_double", test_dstr_to_double) ||
+           !CU_add_test(dstr_suite, "dstr_to_double_locale", test_dstr_to_double_locale) ||
            !CU_add_test(dstr_suite, "dstr_to_upper", test_dstr_to_upper) ||
            !CU_add_test(dstr_suite, "dstr_to_lower", test_dstr_to_lower) ||
            !CU_add_test(dstr_suite, "dstr_capitalize", test_dstr_capitalize) ||
@@ -998,6 +2485,31 @@ int main()
            !CU_add_test(dstr_suite, "dstr_split_to_vector", test_dstr_split_to_vector) ||
            !CU_add_test(dstr_suite, "dstr_split_to_list", test_dstr_split_to_list) ||
            !CU_add_test(dstr_suite, "dstr_resize", test_dstr_resize) ||
+           !CU_add_test(dstr_suite, "dstr_builder", test_dstr_builder) ||
+           !CU_add_test(dstr_suite, "dstr_builder_writev", test_dstr_builder_writev) ||
+           !CU_add_test(dstr_suite, "dstr_queue", test_dstr_queue) ||
+           !CU_add_test(dstr_suite, "dstr_intern", test_dstr_intern) ||
+           !CU_add_test(dstr_suite, "dstr_intern_literal", test_dstr_intern_literal) ||
+           !CU_add_test(dstr_suite, "dstr_rcu", test_dstr_rcu) ||
+           !CU_add_test(dstr_suite, "dstr_rcu_stalled_reader", test_dstr_rcu_stalled_reader) ||
+           !CU_add_test(dstr_suite, "dstr_rcu_synchronize_publisher", test_dstr_rcu_synchronize_publisher) ||
+#if defined(DSTR_THREAD_CACHE) && !defined(DSTR_MEM_CLEAR)
+           !CU_add_test(dstr_suite, "dstr_thread_cache", test_dstr_thread_cache) ||
+           !CU_add_test(dstr_suite, "dstr_thread_cache_exit", test_dstr_thread_cache_exit) ||
+#endif
+           !CU_add_test(dstr_suite, "dstr_utf8", test_dstr_utf8) ||
+           !CU_add_test(dstr_suite, "dstr_base64", test_dstr_base64) ||
+           !CU_add_test(dstr_suite, "dstr_hex", test_dstr_hex) ||
+           !CU_add_test(dstr_suite, "dstr_escape", test_dstr_escape) ||
+           !CU_add_test(dstr_suite, "dstr_stats", test_dstr_stats) ||
+#ifdef DSTR_PROFILE
+           !CU_add_test(dstr_suite, "dstr_profile", test_dstr_profile) ||
+#endif
+           !CU_add_test(dstr_suite, "dstr_getline", test_dstr_getline) ||
+           !CU_add_test(dstr_suite, "dstr_read_all", test_dstr_read_all) ||
+           !CU_add_test(dstr_suite, "dstr_tokenizer", test_dstr_tokenizer) ||
+           !CU_add_test(dstr_suite, "dstr_csv", test_dstr_csv) ||
+           !CU_add_test(dstr_suite, "dstr_csv_stream", test_dstr_csv_stream) ||
            !CU_add_test(dstr_suite, "dstr_dstr_to_cstr", test_dstr_to_cstr)){
       CU_cleanup_registry();
       return CU_get_error();
@@ -1009,10 +2521,13 @@ int main()
            !CU_add_test(dstr_list_suite, "dstr_incref", test_dstr_list_incref) ||
            !CU_add_test(dstr_list_suite, "dstr_list_traverse", test_dstr_list_traverse) ||
            !CU_add_test(dstr_list_suite, "dstr_list_traverse_reverse", test_dstr_list_traverse_reverse) ||
+           !CU_add_test(dstr_list_suite, "dstr_list_traverse_delete", test_dstr_list_traverse_delete) ||
            !CU_add_test(dstr_list_suite, "dstr_list_traverse_size", test_dstr_list_size) ||
            !CU_add_test(dstr_list_suite, "DSTR_LIST_FOREACH", test_dstr_list_foreach) ||
            !CU_add_test(dstr_list_suite, "dstr_list_bencode", test_dstr_list_bencode) ||
            !CU_add_test(dstr_list_suite, "dstr_list_bdecode", test_dstr_list_bdecode) ||
+           !CU_add_test(dstr_list_suite, "dstr_list_to_dstr_wrap", test_dstr_list_to_dstr_wrap) ||
+           !CU_add_test(dstr_list_suite, "dstr_list_writev", test_dstr_list_writev) ||
            !CU_add_test(dstr_list_suite, "dstr_list_append_decref", test_dstr_list_append_decref)){
       CU_cleanup_registry();
       return CU_get_error();
@@ -1032,6 +2547,9 @@ int main()
            !CU_add_test(dstr_vector_suite, "dstr_vector_out_of_bounds", test_dstr_vector_bounds_prot) ||
 #endif
            !CU_add_test(dstr_vector_suite, "dstr_vector_at", test_dstr_vector_at) ||
+           !CU_add_test(dstr_vector_suite, "dstr_vector_join", test_dstr_vector_join) ||
+           !CU_add_test(dstr_vector_suite, "dstr_vector_writev", test_dstr_vector_writev) ||
+           !CU_add_test(dstr_vector_suite, "dstr_vector_parallel", test_dstr_vector_parallel) ||
            !CU_add_test(dstr_vector_suite, "dstr_vector_remove", test_dstr_vector_remove)){
       CU_cleanup_registry();
       return CU_get_error();
@@ -1045,6 +2563,9 @@ int main()
            !CU_add_test(typical, "test_list_append_speed", test_list_append_speed) ||
            !CU_add_test(typical, "test_list_bencode_speed", test_list_bencode_speed) ||
            !CU_add_test(typical, "test_list_decode_speed", test_list_decode_speed) ||
+           !CU_add_test(typical, "test_queue_producer_speed", test_queue_producer_speed) ||
+           !CU_add_test(typical, "test_intern_thread_speed", test_intern_thread_speed) ||
+           !CU_add_test(typical, "test_rcu_reload_speed", test_rcu_reload_speed) ||
            !CU_add_test(typical, "test_diverse_things", test_diverse_things)){
       CU_cleanup_registry();
       return CU_get_error();
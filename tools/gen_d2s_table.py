@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+"""Generate src/dstr_d2s_table.h, the power of five tables of the Ryu double
+formatting in dstr_append_double.
+
+    python3 tools/gen_d2s_table.py > src/dstr_d2s_table.h
+"""
+
+POW5_INV_BITCOUNT = 125
+POW5_BITCOUNT = 125
+POW5_INV_TABLE_SIZE = 342
+POW5_TABLE_SIZE = 326
+
+LICENSE = """\
+/*  Reference counted dynamic string and string containers.
+    Copyright (C) 2012 John Abrahamsen <jhnabrhmsn@gmail.com>
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the
+    "Software"), to deal in the Software without restriction, including
+    without limitation the rights to use, copy, modify, merge, publish,
+    distribute, sublicense, and/or sell copies of the Software, and to
+    permit persons to whom the Software is furnished to do so, subject to
+    the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+    LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+    OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.   */
+"""
+
+COMMENT = """\
+/* Power of five tables used by the shortest round trip double formatting in
+   dstr_append_double (Ryu, Ulf Adams 2018). Entries are 128 bit values stored
+   as { low, high } 64 bit words:
+   __DSTR_POW5_INV_SPLIT[i] = floor(2^(bitlength(5^i) - 1 + 125) / 5^i) + 1
+   __DSTR_POW5_SPLIT[i] = the 125 most significant bits of 5^i.
+   Generated by tools/gen_d2s_table.py, do not edit.
+   Private to dstr.c, not installed.   */
+"""
+
+MASK64 = (1 << 64) - 1
+
+
+def pow5_inv(i):
+    p = 5 ** i
+    return (1 << (p.bit_length() - 1 + POW5_INV_BITCOUNT)) // p + 1
+
+
+def pow5(i):
+    p = 5 ** i
+    shift = p.bit_length() - POW5_BITCOUNT
+    return p >> shift if shift > 0 else p << -shift
+
+
+def table(name, size, values):
+    rows = ["    { %du, %du }" % (v & MASK64, v >> 64) for v in values]
+    return ("static const uint64_t %s[%s][2] = {\n%s\n};\n"
+            % (name, size, ",\n".join(rows)))
+
+
+def main():
+    out = [LICENSE, "\n", COMMENT, "\n",
+           "#ifndef _DSTR_D2S_TABLE_H\n#define _DSTR_D2S_TABLE_H 1\n\n",
+           "#define __DSTR_POW5_INV_BITCOUNT %d\n" % POW5_INV_BITCOUNT,
+           "#define __DSTR_POW5_BITCOUNT %d\n" % POW5_BITCOUNT,
+           "#define __DSTR_POW5_INV_TABLE_SIZE %d\n" % POW5_INV_TABLE_SIZE,
+           "#define __DSTR_POW5_TABLE_SIZE %d\n\n" % POW5_TABLE_SIZE,
+           table("__DSTR_POW5_INV_SPLIT", "__DSTR_POW5_INV_TABLE_SIZE",
+                 [pow5_inv(i) for i in range(POW5_INV_TABLE_SIZE)]),
+           "\n",
+           table("__DSTR_POW5_SPLIT", "__DSTR_POW5_TABLE_SIZE",
+                 [pow5(i) for i in range(POW5_TABLE_SIZE)]),
+           "\n#endif /* dstr_d2s_table.h */\n"]
+    print("".join(out), end="")
+
+
+if __name__ == "__main__":
+    main()